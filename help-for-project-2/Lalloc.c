@@ -0,0 +1,170 @@
+#include "posix-calls.h"
+#include "Llibc.h"
+#include "types.h"
+#include "Llock.h"
+#include "Lalloc.h"
+
+#define PAGESIZE 4096
+#define ALIGN16(n) (((n) + 15) & ~15UL)
+
+static void *
+map(ulong size, int flags)
+{
+  void *p = (void *) Lsyscall(SYS_mmap, 0, size, PROT_READ | PROT_WRITE,
+    MAP_PRIVATE | MAP_ANONYMOUS | flags, -1, 0);
+  return ((long) p < 0 && (long) p > -4096) ? 0 : p;
+}
+
+/*********************
+ * Arena
+ *********************/
+
+void*
+Larena_alloc(struct arena *a, ulong n)
+{
+  char *p;
+
+  if (a->base == 0) {
+    /* Reserve only:  the kernel backs pages as they are touched */
+    if ((a->base = map(LARENA_RESERVE, MAP_NORESERVE)) == 0)
+      return 0;
+    a->size = LARENA_RESERVE;
+    a->used = a->high = 0;
+  }
+  n = ALIGN16(n);
+  if (n > a->size - a->used)
+    return 0;
+  p = a->base + a->used;
+  a->used += n;
+  if (a->used > a->high)
+    a->high = a->used;
+  return p;
+}
+
+char*
+Larena_strdup(struct arena *a, const char *s)
+{
+  uint n = Lstrlen((char *) s) + 1;
+  char *p = Larena_alloc(a, n);
+
+  if (p)
+    Lmemcpy(p, s, n);
+  return p;
+}
+
+void
+Larena_reset(struct arena *a)
+{
+  if (a->high > LARENA_KEEP) {
+    Lsyscall(SYS_madvise, a->base + LARENA_KEEP, a->high - LARENA_KEEP,
+      MADV_DONTNEED);
+    a->high = LARENA_KEEP;
+  }
+  a->used = 0;
+}
+
+/*********************
+ * Size-class heap
+ *********************/
+
+/*
+  Every block has a 16-byte header just below it.  A free block of
+  class c sits on heap.free[c], linked through its first word.
+
+      class c  (LMALLOC_MINCLASS..LMALLOC_MAXCLASS):  2^c usable bytes,
+               carved from shared LHEAP_CHUNK mappings, never unmapped
+      class 0  its own mapping of hdr.size bytes, unmapped by Lfree
+*/
+#define LHEAP_CHUNK (64*1024)
+
+struct lhdr {
+  ulong class;
+  ulong size;     // Mapping size (class 0 only)
+};
+
+struct lfree {
+  struct lfree *next;
+};
+
+static struct {
+  struct spinlock lock;
+  int init;
+  struct lfree *free[LMALLOC_MAXCLASS+1];
+  char *chunk;          // Uncarved rest of the current chunk
+  ulong left;
+} heap;
+
+static int
+size_class(ulong n)
+{
+  int c = LMALLOC_MINCLASS;
+
+  while ((1UL << c) < n)
+    c++;
+  return c;
+}
+
+void*
+Lmalloc(ulong n)
+{
+  struct lhdr *h;
+
+  if (n > (1UL << LMALLOC_MAXCLASS)) {
+    ulong size = (sizeof(struct lhdr) + n + PAGESIZE - 1) & ~(ulong) (PAGESIZE - 1);
+    if ((h = map(size, 0)) == 0)
+      return 0;
+    h->class = 0;
+    h->size = size;
+    return h + 1;
+  }
+
+  int c = size_class(n);
+  ulong need = sizeof(struct lhdr) + (1UL << c);
+
+  if (!__atomic_load_n(&heap.init, __ATOMIC_ACQUIRE)) {
+    /* A spinlock of all zeroes is a free one, so this is race-free */
+    initlock(&heap.lock, "heap");
+    __atomic_store_n(&heap.init, 1, __ATOMIC_RELEASE);
+  }
+  acquire(&heap.lock);
+  if (heap.free[c] != 0) {
+    struct lfree *f = heap.free[c];
+    heap.free[c] = f->next;
+    release(&heap.lock);
+    return f;
+  }
+  if (heap.left < need) {
+    /* The tail of the old chunk is dropped:  under 4 KiB, rare */
+    if ((heap.chunk = map(LHEAP_CHUNK, 0)) == 0) {
+      heap.left = 0;
+      release(&heap.lock);
+      return 0;
+    }
+    heap.left = LHEAP_CHUNK;
+  }
+  h = (struct lhdr *) heap.chunk;
+  heap.chunk += need;
+  heap.left -= need;
+  release(&heap.lock);
+  h->class = c;
+  return h + 1;
+}
+
+void
+Lfree(void *p)
+{
+  struct lhdr *h;
+  struct lfree *f = p;
+
+  if (p == 0)
+    return;
+  h = (struct lhdr *) p - 1;
+  if (h->class == 0) {
+    Lsyscall(SYS_munmap, h, h->size);
+    return;
+  }
+  acquire(&heap.lock);
+  f->next = heap.free[h->class];
+  heap.free[h->class] = f;
+  release(&heap.lock);
+}
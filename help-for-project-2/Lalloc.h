@@ -0,0 +1,62 @@
+/*
+
+File Lalloc.h
+
+Memory allocation for -nostdlib Llibc programs (Lalloc.c), in place
+of big fixed arrays.  All memory comes straight from mmap; Lsbrk is
+not used.
+
+    arena   bump allocation into one large lazily-backed mapping;
+            nothing is freed singly, the whole arena is reset at once
+            (Lcli resets cmdarena after every command)
+
+    heap    Lmalloc/Lfree with power-of-two size classes, 16 B to
+            4 KiB, each with its own free list, for objects that
+            outlive a command (per-client CWD stacks, caches).
+            Larger requests get their own mapping.
+
+*/
+
+#ifndef LALLOC_H
+#define LALLOC_H
+
+#define LARENA_RESERVE  (16*1024*1024)  /* Address space, not memory */
+#define LARENA_KEEP     (256*1024)      /* Kept mapped across resets */
+
+struct arena {
+  char *base;       // Start of the mapping, 0 until first use
+  unsigned long size;       // Bytes reserved
+  unsigned long used;       // Bump pointer (offset from base)
+  unsigned long high;       // Most ever used since the last trim
+};
+
+void*   Larena_alloc(struct arena *a, unsigned long n);
+/*
+  Return n bytes, 16-byte aligned, or 0 when the reservation is used
+  up.  O(1):  just a bump of a->used (the first call maps the arena).
+*/
+
+char*   Larena_strdup(struct arena *a, const char *s);
+
+void    Larena_reset(struct arena *a);
+/*
+  Free everything in a at once.  Pages past LARENA_KEEP are handed
+  back to the kernel, so one big command does not pin memory.
+*/
+
+#define LMALLOC_MINCLASS 4              /* 16 bytes */
+#define LMALLOC_MAXCLASS 12             /* 4096 bytes */
+
+void*   Lmalloc(unsigned long n);
+/*
+  Return n bytes, 16-byte aligned, or 0.  Thread-safe.
+*/
+
+void    Lfree(void *p);
+/*
+  Give back memory from Lmalloc (or 0).  Thread-safe.
+*/
+
+extern struct arena cmdarena;   /* Lcli.c:  reset after each command */
+
+#endif
@@ -0,0 +1,103 @@
+/*
+
+File Lbench-aio.c
+
+Batched disk I/O benchmark:  the same random block reads done with the
+synchronous disk_block_rw() and with disk_block_rw_batch() at queue
+depths 1, 2, 4, ... 64.  The batch engine is io_uring when the kernel
+allows it, otherwise preadv/pwritev (the engine is printed).
+
+Usage:  Lbench-aio fs.img [reads]
+
+*/
+
+#include "posix-calls.h"
+#include "Llibc.h"
+#include "types.h"
+#include "param.h"
+#include "fs.h"
+#include "buf.h"
+#include "Ldiskio.h"
+
+#define MAXDEPTH 64
+
+struct buf bufs[MAXDEPTH];
+uchar bufdata[MAXDEPTH][BSIZE] __attribute__((aligned(4096)));    // bufs[i].data
+struct buf *batch[MAXDEPTH];
+
+long
+now_usec(void)
+{
+	struct timespec ts;
+
+	Lsyscall(SYS_clock_gettime, CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+void
+report(const char *engine, int depth, int reads, long us, int fails)
+{
+	if (us == 0)
+		us = 1;
+	Lprintf("engine=%s depth=%d reads=%d usec=%d kiops=%d fails=%d\n",
+		engine, depth, reads, (int) us, (int) ((long) reads * 1000 / us), fails);
+}
+
+int
+Lmain(int argc, char *argv[])
+{
+	int fd, reads = 20000, fails;
+	uint nblocks, seed;
+	long t0;
+
+	if (argc < 2) {
+		Lprintf("Usage:  %s fs_img_path [reads]\n", argv[0]);
+		return 1;
+	}
+	if (argc > 2)
+		reads = Latoi(argv[2]);
+	if ((fd = Lopen(argv[1], O_RDONLY)) < 0) {
+		Lfprintf(2, "Could not open %s\n", argv[1]);
+		return 2;
+	}
+	nblocks = Llseek(fd, 0, SEEK_END) / BSIZE;
+	for (int i = 0; i < MAXDEPTH; i++) {
+		bufs[i].dev_fd = fd;
+		bufs[i].data = bufdata[i];
+	}
+
+	/* Baseline:  one synchronous block at a time */
+	seed = 1;
+	fails = 0;
+	t0 = now_usec();
+	for (int i = 0; i < reads; i++) {
+		seed = seed * 1103515245 + 12345;
+		bufs[0].blockno = (seed >> 8) % nblocks;
+		disk_block_rw(&bufs[0], 0);
+		fails += bufs[0].disk_rw_fail;
+	}
+	report("sync", 1, reads, now_usec() - t0, fails);
+
+	int mode = disk_aio_init(MAXDEPTH);
+	const char *engine = mode == DISK_AIO_URING ? "io_uring" : "vectored";
+	if (mode == DISK_AIO_URING && disk_aio_register(bufs, MAXDEPTH) == 0)
+		engine = "io_uring-fixed";
+
+	for (int depth = 1; depth <= MAXDEPTH; depth *= 2) {
+		seed = 1;
+		fails = 0;
+		t0 = now_usec();
+		for (int i = 0; i < reads; i += depth) {
+			for (int k = 0; k < depth; k++) {
+				seed = seed * 1103515245 + 12345;
+				bufs[k].blockno = (seed >> 8) % nblocks;
+				batch[k] = &bufs[k];
+			}
+			disk_block_rw_batch(batch, depth, 0);
+			for (int k = 0; k < depth; k++)
+				fails += bufs[k].disk_rw_fail;
+		}
+		report(engine, depth, reads, now_usec() - t0, fails);
+	}
+	return 0;
+}
@@ -0,0 +1,130 @@
+/*
+
+File Lbench-bcache.c
+
+Buffer cache scalability benchmark.  For 1, 2, 4, 8 and 16 threads,
+each thread does a fixed number of bread()/brelse() pairs on
+pseudo-random blocks, in two workloads:
+
+    hot    working set of NBUF/2 blocks:  nearly all hits
+    cold   working set of the whole image:  mostly misses and I/O
+
+and the aggregate throughput is printed per thread count.
+
+Usage:  Lbench-bcache fs.img [ops-per-thread]
+
+*/
+
+#include "posix-calls.h"
+#include "Llibc.h"
+#include "types.h"
+#include "param.h"
+#include "fs.h"
+#include "buf.h"
+#include "Lthread.h"
+
+#define MAXTHREADS 16
+
+/* From Lbio.c */
+void binit(void);
+struct buf* bread(uint, uint);
+void brelse(struct buf*);
+
+struct worker {
+	Lthread t;
+	uint seed;
+	uint nblocks;
+	int ops;
+	int failed;
+};
+
+int devfd;
+struct worker workers[MAXTHREADS];
+
+long
+now_usec(void)
+{
+	struct timespec ts;
+
+	Lsyscall(SYS_clock_gettime, CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+int
+work(void *arg)
+{
+	struct worker *w = arg;
+	struct buf *b;
+
+	for (int i = 0; i < w->ops; i++) {
+		w->seed = w->seed * 1103515245 + 12345;
+		if ((b = bread(devfd, (w->seed >> 8) % w->nblocks)) == 0) {
+			w->failed++;
+			continue;
+		}
+		brelse(b);
+	}
+	return 0;
+}
+
+/* Run nthreads workers; returns elapsed usec, or -1 */
+long
+run(int nthreads, uint nblocks, int ops)
+{
+	long t0 = now_usec();
+
+	for (int i = 0; i < nthreads; i++) {
+		struct worker *w = &workers[i];
+		w->seed = i + 1;
+		w->nblocks = nblocks;
+		w->ops = ops;
+		w->failed = 0;
+		if (Lthread_create(&w->t, work, w) < 0)
+			return -1;
+	}
+	for (int i = 0; i < nthreads; i++)
+		Lthread_join(&workers[i].t);
+	long elapsed = now_usec() - t0;
+
+	for (int i = 0; i < nthreads; i++)
+		if (workers[i].failed)
+			Lfprintf(2, "thread %d: %d bread failures\n", i, workers[i].failed);
+	return elapsed;
+}
+
+int
+Lmain(int argc, char *argv[])
+{
+	int ops = 100000;
+	uint nblocks;
+
+	if (argc < 2) {
+		Lprintf("Usage:  %s fs_img_path [ops-per-thread]\n", argv[0]);
+		return 1;
+	}
+	if (argc > 2)
+		ops = Latoi(argv[2]);
+	if ((devfd = Lopen(argv[1], O_RDONLY)) < 0) {
+		Lfprintf(2, "Could not open %s\n", argv[1]);
+		return 2;
+	}
+	nblocks = Llseek(devfd, 0, SEEK_END) / BSIZE;
+	binit();
+
+	const char *names[2] = { "hot", "cold" };
+	uint sets[2] = { NBUF / 2, nblocks };
+	for (int k = 0; k < 2; k++) {
+		for (int t = 1; t <= MAXTHREADS; t *= 2) {
+			long us = run(t, sets[k], ops);
+			if (us < 0) {
+				Lfprintf(2, "could not start threads\n");
+				return 3;
+			}
+			if (us == 0)
+				us = 1;
+			Lprintf("workload=%s threads=%d ops=%d usec=%d kops_per_sec=%d\n",
+				names[k], t, t * ops, (int) us, (int) ((long) t * ops * 1000 / us));
+		}
+	}
+	return 0;
+}
@@ -0,0 +1,289 @@
+/*
+
+File Lbench-fs.c
+
+File system workload benchmark for Lcli.  For each workload, the image
+is copied to a scratch file, a command script is generated, and
+
+    Lcli --stats-json scratch < script > /dev/null 2> json
+
+is run and timed.  One JSON object per line is printed:
+
+    {"image":"bench-small.img","workload":"namei","ops":200,
+     "usec":5120,"usec_per_op":25,"lcli":{...}}
+
+where "lcli" is Lcli's own counters and per-command latency histograms
+(see Lstats.h).  The "startup" workload only runs quit, so its time is
+the fixed cost included in all the others.  "mixed" runs a lookup after
+each download:  its path histogram, against the one from "namei",
+shows how much bulk data traffic slows lookups down.
+
+The image should come from Lmkfs, so that /d0/.../d0/f0 (depth
+levels) exists.
+
+Usage:  Lbench-fs ./Lcli image depth [ops]
+
+*/
+
+#include "posix-calls.h"
+#include "Llibc.h"
+
+#define SCRATCH  "Lbench-fs.scratch"
+#define SCRIPT   "Lbench-fs.cmds"
+#define JSONOUT  "Lbench-fs.json"
+#define HOSTIN   "Lbench-fs.in"
+#define HOSTOUT  "Lbench-fs.out"
+#define HOSTSIZE (16 * 1024)    /* Bytes per download */
+#define JSONMAX  (64 * 1024)
+
+char deep[256];         // /d0/d0/.../f0
+char iobuf[64 * 1024];
+char json[JSONMAX];
+
+long
+now_usec(void)
+{
+	struct timespec ts;
+
+	Lsyscall(SYS_clock_gettime, CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+/* Script generators:  write the commands for n ops to fd */
+
+void
+gen_startup(int fd, int n)
+{
+}
+
+void
+gen_namei(int fd, int n)
+{
+	for (int i = 0; i < n; i++)
+		Lfprintf(fd, "path %s\n", deep);
+}
+
+void
+gen_ls(int fd, int n)
+{
+	for (int i = 0; i < n; i++)
+		Lfprintf(fd, "ls /d0\n");
+}
+
+void
+gen_lsr(int fd, int n)
+{
+	for (int i = 0; i < n; i++)
+		Lfprintf(fd, "ls -R /\n");
+}
+
+void
+gen_creat(int fd, int n)
+{
+	Lfprintf(fd, "mkdir /cstorm\ncd cstorm\n");
+	for (int i = 0; i < n; i++)
+		Lfprintf(fd, "creat s%d\n", i);
+}
+
+void
+gen_mkdir(int fd, int n)
+{
+	Lfprintf(fd, "mkdir /mstorm\n");
+	for (int i = 0; i < n; i++)
+		Lfprintf(fd, "mkdir /mstorm/d%d\n", i);
+}
+
+void
+gen_upload(int fd, int n)
+{
+	for (int i = 0; i < n; i++)
+		Lfprintf(fd, "upload %s %s\n", deep, HOSTOUT);
+}
+
+void
+gen_download(int fd, int n)
+{
+	for (int i = 0; i < n; i++)
+		Lfprintf(fd, "download %s /dl%d\n", HOSTIN, i);
+}
+
+/* Lookups between bulk downloads (well over NBUF blocks each) */
+void
+gen_mixed(int fd, int n)
+{
+	for (int i = 0; i < n; i++) {
+		for (int k = 0; k < 4; k++)
+			Lfprintf(fd, "download %s /mix%d\n", HOSTIN, k);
+		Lfprintf(fd, "path %s\n", deep);
+	}
+}
+
+void
+gen_sync(int fd, int n)
+{
+	Lfprintf(fd, "mkdir /sstorm\ncd sstorm\n");
+	for (int i = 0; i < n; i++)
+		Lfprintf(fd, "creat y%d\nsync\n", i);
+}
+
+struct workload {
+	char *name;
+	void (*gen)(int fd, int n);
+	int div;        // ops = n / div, for the costly ones
+} workloads[] = {
+	{ "startup",  gen_startup,  0 },
+	{ "namei",    gen_namei,    1 },
+	{ "ls",       gen_ls,       1 },
+	{ "ls-R",     gen_lsr,      20 },
+	{ "creat",    gen_creat,    1 },
+	{ "mkdir",    gen_mkdir,    2 },
+	{ "upload",   gen_upload,   1 },
+	{ "download", gen_download, 4 },
+	{ "mixed",    gen_mixed,    4 },
+	{ "sync",     gen_sync,     2 },
+};
+
+int
+copy_file(char *from, char *to)
+{
+	int in, out;
+	long n;
+
+	if ((in = Lopen(from, O_RDONLY)) < 0)
+		return -1;
+	if ((out = Lopen(to, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+		Lclose(in);
+		return -1;
+	}
+	while ((n = Lread(in, iobuf, sizeof(iobuf))) > 0)
+		Lwrite(out, iobuf, n);
+	Lclose(in);
+	Lclose(out);
+	return n < 0 ? -1 : 0;
+}
+
+/* HOSTIN:  HOSTSIZE bytes of pseudo-random data */
+int
+make_hostin(void)
+{
+	unsigned int x = 1;
+	int fd;
+
+	for (int i = 0; i < HOSTSIZE; i++) {
+		x = x * 1103515245 + 12345;
+		iobuf[i] = x >> 16;
+	}
+	if ((fd = Lopen(HOSTIN, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+		return -1;
+	Lwrite(fd, iobuf, HOSTSIZE);
+	Lclose(fd);
+	return 0;
+}
+
+/* Run cli on SCRATCH with SCRIPT as input; returns usec, or -1 if it
+   could not be run or did not exit with status 0 */
+long
+run_cli(char *cli)
+{
+	int pid, status;
+	char *args[4];
+	long t0;
+
+	t0 = now_usec();
+	if ((pid = Lfork()) == 0) {
+		int in = Lopen(SCRIPT, O_RDONLY);
+		int out = Lopen("/dev/null", O_WRONLY);
+		int err = Lopen(JSONOUT, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (in < 0 || out < 0 || err < 0)
+			Lexit(126);
+		Ldup2(in, 0);
+		Ldup2(out, 1);
+		Ldup2(err, 2);
+		args[0] = cli;
+		args[1] = "--stats-json";
+		args[2] = SCRATCH;
+		args[3] = 0;
+		Lexec(cli, args);
+		Lexit(127);
+	}
+	if (pid < 0)
+		return -1;
+	if (Lwait(&status) < 0 || (status & 0x7f) != 0 || (status >> 8 & 0xff) != 0)
+		return -1;
+	return now_usec() - t0;
+}
+
+/* JSONOUT into json[], without the trailing newline; "null" if empty */
+void
+read_json(void)
+{
+	int fd, len = 0;
+	long n;
+
+	if ((fd = Lopen(JSONOUT, O_RDONLY)) >= 0) {
+		while (len < JSONMAX - 1 && (n = Lread(fd, json + len, JSONMAX - 1 - len)) > 0)
+			len += n;
+		Lclose(fd);
+	}
+	while (len > 0 && (json[len - 1] == '\n' || json[len - 1] == ' '))
+		len--;
+	json[len] = 0;
+	if (len == 0 || json[0] != '{')
+		Lstrcpy(json, "null");
+}
+
+int
+Lmain(int argc, char *argv[])
+{
+	int depth, ops = 200;
+
+	if (argc < 4) {
+		Lprintf("Usage:  %s Lcli image depth [ops]\n", argv[0]);
+		return 1;
+	}
+	depth = Latoi(argv[3]);
+	if (argc > 4)
+		ops = Latoi(argv[4]);
+	if (ops < 1)
+		ops = 200;
+	if (depth < 0 || depth * 3 + 4 > sizeof(deep))
+		depth = 0;
+	deep[0] = 0;
+	for (int i = 0; i < depth; i++)
+		Lstrcpy(deep + Lstrlen(deep), "/d0");
+	Lstrcpy(deep + Lstrlen(deep), "/f0");
+	if (make_hostin() < 0) {
+		Lfprintf(2, "Could not create %s\n", HOSTIN);
+		return 2;
+	}
+
+	for (int w = 0; w < sizeof(workloads) / sizeof(workloads[0]); w++) {
+		struct workload *wl = &workloads[w];
+		int n = wl->div ? ops / wl->div : 1, fd;
+		long us;
+
+		if (n < 1)
+			n = 1;
+		if (copy_file(argv[2], SCRATCH) < 0
+				|| (fd = Lopen(SCRIPT, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+			Lfprintf(2, "Could not set up %s\n", wl->name);
+			return 2;
+		}
+		wl->gen(fd, n);
+		Lfprintf(fd, "quit\n");
+		Lclose(fd);
+		if ((us = run_cli(argv[1])) < 0) {
+			Lfprintf(2, "%s failed on workload %s\n", argv[1], wl->name);
+			return 2;
+		}
+		read_json();
+		Lprintf("{\"image\":\"%s\",\"workload\":\"%s\",\"ops\":%d,\"usec\":%d,\"usec_per_op\":%d,\"lcli\":%s}\n",
+			argv[2], wl->name, n, (int)us, (int)(us / n), json);
+	}
+	Lunlink(SCRATCH);
+	Lunlink(SCRIPT);
+	Lunlink(JSONOUT);
+	Lunlink(HOSTIN);
+	Lunlink(HOSTOUT);
+	return 0;
+}
@@ -0,0 +1,161 @@
+/*
+
+File Lbench-mem.c
+
+Microbenchmark for Lmem.c.  For sizes 16 B to 64 KiB (powers of two)
+times memcpy (aligned, and with the source 3 bytes off), an
+overlapping memmove, memset and memcmp of equal buffers (a full scan),
+each with:
+
+    byte   the plain byte loops lib4490.a used to have
+    word   Lmem.c's 64-bit word loops
+    rvv    Lmem-riscv64.S, if the CPU has the V extension
+
+and prints one line per (op, variant, size).
+
+Usage:  Lbench-mem [bytes-per-test]
+
+*/
+
+#include "posix-calls.h"
+#include "Llibc.h"
+#include "types.h"
+#include "Lmem.h"
+
+#define MINSIZE 16
+#define MAXSIZE (64 * 1024)
+
+char bufa[MAXSIZE + 64];
+char bufb[MAXSIZE + 64];
+
+long
+now_usec(void)
+{
+	struct timespec ts;
+
+	Lsyscall(SYS_clock_gettime, CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+/* The byte loops, as a baseline */
+void *
+byte_memcpy(void *dst, const void *src, uint n)
+{
+	char *d = dst;
+	const char *s = src;
+
+	while (n-- > 0)
+		*d++ = *s++;
+	return dst;
+}
+
+void *
+byte_memmove(void *dst, const void *src, uint n)
+{
+	char *d = dst;
+	const char *s = src;
+
+	if (s < d && s + n > d) {
+		d += n;
+		s += n;
+		while (n-- > 0)
+			*--d = *--s;
+	} else
+		while (n-- > 0)
+			*d++ = *s++;
+	return dst;
+}
+
+void *
+byte_memset(void *dst, int c, uint n)
+{
+	char *d = dst;
+
+	while (n-- > 0)
+		*d++ = c;
+	return dst;
+}
+
+int
+byte_memcmp(const void *s1, const void *s2, uint n)
+{
+	const uchar *a = s1, *b = s2;
+
+	for (; n > 0; n--, a++, b++)
+		if (*a != *b)
+			return *a - *b;
+	return 0;
+}
+
+enum { CPY, CPYU, MOVE, SET, CMP, NOPS };
+const char *opnames[NOPS] = { "memcpy", "memcpy-unaligned", "memmove", "memset", "memcmp" };
+
+/* One call of op on n bytes, with byte loops or the Lmem functions */
+int
+one(int op, int byte, uint n)
+{
+	switch (op) {
+	case CPY:
+		byte ? byte_memcpy(bufa, bufb, n) : Lmemcpy(bufa, bufb, n);
+		break;
+	case CPYU:
+		byte ? byte_memcpy(bufa, bufb + 3, n) : Lmemcpy(bufa, bufb + 3, n);
+		break;
+	case MOVE:
+		byte ? byte_memmove(bufa + 8, bufa, n) : Lmemmove(bufa + 8, bufa, n);
+		break;
+	case SET:
+		byte ? byte_memset(bufa, op, n) : Lmemset(bufa, op, n);
+		break;
+	case CMP:
+		return byte ? byte_memcmp(bufa, bufb, n) : Lmemcmp(bufa, bufb, n);
+	}
+	return 0;
+}
+
+void
+bench(int op, const char *vname, int byte, long total)
+{
+	for (uint n = MINSIZE; n <= MAXSIZE; n *= 2) {
+		long iters = total / n;
+		int sink = 0;
+
+		if (op == CMP)
+			byte_memcpy(bufb, bufa, n);	/* Equal, so the whole buffer is read */
+		long t0 = now_usec();
+		for (long i = 0; i < iters; i++)
+			sink |= one(op, byte, n);
+		long us = now_usec() - t0;
+		if (us == 0)
+			us = 1;
+		Lprintf("op=%s variant=%s size=%d iters=%d usec=%d ns_per_op=%d mb_per_sec=%d%s\n",
+			opnames[op], vname, n, (int) iters, (int) us,
+			(int) (us * 1000 / iters), (int) (iters * n / us),
+			sink ? " MISMATCH" : "");
+	}
+}
+
+int
+Lmain(int argc, char *argv[])
+{
+	long total = 64L * 1024 * 1024;
+	int hasrvv = Lmem_variant() == LMEM_RVV;
+
+	if (argc > 1)
+		total = Latoi(argv[1]);
+	if (total < MAXSIZE)
+		total = MAXSIZE;
+	for (int i = 0; i < sizeof(bufb); i++)
+		bufb[i] = i * 7;
+
+	for (int op = 0; op < NOPS; op++) {
+		bench(op, "byte", 1, total);
+		Lmem_force(LMEM_WORD);
+		bench(op, "word", 0, total);
+		if (hasrvv) {
+			Lmem_force(LMEM_RVV);
+			bench(op, "rvv", 0, total);
+		}
+	}
+	return 0;
+}
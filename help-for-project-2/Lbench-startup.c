@@ -0,0 +1,140 @@
+/*
+
+File Lbench-startup.c
+
+Startup-latency benchmark for Lcli.  Each run forks and execs the CLI
+on the given image with its stdin/stdout on pipes, and measures:
+
+    exec -> first prompt          (time until "> " is printed)
+    exec -> first command result  (time until the output of "pwd" arrives)
+
+Usage:  Lbench-startup ./Lcli fs.img [runs]
+
+*/
+
+#include "posix-calls.h"
+#include "Llibc.h"
+
+#define PROMPT_TAIL "> "
+#define MAXRUNS 1000
+#define OUTSIZE 4096
+
+long
+now_usec(void)
+{
+	struct timespec ts;
+
+	Lsyscall(SYS_clock_gettime, CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+/* Read from fd until the accumulated output ends with the prompt */
+int
+wait_prompt(int fd, char *out, int *len)
+{
+	long n;
+	int plen = Lstrlen(PROMPT_TAIL);
+
+	for (;;) {
+		if (*len >= plen && Lmemcmp(out + *len - plen, PROMPT_TAIL, plen) == 0)
+			return 0;
+		if (*len >= OUTSIZE - 1)
+			*len = 0;	/* Only the tail matters */
+		if ((n = Lread(fd, out + *len, OUTSIZE - 1 - *len)) <= 0)
+			return -1;
+		*len += n;
+	}
+}
+
+/* One run; returns 0 and fills the two latencies (usec) on success */
+int
+run_once(char *cli, char *img, long *to_prompt, long *to_result)
+{
+	int in[2], out[2], pid, status, len = 0;
+	char buf[OUTSIZE];
+	char *args[3];
+	long t0;
+
+	if (Lpipe(in) < 0 || Lpipe(out) < 0)
+		return -1;
+	t0 = now_usec();
+	if ((pid = Lfork()) == 0) {
+		Ldup2(in[0], 0);
+		Ldup2(out[1], 1);
+		Lclose(in[0]); Lclose(in[1]);
+		Lclose(out[0]); Lclose(out[1]);
+		args[0] = cli;
+		args[1] = img;
+		args[2] = 0;
+		Lexec(cli, args);
+		Lexit(127);
+	}
+	Lclose(in[0]);
+	Lclose(out[1]);
+
+	int rc = wait_prompt(out[0], buf, &len);
+	*to_prompt = now_usec() - t0;
+	if (rc == 0) {
+		Lwrite(in[1], "pwd\n", 4);
+		len = 0;
+		rc = wait_prompt(out[0], buf, &len);
+		*to_result = now_usec() - t0;
+		Lwrite(in[1], "quit\n", 5);
+	}
+	Lclose(in[1]);
+	Lclose(out[0]);
+	Lwait(&status);
+	return rc;
+}
+
+void
+sort(long *a, int n)
+{
+	for (int i = 1; i < n; i++) {
+		long v = a[i];
+		int j = i - 1;
+		for (; j >= 0 && a[j] > v; j--)
+			a[j + 1] = a[j];
+		a[j + 1] = v;
+	}
+}
+
+void
+report(const char *what, long *a, int n)
+{
+	long sum = 0;
+
+	sort(a, n);
+	for (int i = 0; i < n; i++)
+		sum += a[i];
+	Lprintf("%s: runs=%d min=%dus median=%dus mean=%dus max=%dus\n", what, n,
+		(int)a[0], (int)a[n / 2], (int)(sum / n), (int)a[n - 1]);
+}
+
+long prompt_us[MAXRUNS];
+long result_us[MAXRUNS];
+
+int
+Lmain(int argc, char *argv[])
+{
+	int runs = 20;
+
+	if (argc < 3) {
+		Lprintf("Usage:  %s Lcli fs_img_path [runs]\n", argv[0]);
+		return 1;
+	}
+	if (argc > 3)
+		runs = Latoi(argv[3]);
+	if (runs < 1 || runs > MAXRUNS)
+		runs = 20;
+
+	for (int i = 0; i < runs; i++) {
+		if (run_once(argv[1], argv[2], &prompt_us[i], &result_us[i]) < 0) {
+			Lfprintf(2, "run %d failed\n", i);
+			return 2;
+		}
+	}
+	report("exec->first prompt", prompt_us, runs);
+	report("exec->first result", result_us, runs);
+	return 0;
+}
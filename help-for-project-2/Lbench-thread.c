@@ -0,0 +1,220 @@
+/*
+
+File Lbench-thread.c
+
+Threading runtime benchmark (Lthread.c), and a check of its results.
+For 1, 2, 4, 8 and 16 threads:
+
+    pool     Lpool_submit() of small tasks from the main thread, then
+             Lpool_wait():  every task must have run exactly once
+    mutex    every thread adds to one counter under one Lmutex:  the
+             total must come out exact
+    cond     pairs of threads pass a token back and forth through an
+             Lmutex and two Lconds (at 1 thread, with the main thread)
+
+and the throughput is printed per workload and thread count.  Exits
+with 4 if any count comes out wrong.
+
+Usage:  Lbench-thread [ops]
+
+*/
+
+#include "posix-calls.h"
+#include "Llibc.h"
+#include "Lthread.h"
+
+#define MAXTHREADS 16
+
+struct worker {
+	Lthread t;
+	int id;
+	int ops;
+};
+
+struct worker workers[MAXTHREADS];
+Lpool pool;
+Lmutex mu;
+long total;
+long tasksum;
+int bad;
+
+/* One ping-pong pair:  turn says whose move it is */
+struct pair {
+	Lmutex m;
+	Lcond cv[2];
+	int turn;
+	int ops;
+	int moves;
+} pairs[MAXTHREADS / 2 + 1];
+
+long
+now_usec(void)
+{
+	struct timespec ts;
+
+	Lsyscall(SYS_clock_gettime, CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+void
+task(void *arg)
+{
+	__atomic_add_fetch(&tasksum, (long) arg, __ATOMIC_RELAXED);
+}
+
+int
+locker(void *arg)
+{
+	struct worker *w = arg;
+
+	for (int i = 0; i < w->ops; i++) {
+		Lmutex_lock(&mu);
+		total++;
+		Lmutex_unlock(&mu);
+	}
+	return 0;
+}
+
+/* Side me of pair p:  wait for the turn, pass it, ops times */
+int
+player(struct pair *p, int me)
+{
+	Lmutex_lock(&p->m);
+	for (int i = 0; i < p->ops; i++) {
+		while (p->turn != me)
+			Lcond_wait(&p->cv[me], &p->m);
+		p->turn = !me;
+		p->moves++;
+		Lcond_signal(&p->cv[!me]);
+	}
+	Lmutex_unlock(&p->m);
+	return 0;
+}
+
+int
+pinger(void *arg)
+{
+	struct worker *w = arg;
+
+	return player(&pairs[w->id / 2], w->id % 2);
+}
+
+/* Lpool:  ops tasks on nthreads workers; returns elapsed usec, or -1 */
+long
+run_pool(int nthreads, int ops)
+{
+	long want = (long) ops * (ops + 1) / 2;	/* Each i once */
+	long t0 = now_usec();
+
+	tasksum = 0;
+	if (Lpool_init(&pool, nthreads) < 0)
+		return -1;
+	for (long i = 1; i <= ops; i++)
+		Lpool_submit(&pool, task, (void *) i);
+	Lpool_wait(&pool);
+	long elapsed = now_usec() - t0;
+	Lpool_destroy(&pool);
+
+	if (tasksum != want) {
+		Lfprintf(2, "pool: task sum off by %d\n", (int) (tasksum - want));
+		bad = 1;
+	}
+	return elapsed;
+}
+
+/* Start nthreads threads running fn; returns elapsed usec, or -1 */
+long
+run(int (*fn)(void *), int nthreads, int ops)
+{
+	long t0 = now_usec();
+
+	for (int i = 0; i < nthreads; i++) {
+		workers[i].id = i;
+		workers[i].ops = ops;
+		if (Lthread_create(&workers[i].t, fn, &workers[i]) < 0)
+			return -1;
+	}
+	for (int i = 0; i < nthreads; i++)
+		Lthread_join(&workers[i].t);
+	return now_usec() - t0;
+}
+
+long
+run_mutex(int nthreads, int ops)
+{
+	total = 0;
+	Lmutex_init(&mu);
+	long us = run(locker, nthreads, ops);
+	if (us >= 0 && total != (long) nthreads * ops) {
+		Lfprintf(2, "mutex: total %d, want %d\n", (int) total, nthreads * ops);
+		bad = 1;
+	}
+	return us;
+}
+
+/* Round trips:  nthreads/2 pairs, or one with the main thread */
+long
+run_cond(int nthreads, int ops)
+{
+	int npairs = nthreads > 1 ? nthreads / 2 : 1;
+	long us;
+
+	for (int i = 0; i < npairs; i++) {
+		Lmutex_init(&pairs[i].m);
+		Lcond_init(&pairs[i].cv[0]);
+		Lcond_init(&pairs[i].cv[1]);
+		pairs[i].turn = 0;
+		pairs[i].ops = ops;
+		pairs[i].moves = 0;
+	}
+	if (nthreads > 1)
+		us = run(pinger, npairs * 2, ops);
+	else {
+		long t0 = now_usec();
+		workers[1].id = 1;
+		if (Lthread_create(&workers[1].t, pinger, &workers[1]) < 0)
+			return -1;
+		player(&pairs[0], 0);
+		Lthread_join(&workers[1].t);
+		us = now_usec() - t0;
+	}
+	for (int i = 0; us >= 0 && i < npairs; i++) {
+		if (pairs[i].moves != 2 * ops) {
+			Lfprintf(2, "cond: pair %d made %d moves, want %d\n", i, pairs[i].moves, 2 * ops);
+			bad = 1;
+		}
+	}
+	return us;
+}
+
+int
+Lmain(int argc, char *argv[])
+{
+	int ops = 100000;
+
+	if (argc > 1)
+		ops = Latoi(argv[1]);
+	if (ops < 1) {
+		Lprintf("Usage:  %s [ops]\n", argv[0]);
+		return 1;
+	}
+
+	const char *names[3] = { "pool", "mutex", "cond" };
+	for (int k = 0; k < 3; k++) {
+		for (int t = 1; t <= MAXTHREADS; t *= 2) {
+			long us = k == 0 ? run_pool(t, ops)
+			    : k == 1 ? run_mutex(t, ops) : run_cond(t, ops);
+			if (us < 0) {
+				Lfprintf(2, "could not start threads\n");
+				return 3;
+			}
+			/* Tasks, lock round trips, or token passes over all pairs */
+			long n = k == 0 ? ops : k == 1 ? (long) t * ops : (long) (t > 1 ? t / 2 : 1) * ops;
+			if (us == 0)
+				us = 1;
+			Lprintf("workload=%s threads=%d ops=%d usec=%d kops_per_sec=%d\n",
+				names[k], t, (int) n, (int) us, (int) (n * 1000 / us));
+		}
+	}
+	return bad ? 4 : 0;
+}
@@ -1,195 +1,683 @@
+#include "posix-calls.h"
 #include "types.h"
 #include "param.h"
 #include "fs.h"
 #include "buf.h"
 #include "Ldiskio.h"
 #include "Llibc.h"
+#include "Lstats.h"
+#include "Ltrace.h"
+#include "Lthread.h"
+#include <linux/futex.h>
+
+/*
+    Buffer cache that several threads can use at once.
+
+    Locking model (restored from xv6, but striped):
+
+    - bcache.bucket[h].lock protects the hash chain of bucket h and
+      the dev_fd/blockno/refcnt of every buf on that chain.  A hit takes
+      only its own bucket lock, so lookups of different blocks rarely
+      contend.
+
+    - bcache.lock serializes misses:  only a thread holding it may move
+      a buf from one chain to another.  A miss re-checks its bucket
+      under bcache.lock, so two threads missing on the same block end
+      up sharing one buf (and one disk read).
+
+    - Each buf has a sleep lock, held from bread() to brelse(), which
+      gives the caller exclusive use of b->data across disk I/O.
+
+    Replacement is CLOCK (second chance) instead of a global LRU list:
+    a hit just sets b->used, so no global list is relinked per hit.
+
+    Metadata tier:  blocks below bcache.metalimit (boot, super, log,
+    inodes, bitmap; see bsetmeta()) and blocks read with bread_meta()
+    (directory and indirect blocks) are metadata.  A metadata miss
+    takes a data buf if there is a free one, so the tier grows into
+    whatever the cache is not using for data.  A data miss takes a
+    metadata buf only while the tier is over NMETA bufs, so at least
+    NMETA metadata blocks stay resident however much file data goes
+    through the cache, and path lookups keep finding them.
+
+    Block data is not in struct buf but in a separate slab, one BSIZE
+    slot per buf:  the headers stay dense, and every b->data is
+    BSIZE-aligned (for O_DIRECT and io_uring registered buffers).
+
+    Write-back (opt-in, after bwriteback_start()):  bwrite() only
+    marks the buf dirty, and a flusher thread writes dirty bufs back
+    once they are wb.age ms old, or all of them as soon as more than
+    wb.limit of them are dirty.  Each round is one sorted batch, so
+    runs of adjacent blocks go out as single vectored writes.  CLOCK
+    passes over dirty bufs while it can, so a miss rarely has to write
+    its victim before reading.  Without it, bwrite() writes through.
+
+    Write-back does not keep the order of writes.  A write that later
+    ones must not overtake uses bwritesync(), and a caller that needs
+    a group of writes on disk before the next ones calls bflush().
+*/
+#define NBUCKET (NBUF > 64 ? NBUF/2 + 1 : 13)    /* Short chains for big caches too */
+#define NMETA   (NBUF/2)                        /* Metadata kept from data misses */
+#define BHASH(blockno) ((blockno) % NBUCKET)
+
+struct bucket {
+  struct spinlock lock;
+  struct buf *head;     // Chain through buf.next
+};
 
 /*  This is where the global buffer pool is defined and storage allocated
-    for all the NBUF+1 struct bufs!  Note that this is in bss, and
+    for all the NBUF struct bufs!  Note that this is in bss, and
     while storage is allocated here, everything is null, including
-    all the pointers inside each of the NBUF+1 struct bufs here.
+    all the pointers inside each of the NBUF struct bufs here.
     (Things will be initialized via binit().)
 */
 struct {
-  /* struct spinlock lock; */
+  struct spinlock lock;   // Serializes misses (chain moves)
   struct buf buf[NBUF];
-  // Linked list of all buffers, through prev/next.
-  // Sorted by how recently the buffer was used.
-  // head.next is most recent, head.prev is least.
-  struct buf head;
+  struct bucket bucket[NBUCKET];
+  uint hand;              // CLOCK hand into buf[]
+  int aio;                // Batched I/O set up (lazily, by bflush)
+  uint metalimit;         // Blocks below this are metadata
+  int nmeta;              // Bufs in the metadata tier
+  struct sleeplock flushlock;
+  struct buf *flush[NBUF];  // bflush()'s batch, under flushlock (too big
+                            // for a thread stack once NBUF is raised)
 } bcache;
 
-/*
-    Picture of bcache after binit():
-
-   +---------------->------------->--------------->--------------+
-   |                                                             |
-   ^        head     buf[NBUF-1]         buf[1]    buf[0]        v
-   |      +---------+---------+-     -+---------+---------+      |
-   +--<---|<-prev   |<-prev   | - - - |<-prev   |<-prev   |<--<--+
-          |         |         |       |         |         |
-   +-->-->|   next->|   next->| - - - |   next->|   next->|--->--+
-   |      +---------+---------+-     -+---------+---------+      |
-   ^                   MRU                          LRU          v
-   |                                                             |
-   +------------------<------------<---------------<-------------+
+#define PAGESIZE 4096
+#define HUGEPAGE  (2*1024*1024)
+#ifndef MAP_HUGETLB
+#define MAP_HUGETLB 0x40000
+#endif
+
+/* Write-back state; ndirty is approximate between flusher rounds */
+static struct {
+  int on;
+  int stop;
+  uint age;               // ms
+  int limit;              // Bufs dirty before the flusher takes them all
+  int ndirty;
+  int kick;               // Futex:  bumped to wake the flusher early
+  Lthread flusher;
+} wb;
 
+static uchar bslab[NBUF*BSIZE] __attribute__((aligned(PAGESIZE)));
+
+/*
+   The data slab:  a huge page if the pool is big enough to fill one
+   and the system has one to spare, else the static one above.
 */
+static uchar*
+bslab_map(void)
+{
+  if (NBUF*BSIZE >= HUGEPAGE) {
+    ulong size = (NBUF*BSIZE + HUGEPAGE - 1) & ~(ulong) (HUGEPAGE - 1);
+    void *p = (void *) Lsyscall(SYS_mmap, 0, size, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (!((long) p < 0 && (long) p > -4096))
+      return p;
+  }
+  return bslab;
+}
 
-/* 
-    This is where the NBUF+1 prev/next pointer pairs actually get
-	meaningful values and the doubly linked list is formed as above!
+/*
+    Picture of bcache after binit() (all bufs start on bucket 0,
+    with blockno 0 and not valid):
+
+      bucket[0].head --> buf[NBUF-1] --> ... --> buf[1] --> buf[0] --> 0
+      bucket[1].head --> 0
+      ...
+      bucket[NBUCKET-1].head --> 0
 */
+
 void
 binit(void)
 {
   struct buf *b;
+  uchar *slab = bslab_map();
 
-  /* initlock(&bcache.lock, "bcache"); */
-
-  // Create linked list of buffers
-  /* Start with a singleton self-loop bcache.head */
-  bcache.head.prev = &bcache.head;  /* self-ref */
-  bcache.head.next = &bcache.head;  /* self-ref */
-  /* Incrementally grow cycles! */
+  initlock(&bcache.lock, "bcache");
+  initsleeplock(&bcache.flushlock, "bflush");
+  bcache.metalimit = 2;   /* Boot and super block, until bsetmeta() */
+  for (int i = 0; i < NBUCKET; i++) {
+    initlock(&bcache.bucket[i].lock, "bcache.bucket");
+    bcache.bucket[i].head = 0;
+  }
   for (b = bcache.buf; b < bcache.buf+NBUF; b++){
-    b->next = bcache.head.next;
-    b->prev = &bcache.head; 
-    /* initsleeplock(&b->lock, "buffer"); */
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
-  }
-  /* 
-	Study the four lines in the body of the for loop carefully
-	to understand how the doubly linked list is formed.  It
-	grows incrementally in each iteration of the for loop:
-      - Starts with the singleton of only bcache.head
-      - Then for k = 0, 1, ... it grows like this (left prev, right next):
-            head buf[0]         (k=0 two-element cycle bcache.head,bcache.buf+0)
-            head buf[1] buf[0]  (k=1 three-element cycle head,buf+1,buf+0)
-            ...
-            head buf[k-1] . . . buf[1] buf[0]
-            head buf[k] buf[k-1] . . . buf[1] buf[0]
-            ...
-            head buf [NBUF-1] . . . buf[k] buf[k-1] . . . buf[1] buf[0]
-  */
+    initsleeplock(&b->lock, "buffer");
+    b->data = slab + (b - bcache.buf) * BSIZE;
+    b->next = bcache.bucket[0].head;
+    bcache.bucket[0].head = b;
+  }
 }
 
-// Look through buffer cache for block on device dev.
-// If not found, allocate a buffer.
-// In either case, return locked buffer.
+/* Find blockno on chain bk; caller holds bk->lock */
 static struct buf*
-/* bget(uint dev, uint blockno) */
-bget(uint dev_fd, uint blockno)
+bucket_find(struct bucket *bk, uint dev_fd, uint blockno)
 {
   struct buf *b;
 
-  /* acquire(&bcache.lock); */
-
-  // Is the block already cached?
-  for (b = bcache.head.next; b != &bcache.head; b = b->next){
-    /* if (b->dev == dev && b->blockno == blockno){ */
-    if (b->dev_fd == dev_fd && b->blockno == blockno){
-      b->refcnt++;
-      /*
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
-      */
+  for (b = bk->head; b != 0; b = b->next)
+    if (b->dev_fd == dev_fd && b->blockno == blockno)
       return b;
+  return 0;
+}
+
+static void
+bucket_unlink(struct bucket *bk, struct buf *b)
+{
+  struct buf **pp;
+
+  for (pp = &bk->head; *pp != 0; pp = &(*pp)->next) {
+    if (*pp == b) {
+      *pp = b->next;
+      return;
     }
   }
+}
+
+/*
+   Pick a victim with CLOCK and take it off its chain, with
+   bcache.lock held.  The victim comes from the data tier, or from the
+   metadata tier for a data miss while that is over capacity.  Only
+   if that tier has nothing free is any free buf taken.  Returns 0 if
+   every buf is in use.
+*/
+static struct buf*
+bvictim(int meta)
+{
+  struct buf *b;
+  struct bucket *bk;
+  int nmeta = __atomic_load_n(&bcache.nmeta, __ATOMIC_RELAXED);
+  int tier = !meta && nmeta > NMETA;
 
-  // Not cached.
-  // Recycle the least recently used (LRU) unused buffer.
-  for (b = bcache.head.prev; b != &bcache.head; b = b->prev){
+  /* Two sweeps of the tier:  the first may only clear used bits, and
+     neither takes a dirty buf; then one sweep of any buf */
+  for (int n = 0; n < 3*NBUF; n++) {
+    b = &bcache.buf[bcache.hand];
+    bcache.hand = (bcache.hand + 1) % NBUF;
+    if (b->refcnt != 0)         /* Unlocked peek, re-checked below */
+      continue;
+    if (n < 2*NBUF) {
+      if (b->meta != tier || b->dirty)
+        continue;
+      if (b->used) {
+        b->used = 0;
+        continue;
+      }
+    }
+    /* Only bcache.lock holders move bufs, so b stays on this chain */
+    bk = &bcache.bucket[BHASH(b->blockno)];
+    acquire(&bk->lock);
     if (b->refcnt == 0) {
-      b->dev_fd = dev_fd;
-      b->blockno = blockno;
-      b->valid = 0;
-      b->refcnt = 1;
-      /*
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
-      */
+      bucket_unlink(bk, b);
+      release(&bk->lock);
       return b;
     }
+    release(&bk->lock);
   }
-  /* panic("bget: no buffers"); */
-  return (struct buf *) 0;
+  return 0;
 }
 
-// Return a locked buf with the contents of the indicated block.
+/* Move b into or out of the metadata tier */
+static void
+bsettier(struct buf *b, int meta)
+{
+  if (b->meta == meta)
+    return;
+  b->meta = meta;
+  __atomic_add_fetch(&bcache.nmeta, meta ? 1 : -1, __ATOMIC_RELAXED);
+  stats.bcache_meta_resident = __atomic_load_n(&bcache.nmeta, __ATOMIC_RELAXED);
+}
+
+// Look through buffer cache for block on device dev.
+// If not found, allocate a buffer.
+// In either case, return locked buffer.
+// meta:  the block is metadata (see above); a cached block already
+// in the metadata tier stays there.
+static struct buf*
+/* bget(uint dev, uint blockno) */
+bget(uint dev_fd, uint blockno, int meta)
+{
+  struct buf *b;
+  struct bucket *bk = &bcache.bucket[BHASH(blockno)];
+
+  // Is the block already cached?
+  acquire(&bk->lock);
+  if ((b = bucket_find(bk, dev_fd, blockno)) != 0) {
+    b->refcnt++;
+    b->used = 1;
+    if (meta)
+      bsettier(b, 1);
+    release(&bk->lock);
+    STAT_INC(bcache_hits);
+    if (b->meta)
+      STAT_INC(bcache_meta_hits);
+    acquiresleep(&b->lock);
+    return b;
+  }
+  release(&bk->lock);
+
+  // Not cached.  Serialize with other misses, then look again:
+  // another thread may have brought the block in meanwhile.
+  acquire(&bcache.lock);
+  acquire(&bk->lock);
+  if ((b = bucket_find(bk, dev_fd, blockno)) != 0) {
+    b->refcnt++;
+    b->used = 1;
+    if (meta)
+      bsettier(b, 1);
+    release(&bk->lock);
+    release(&bcache.lock);
+    STAT_INC(bcache_hits);
+    if (b->meta)
+      STAT_INC(bcache_meta_hits);
+    acquiresleep(&b->lock);
+    return b;
+  }
+  release(&bk->lock);
+  STAT_INC(bcache_misses);
+  if (meta)
+    STAT_INC(bcache_meta_misses);
+
+  // Recycle an unused buffer chosen by CLOCK.
+  if ((b = bvictim(meta)) == 0) {
+    release(&bcache.lock);
+    /* panic("bget: no buffers"); */
+    return (struct buf *) 0;
+  }
+  /* Off every chain now, so no one else can reach it:  save its data */
+  if (b->valid)
+    STAT_INC(bcache_evictions);
+  if (b->valid && b->dirty) {
+    STAT_INC(bcache_dirty_evictions);
+    disk_block_rw(b, 1);
+  }
+  b->dev_fd = dev_fd;
+  b->blockno = blockno;
+  b->valid = 0;
+  b->dirty = 0;
+  b->dirtied = 0;
+  b->refcnt = 1;
+  b->used = 1;
+  bsettier(b, meta);
+  acquire(&bk->lock);
+  b->next = bk->head;
+  bk->head = b;
+  release(&bk->lock);
+  release(&bcache.lock);
+  acquiresleep(&b->lock);
+  return b;
+}
+
+// Blocks below nmeta (boot, super, log, inodes and bitmap, as mkfs
+// lays them out) are metadata from now on.  Called at mount.
+void
+bsetmeta(uint nmeta)
+{
+  bcache.metalimit = nmeta;
+}
+
+// bread() for a block the caller knows to be metadata (or not), such
+// as a directory or indirect block:  with meta, it is cached in the
+// metadata tier.
 struct buf*
-bread(uint dev_fd, uint blockno)
+bread_meta(uint dev_fd, uint blockno, int meta)
 {
   struct buf *b;
 
-  b = bget(dev_fd, blockno);
+  b = bget(dev_fd, blockno, meta);
+  if (b == 0)
+    return 0;
+  TRACE(TR_BREAD, dev_fd, blockno, b->valid);
+  /* Whoever holds the sleep lock first does the (only) disk read */
   if (!b->valid) {
     /* virtio_disk_rw(b, 0); */
-	/* Lfprintf(2, "DEBUG:  disk i/o for blockno = %d\n", blockno); */
     disk_block_rw(b, 0);
+    /* A failed read must not leave stale data marked valid */
+    b->valid = !b->disk_rw_fail;
+  }
+  return b;
+}
+
+// Return a locked buf with the contents of the indicated block.
+struct buf*
+bread(uint dev_fd, uint blockno)
+{
+  return bread_meta(dev_fd, blockno, blockno < bcache.metalimit);
+}
+
+// Like bread(), for a block the caller will overwrite whole:  an
+// uncached block is not read from disk, it starts out zeroed.
+struct buf*
+bnew(uint dev_fd, uint blockno)
+{
+  struct buf *b;
+
+  b = bget(dev_fd, blockno, blockno < bcache.metalimit);
+  if (b == 0)
+    return 0;
+  TRACE(TR_BREAD, dev_fd, blockno, b->valid);
+  if (!b->valid) {
+    Lmemset(b->data, 0, BSIZE);
     b->valid = 1;
   }
   return b;
 }
 
+/* Milliseconds, never 0 (which means clean in b->dirtied) */
+static uint
+bnow(void)
+{
+  return stats_now() / 1000 + 1;
+}
+
+static void
+bwakeflusher(void)
+{
+  __atomic_add_fetch(&wb.kick, 1, __ATOMIC_RELEASE);
+  Lfutex_wake(&wb.kick, 1);
+}
+
+/* b (locked) has just been found dirty:  start its age */
+static void
+bdirtied(struct buf *b)
+{
+  if (b->dirtied != 0)
+    return;
+  b->dirtied = bnow();
+  if (__atomic_add_fetch(&wb.ndirty, 1, __ATOMIC_RELAXED) == wb.limit + 1 && wb.on)
+    bwakeflusher();
+}
+
+static void
+bwritethrough(struct buf *b)
+{
+  /* virtio_disk_rw(b, 1); */
+    disk_block_rw(b, 1);
+    if (!b->disk_rw_fail) {
+      b->dirty = 0;
+      b->dirtied = 0;
+    }
+}
+
 // Write b's contents to disk.  Must be locked.
+// With write-back on, only mark it dirty:  the flusher writes it.
 void
 bwrite(struct buf *b)
 {
-  /*
-  if (!holdingsleep(&b->lock))
-    panic("bwrite");
-  */
-  /* virtio_disk_rw(b, 1); */
-    disk_block_rw(b, 1);
+  if (!holdingsleep(&b->lock)) {
+    Lfprintf(2, "panic: bwrite\n");
+    Lexit_group(1);
+  }
+  TRACE(TR_BWRITE, b->dev_fd, b->blockno, 0);
+  if (wb.on) {
+    b->dirty = 1;
+    bdirtied(b);
+    return;
+  }
+  bwritethrough(b);
+}
+
+// Write b's contents to disk now, even with write-back on:  for
+// writes that later ones must not overtake (the superblock).
+void
+bwritesync(struct buf *b)
+{
+  if (!holdingsleep(&b->lock)) {
+    Lfprintf(2, "panic: bwritesync\n");
+    Lexit_group(1);
+  }
+  TRACE(TR_BWRITE, b->dev_fd, b->blockno, 0);
+  bwritethrough(b);
 }
 
 // Release a locked buffer.
-// Move to the head of the most-recently-used list.
+// It becomes a replacement candidate once refcnt drops to 0.
 void
 brelse(struct buf *b)
 {
-  /*
-  if(!holdingsleep(&b->lock))
-    panic("brelse");
-  */
+  struct bucket *bk;
 
-  /* 
+  if (!holdingsleep(&b->lock)) {
+    Lfprintf(2, "panic: brelse\n");
+    Lexit_group(1);
+  }
+  if (b->dirty)   /* Also catches bufs dirtied without bwrite() */
+    bdirtied(b);
   releasesleep(&b->lock);
 
-  acquire(&bcache.lock);
-  */
+  bk = &bcache.bucket[BHASH(b->blockno)];
+  acquire(&bk->lock);
   if (b->refcnt > 0) {
   	b->refcnt--;
   }
-  if (b->refcnt == 0) {
-    // no one is waiting for it.
-    b->next->prev = b->prev;
-    b->prev->next = b->next;
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
-  }
+  release(&bk->lock);
+}
 
-  /* release(&bcache.lock); */
+// Like bread() for n blocks at once (n <= DISK_AIO_MAXBATCH, and well
+// under NBUF):  the ones not cached are read in one batch (one preadv
+// per run of adjacent blocks).  Blocks must be distinct and in
+// ascending order, so that callers holding several buffers always
+// lock them in the same order.  Returns 0, or -1 (no buffers held)
+// if the pool ran out.
+int
+bread_batch(uint dev_fd, uint *blocknos, int n, struct buf **bs)
+{
+  struct buf *miss[DISK_AIO_MAXBATCH];
+  int m = 0;
+
+  for (int i = 0; i < n; i++) {
+    if ((bs[i] = bget(dev_fd, blocknos[i], blocknos[i] < bcache.metalimit)) == 0) {
+      while (--i >= 0)
+        brelse(bs[i]);
+      return -1;
+    }
+    TRACE(TR_BREAD, dev_fd, blocknos[i], bs[i]->valid);
+    if (!bs[i]->valid)
+      miss[m++] = bs[i];
+  }
+  disk_block_rw_batch(miss, m, 0);
+  for (int i = 0; i < m; i++)
+    miss[i]->valid = !miss[i]->disk_rw_fail;
+  return 0;
 }
 
 void
 bpin(struct buf *b) {
-  /* acquire(&bcache.lock); */
+  struct bucket *bk = &bcache.bucket[BHASH(b->blockno)];
+
+  acquire(&bk->lock);
   b->refcnt++;
-  /* release(&bcache.lock); */
+  release(&bk->lock);
 }
 
 void
 bunpin(struct buf *b) {
-  /* acquire(&bcache.lock); */
+  struct bucket *bk = &bcache.bucket[BHASH(b->blockno)];
+
+  acquire(&bk->lock);
   if (b->refcnt > 0)
   	b->refcnt--;
-  /* release(&bcache.lock); */
+  release(&bk->lock);
+}
+
+/*
+   Set up batched I/O for the pool:  io_uring with registered bufs.
+   Done on the first bflush(), not in binit(), to keep startup cheap.
+*/
+static int
+baio_init(void)
+{
+  int mode = disk_aio_init(DISK_AIO_MAXBATCH);
+
+  if (mode == DISK_AIO_URING)
+    disk_aio_register(bcache.buf, NBUF);
+  return mode;
+}
+
+/*
+   Write back the valid dirty buffers that went dirty at or before
+   time `before` (bnow() ms; ~0 for all of them), and recount
+   wb.ndirty.  Returns the number written.
+
+   Pins every such buffer (bcache.lock keeps them on their chains
+   meanwhile) and locks those nobody holds, then writes them all in
+   one batch, so many writes are in flight at once.  Buffers that are
+   busy are skipped:  their holders may be changing them still.
+*/
+static int
+bwriteback(uint before)
+{
+  struct buf *b;
+  struct bucket *bk;
+  struct buf **batch = bcache.flush;
+  int n = 0, ndirty = 0;
+
+  acquiresleep(&bcache.flushlock);
+  acquire(&bcache.lock);
+  if (!bcache.aio) {
+    baio_init();
+    bcache.aio = 1;
+  }
+  for (b = bcache.buf; b < bcache.buf+NBUF; b++) {
+    if (!(b->valid && b->dirty))      /* Unlocked peek */
+      continue;
+    ndirty++;
+    if (b->dirtied > before)
+      continue;
+    bk = &bcache.bucket[BHASH(b->blockno)];
+    acquire(&bk->lock);
+    b->refcnt++;
+    release(&bk->lock);
+    if (tryacquiresleep(&b->lock))
+      batch[n++] = b;
+    else {
+      acquire(&bk->lock);
+      b->refcnt--;
+      release(&bk->lock);
+    }
+  }
+  release(&bcache.lock);
+
+  /* Re-check under the sleep lock:  someone may have written it */
+  int m = 0;
+  for (int i = 0; i < n; i++) {
+    if (batch[i]->valid && batch[i]->dirty)
+      batch[m++] = batch[i];
+    else
+      brelse(batch[i]);
+  }
+  disk_block_rw_batch(batch, m, 1);
+  for (int i = 0; i < m; i++) {
+    b = batch[i];
+    if (b->disk_rw_fail)
+      Lfprintf(2, "sync: could not write block %d\n", b->blockno);
+    b->dirty = 0;
+    b->dirtied = 0;
+    brelse(b);
+  }
+  __atomic_store_n(&wb.ndirty, ndirty - m, __ATOMIC_RELAXED);
+  releasesleep(&bcache.flushlock);
+  return m;
+}
+
+/*
+   Write back every valid dirty buffer (used by sync()).
+
+   bwriteback() takes all the idle ones in one batch; the busy ones
+   are left to the second pass, which waits for each in turn while
+   holding no other buffer, so it cannot deadlock with a thread that
+   holds one buffer and wants another.
+*/
+void
+bflush(void)
+{
+  struct buf *b;
+  struct bucket *bk;
+
+  bwriteback(~0U);
+
+  for (int h = 0; h < NBUCKET; h++) {
+    bk = &bcache.bucket[h];
+    for (;;) {
+      acquire(&bk->lock);
+      for (b = bk->head; b != 0; b = b->next)
+        if (b->valid && b->dirty)
+          break;
+      if (b == 0) {
+        release(&bk->lock);
+        break;
+      }
+      b->refcnt++;
+      release(&bk->lock);
+
+      acquiresleep(&b->lock);
+      if (b->valid && b->dirty) {
+        disk_block_rw(b, 1);
+        if (b->disk_rw_fail)  /* Report, do not retry forever */
+          Lfprintf(2, "sync: could not write block %d\n", b->blockno);
+      }
+      b->dirty = 0;
+      b->dirtied = 0;
+      brelse(b);
+    }
+  }
+}
+
+/*
+   The flusher:  every age/2 ms, or when kicked, write back what is
+   older than age, or everything if over the limit.
+*/
+static int
+bflusher(void *arg)
+{
+  struct timespec ts;
+  uint nap = wb.age / 2 ? wb.age / 2 : 1;
+
+  while (!__atomic_load_n(&wb.stop, __ATOMIC_ACQUIRE)) {
+    int kick = __atomic_load_n(&wb.kick, __ATOMIC_ACQUIRE);
+    uint now = bnow();
+    int over = __atomic_load_n(&wb.ndirty, __ATOMIC_RELAXED) > wb.limit;
+
+    STAT_ADD(bcache_writeback_blocks,
+      bwriteback(over ? ~0U : now > wb.age ? now - wb.age : 0));
+    ts.tv_sec = nap / 1000;
+    ts.tv_nsec = (nap % 1000) * 1000000L;
+    Lsyscall(SYS_futex, &wb.kick, FUTEX_WAIT | FUTEX_PRIVATE_FLAG, kick, &ts, 0, 0);
+  }
+  return 0;
 }
 
+/*
+   Turn on write-back:  dirty blocks reach the disk age_ms after they
+   were first written, or sooner once more than ratio percent of the
+   pool is dirty.  Returns 0, or -1 (still writing through) if the
+   flusher could not be started.
+*/
+int
+bwriteback_start(uint age_ms, int ratio)
+{
+  if (wb.on)
+    return 0;
+  wb.age = age_ms;
+  wb.limit = NBUF * ratio / 100;
+  wb.stop = 0;
+  if (Lthread_create(&wb.flusher, bflusher, 0) < 0)
+    return -1;
+  wb.on = 1;
+  return 0;
+}
+
+/* Stop the flusher and write back everything; bwrite() writes through again */
+void
+bwriteback_stop(void)
+{
+  if (!wb.on)
+    return;
+  __atomic_store_n(&wb.stop, 1, __ATOMIC_RELEASE);
+  bwakeflusher();
+  Lthread_join(&wb.flusher);
+  wb.on = 0;
+  bflush();
+}
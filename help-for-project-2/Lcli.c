@@ -2,22 +2,30 @@
 #include "Llibc.h"
 #include "Lcli.h"
 #include "walkfunctions.h"
+#include "Lserver.h"
+#include "Lstats.h"
+#include "Ltrace.h"
 
 
-#define LINESIZE 1024   /* Line buffer size */
 #define NTOKS 128       /* Max number of tokens in a line */
 #define TOKEN_SIZE 100
 #define MAX_NAME_LENGTH 256
-#define STACK_SIZE 128
 
 /* From Lbio.c */
 void binit(void);
 struct buf* bread(uint, uint);
+void bsetmeta(uint);
 void brelse(struct buf*);
+int bwriteback_start(uint, int);
+void bwriteback_stop(void);
+
+/* Write-back default (--dirty-ratio); it is off unless --writeback */
+#define WB_RATIO  50
 
 
 /* For this File */
 int parseLine(char **line, int len, char **token);
+int readline(int fd, char *line, int max);
 void help();
 
 
@@ -33,17 +41,10 @@ of the CLI, we will have to track CWD, we will have a global struct for it;
 int DEVFD;
 struct superblock SB;
 
-typedef struct{
-	uint inum;
-	char name[MAXPATH];
-} CWD;
-
-typedef struct{
-    CWD entries[STACK_SIZE];
-    int top;
-} DirectoryStack;
+DirectoryStack dirStack = {0, -1, 0}; // Initialize the stack with an empty state
 
-DirectoryStack dirStack = {{{0}}, -1}; // Initialize the stack with an empty state
+/* Scratch memory for the command being run:  reset after each one */
+struct arena cmdarena;
 
 
 // More Prototype
@@ -53,38 +54,116 @@ CWD peek(const DirectoryStack *stack);
 void printStack(const DirectoryStack *stack);
 int lsCommand(char *token[], int curr);
 int buildPathFromStack(const DirectoryStack *stack, char *resultPath, int resultSize);
+char *cwdPath(const char *name);
+char *absPath(const char *path);
+int uploadtreeCommand(char *token[], int curr);
 int cdCommand(DirectoryStack *stack, char *token);
 int unlinkCommand(char *token[],int curr);
 int linkCommand(char *token[], int curr);
+void traceCommand(char *token[], int curr);
+void defragCommand(char *token[], int curr);
+void dfCommand(void);
+void creatCommand(char *token[], int curr);
+void mkdirCommand(char *token[], int curr);
+void rmCommand(char *token[], int curr);
+int oncwdpath(uint inum);
 
 
 void
-devfd_init(const char *devpath)
+devfd_init(const char *devpath, int direct)
 {
-	/* First do this readonly to implement pwd, ls, cd, and upload commands */
-	if ((DEVFD = Lopen(devpath, O_RDONLY)) < 0 ) {
+	if ((DEVFD = disk_open(devpath, direct)) < 0) {
 		Lfprintf(2, "Could not open %s\n", devpath);
 		Lexit(2);
 	}
 }
 
-void
-superblock_init(int devfd)
+/*
+The superblock is read lazily:  nothing touches the image until the
+first command that needs it.  fs_mount() validates FSMAGIC once and
+memoizes SB; every later call is just a flag test.
+*/
+int SBvalid = 0;
+
+int
+fs_mount(void)
 {
 	struct buf *b;
-	if ((b = bread(DEVFD, 1)) == 0) {
+
+	if (SBvalid)
+		return 0;
+	if ((b = bread(DEVFD, 1)) == 0 || b->disk_rw_fail) {
 		Lfprintf(2, "Could not read superblock\n");
-		Lexit(3);
+		if (b)
+			brelse(b);
+		return -1;
 	}
-	Lprintf("The superblock was read:");
-	Lprintf("  blockno = %d, refcnt = %d, valid = %d, dirty = %d\n",
-		b->blockno, b->refcnt, b->valid, b->dirty);
 	/* Populate SB */
-	// struct superblock *s = &SB;
 	Lmemcpy(&SB, &b->data[0], sizeof(struct superblock));
 	brelse(b);
+	if (SB.magic != FSMAGIC) {
+		Lfprintf(2, "Bad superblock magic %08x (expected %08x)\n",
+			SB.magic, FSMAGIC);
+		return -1;
+	}
+	/* Everything below the data blocks goes to the metadata tier */
+	bsetmeta(SB.size - SB.nblocks);
+	SBvalid = 1;
+	/* Saved free counts, if any:  a mount never scans (df does) */
+	fsum_load(0);
+	return 0;
 }
 
+/*
+Opt-in diagnostic dump (the dumpfs/stat command):  the superblock,
+the inode geometry, the first ninodes inodes, and the dirent geometry.
+*/
+void
+dumpfs(int ninodes)
+{
+	struct superblock *s = &SB;
+
+	Lprintf("Superblock magic = %08x\n", s->magic);
+	Lprintf("FS device size = %d\n", s->size);
+	Lprintf("Number of data blocks = %d\n", s->nblocks);
+	Lprintf("Number of inodes = %d\n", s->ninodes);
+	Lprintf("Block number for the first inode block = %d\n", s->inodestart);
+	Lprintf("Block number for the first bitmap block = %d\n", s->bmapstart);
+
+	uint inodesize = sizeof(struct dinode);
+	uint inodes_per_block = BSIZE / inodesize;
+	Lprintf("Size of each inode = %d\n", inodesize);
+	Lprintf("Number of inodes per block = %d\n", inodes_per_block);
+	/* Mailman algorithm: Given inode number ino, its
+		block number is:  				SB.inodestart + ino / inodes_per_block;
+		byte offset within block is: 	inodesize * (ino % inodes_per_block);
+	*/
+	Lprintf("Dumping the first %d inodes ...\n", ninodes);
+	struct dinode inode;
+	for (int k = 0; k < ninodes && k < s->ninodes; k++) {
+		Lprintf("inode %d:\n", k);
+		if (getinode(&inode, k) == -1) {
+			Lprintf("  UNUSED (file type = 0)\n");
+			continue;
+		}
+		Lprintf("  file type = %d\n", inode.type);
+		Lprintf("  number of links = %d\n", inode.nlink);
+		Lprintf("  file size = %u (bytes)\n", inode.size);
+		Lprintf("  block map:\n");
+		for (uint j = 0; j < NDIRECT && inode.addrs[j] != 0; j++)
+			Lprintf("    direct block in decimal: %d --- hexadecimal: 0x%08x\n", inode.addrs[j], inode.addrs[j]);
+		if (inode.addrs[NDIRECT] != 0)
+			Lprintf("      indirect block 0x%08x\n", inode.addrs[NDIRECT]);
+	}
+
+	/* Directories */
+	uint direntsize = sizeof(struct dirent);	/* 16 bytes */
+	uint dirents_per_block = BSIZE / direntsize;
+	Lprintf("Size of each dir entry = %d\n", direntsize);
+	Lprintf("Number of dir entries per block = %d\n", dirents_per_block);
+}
+
+
 void
 cwd_init(void)
 {
@@ -107,219 +186,102 @@ cwd_update(uint inum, const char *name){
 int
 Lmain(int argc, char *argv[])
 {
+	int statsjson = 0, direct = 0;
+	int wbage = 0, wbratio = WB_RATIO;
+	char *tracepath = NULL;
+
+	/*
+	  --stats-json:  write the counters as JSON to fd 2 at exit
+	  --trace path:  trace block accesses from the start, dump at exit
+	  --direct:      O_DIRECT image I/O, bypassing the host page cache
+	                 (pair it with a larger cache:  make NBUF=...)
+	  --writeback ms:  write dirty blocks back in the background once
+	                 they are ms old (default 0:  write through, no
+	                 flusher).  Writes may reach the image out of order.
+	  --dirty-ratio p: ... or as soon as p% of the cache is dirty
+	*/
+	for (;;) {
+		if (argc > 1 && Lstrcmp(argv[1], "--stats-json") == 0) {
+			statsjson = 1;
+			argv[1] = argv[0];
+			argv++;
+			argc--;
+		} else if (argc > 1 && Lstrcmp(argv[1], "--direct") == 0) {
+			direct = 1;
+			argv[1] = argv[0];
+			argv++;
+			argc--;
+		} else if (argc > 2 && Lstrcmp(argv[1], "--writeback") == 0) {
+			wbage = Latoi(argv[2]);
+			argv[2] = argv[0];
+			argv += 2;
+			argc -= 2;
+		} else if (argc > 2 && Lstrcmp(argv[1], "--dirty-ratio") == 0) {
+			wbratio = Latoi(argv[2]);
+			argv[2] = argv[0];
+			argv += 2;
+			argc -= 2;
+		} else if (argc > 2 && Lstrcmp(argv[1], "--trace") == 0) {
+			tracepath = argv[2];
+			argv[2] = argv[0];
+			argv += 2;
+			argc -= 2;
+		} else
+			break;
+	}
+	if (tracepath != NULL && trace_start(0) < 0)
+		Lfprintf(2, "Could not start trace\n");
 	if (argc < 2) {
-		Lprintf("Usage:  %s fs_img_path\n", argv[0]);
+		Lprintf("Usage:  %s [options] fs_img_path\n", argv[0]);
+		Lprintf("        %s [options] --serve sockpath fs_img_path\n", argv[0]);
+		Lprintf("        %s --client sockpath command [args ...]\n", argv[0]);
+		Lprintf("Options:  --stats-json  --trace path  --direct\n");
+		Lprintf("          --writeback ms (off)  --dirty-ratio percent (%d)\n", WB_RATIO);
 		return 1;
 	}
 
-	devfd_init(argv[1]);
-
-	binit();
-
-	superblock_init(DEVFD);
-
-	cwd_init();
-
-	/* Some code for test/debugging only!
-	   bcache should never be directly accessed!
-
-	int nbuf = 0;
-	struct buf *b;
-	for (b = bcache.head.next; b != &bcache.head; b = b->next){
-		nbuf++;
+	/* Thin client:  forward argv to a running server, no image needed */
+	if (Lstrcmp(argv[1], "--client") == 0) {
+		if (argc < 4)
+			return 1;
+		return client(argv[2], argc - 3, argv + 3) < 0 ? 2 : 0;
 	}
-	Lprintf("nbuf = %d\n", nbuf);
-	*/
-
-	// Return a locked buf with the contents of the indicated block.
-	/*
-	struct buf *b;
-	if ((b = bread(DEVFD, 1)) == 0)
-		return 3;
-	*/
-
-	/*  Each call to bread increases refcnt for that buffer
-		and each call to brelse will decrement refcnt.
-		We are not using locking but the Lbio.c code depends on it,
-		so make sure to brelse() after each bread() and each bwrite()
-		so that refcnt resets to 0, or else even the LRU buffer
-		may not get recycled!
 
-		Also in original xv6 code, refcnt could get negative,
-		so I patched Lbio.c so that refcnt stays >= 0.
-		*/
-
-	/*
-	Lprintf("blockno = %d, refcnt = %d, valid = %d, dirty = %d\n",
-		b->blockno, b->refcnt, b->valid, b->dirty);
-	*/
-
-	/* Dump block contents in hex */
-	/*
-	for (int k = 0; k < BSIZE; k++) {
-		Lprintf("%02x ", b->data[k]);
-		if ((k % 16) == 15 || k == BSIZE - 1)
-			Lprintf("\n");
+	if (Lstrcmp(argv[1], "--serve") == 0) {
+		if (argc < 4)
+			return 1;
+		devfd_init(argv[3], direct);
+		binit();
+		if (wbage > 0 && bwriteback_start(wbage, wbratio) < 0)
+			Lfprintf(2, "Could not start writeback, writing through\n");
+		int rc = serve(argv[2]) < 0 ? 2 : 0;
+		if (SBvalid)
+			sync();     /* Also saves the free counts */
+		bwriteback_stop();
+		if (statsjson)
+			stats_json(2);
+		if (tracepath != NULL)
+			trace_dump(tracepath);
+		return rc;
 	}
-	*/
 
-	/* Analyze the superblock */
-	struct superblock *s;
-	// s = (struct superblock *) &b->data[0];
-	s = &SB;
-
-	Lprintf("Superblock magic = %08x\n", s->magic);
-	Lprintf("FS device size = %d\n", s->size);
-	Lprintf("Number of data blocks = %d\n", s->nblocks);
-	Lprintf("Number of inodes = %d\n", s->ninodes);
-	Lprintf("Block number for the first inode block = %d\n", s->inodestart);
-	Lprintf("Block number for the first bitmap block = %d\n", s->bmapstart);
-
-	Lprintf("Done with superblock for now!\n");
-
-	/* */
-	uint inodesize = sizeof(struct dinode);
-	uint inodes_per_block = BSIZE / inodesize;
-	Lprintf("Size of each inode = %d\n", inodesize);
-	Lprintf("Number of inodes per block = %d\n", inodes_per_block);
-	/* Mailman algorithm: Given inode number ino, its
-		block number is:  				SB.inodestart + ino / inodes_per_block;
-		byte offset within block is: 	inodesize * (ino % inodes_per_block);
-	*/
-	Lprintf("Dumping the first few inodes ...\n");
-	int n = 4;
-	/* Do this directly for now! */
-	struct buf *b;
-	// b = bread(fsdev_fd, SB.inodestart);
-	b = bread(DEVFD, SB.inodestart);
-	struct dinode *inode;
-	for (int k = 0; k < n; k++) {
-		inode = (struct dinode *) &b->data[k*inodesize];
-		Lprintf("inode %d:\n", k);
-		if (inode->type == 0) {
-			Lprintf("  UNUSED (file type = 0)\n");
-			continue;
-		}
-		Lprintf("  file type = %d\n", inode->type);
-		Lprintf("  number of links = %d\n", inode->nlink);
-		Lprintf("  file size = %u (bytes)\n", inode->size);
-		Lprintf("  block map:\n");
-		for (uint j = 0; j < NDIRECT && inode->addrs[j] != 0; j++)
-		//	Lprintf("    direct block 0x%08x\n", inode->addrs[j]);
-			Lprintf("    direct block in decimal: %d --- hexadecimal: 0x%08x\n", inode->addrs[j], inode->addrs[j]);
-		if (inode->size > NDIRECT * BSIZE && inode->addrs[NDIRECT - 1] != 0)
-			Lprintf("      indirect block 0x%08x\n", inode->addrs[NDIRECT]);
-	}
+	devfd_init(argv[1], direct);
 
-	/* Directories */
-	uint direntsize = sizeof(struct dirent);	/* 16 bytes */
-	uint dirents_per_block = BSIZE / direntsize;
-	Lprintf("Size of each dir entry = %d\n", direntsize);
-	Lprintf("Number of dir entries per block = %d\n", dirents_per_block);
+	binit();
+	if (wbage > 0 && bwriteback_start(wbage, wbratio) < 0)
+		Lfprintf(2, "Could not start writeback, writing through\n");
 
-	brelse(b);
+	cwd_init();
 
 	/* Now list the current/root directory */
 	// lspath(CWD.name);
         int flag = 0;
 	char buf[LINESIZE];
-	char *ptrBuf;
 	Lprintf("\n/********************\n * TERMINAL STARTED *\n ********************/\n\n");
 	Lprintf("batcave> ");
-	while (Lread(0, buf, LINESIZE) > 0 && flag == 0) {
-		char *token[NTOKS] = {NULL};
-		/* With the terminal in line buffered mode, buf will hold
-			the '\n' character indicating the end of line
-		   */
-		
-		/* Analyze line typed by user ... */
-			//Write your code here!
-		if (buf[0] != '\n'){
-     			ptrBuf = buf;
-     			// Parses Line to get the token
-     			parseLine(&ptrBuf, Lstrlen(buf),token);
- 
-				// Makes sure the tokens arent null
-       				if(token[0] == NULL){
-	 				Lprintf("Invalid Command");
-       				}else if(Lstrcmp(token[0], "help") == 0){
- 	 				help();
-      			 	}else if (Lstrcmp(token[0], "pwd") == 0){
-					printStack(&dirStack);
-					Lprintf("\n");
-				}else if (Lstrcmp(token[0], "creat") == 0){
-					createPath(dirStack.entries[dirStack.top].inum, token[1]);
-				}else if (Lstrcmp(token[0], "mkdir") == 0){
-					mkdir(token[1]);
-				}else if (Lstrcmp(token[0], "sync") == 0){
-					sync();
-				}else if (Lstrcmp(token[0], "cd") == 0){
-					uint cdresult = cdCommand(&dirStack, token[1]);
-					if (cdresult == -1){
-					   Lprintf("Directory does not exist\n");
-					
-					} 	
-				}else if (Lstrcmp(token[0], "unlink") == 0){
-					int unlinkResult = unlinkCommand(token,0);
-					if (unlinkResult == -1){
-				           Lprintf("Directory does not exist\n");
-					}
-				}else if(Lstrcmp(token[0], "link") == 0){
-					int linkResult = linkCommand(token,0);
-					if (linkResult == -1){
-					    Lprintf("Directory does not exist\n");
-					}
-				}else if(Lstrcmp(token[0], "find") == 0){
-					Lprintf("Returned Inode: %d\n", find_name_in_dirblock(Latoi(token[1]),token[2]));
-				}else if(Lstrcmp(token[0], "dent") == 0){
-					Lprintf("Returned Inode: %d\n", find_dent(Latoi(token[1]), token[2]));
-				}else if(Lstrcmp(token[0], "path") == 0){
-					Lprintf("Returned Inode: %d\n", namei(token[1]));
-				}else if(Lstrcmp(token[0], "ls") == 0){
-					int lsResult = lsCommand(token,0);
-					if (lsResult == -1){
-					    Lprintf("Directory does not exist\n");
-					}
-				}else if (Lstrcmp(token[0], "lspath") == 0){
-					lspath(token[1]);
-				}else if(Lstrcmp(token[0], "quit") == 0){
-					flag = 1;
-					sync();
-				}else{
-       					// Display an invalid message when token doesn't match an action
-       					Lprintf("Invalid Command\n");
-				}
-		}
-		/*
-			If command was pwd:
-
-				Lprintf("%s\n", CWD.name);
-		
-			If command was ls, without any argument params:
-				lspath(CWD.name);
-
-			If command was ls, with argument param path1:
-				lspath(path1);	// Handle errors, repeat for path2, path3, ...
-
-			If command was cd, without any argument params:
-				CWD.inum = 1;
-				Lstrcpy(CWD.name, "/");
-
-			If command was cd, with argument param path:
-				// Strip extra repeated slashes, then
-				uint in = namei(path);
-				struct dinode inode;
-				inode.type = 0;
-				if (in != 0)
-					getinode(&inode, in);
-				if (inode.type == T_DIR) {
-					// Try to do the cd, i.e., update struct CWD properly
-					// Mostly string processing here
-				} else {
-				Lprintf("Could not cd to %s (not a directory)\n", path);
-				}
-		*/
-		
+	while (flag == 0 && readline(0, buf, LINESIZE) > 0) {
+		flag = run_command(buf);
+
 		// clearing buf
 		for(int i = 0; i< LINESIZE; i++){
 			buf[i] = 0;
@@ -331,10 +293,214 @@ Lmain(int argc, char *argv[])
 		}
 	}
 	//Lprintf("\n");
+	if (SBvalid && flag == 0)
+		sync();     /* End of input without quit */
+	bwriteback_stop();
+	if (statsjson)
+		stats_json(2);
+	if (tracepath != NULL)
+		trace_dump(tracepath);
 	return 0;
 
 }
 
+/*****************************
+ * IMPLEMENTING RUN_COMMAND
+ ****************************/
+/*
+Parse and execute one command line (terminated by '\n' or '\0').
+Output goes to fd 1.  Returns 1 if the command was quit, else 0.
+Shared by the interactive loop and the server (see Lserver.c).
+*/
+int
+run_command(char *buf)
+{
+	int flag = 0;
+	char *ptrBuf;
+	char *token[NTOKS] = {NULL};
+	char *statname = NULL;
+	long t0 = stats_now();
+	/* With the terminal in line buffered mode, buf will hold
+		the '\n' character indicating the end of line
+	   */
+
+	/* Analyze line typed by user ... */
+	if (buf[0] != '\n'){
+		ptrBuf = buf;
+		// Parses Line to get the token
+		parseLine(&ptrBuf, Lstrlen(buf),token);
+		statname = token[0];
+
+		// Makes sure the tokens arent null
+		if(token[0] == NULL){
+			Lprintf("Invalid Command");
+		}else if(Lstrcmp(token[0], "help") == 0){
+			help();
+		}else if (Lstrcmp(token[0], "pwd") == 0){
+			printStack(&dirStack);
+			Lprintf("\n");
+		}else if(Lstrcmp(token[0], "quit") == 0){
+			flag = 1;
+			sync();
+		}else if (fs_mount() < 0){
+			/* Everything below needs the image mounted */
+			Lprintf("Could not mount file system image\n");
+		}else if (Lstrcmp(token[0], "dumpfs") == 0 || Lstrcmp(token[0], "stat") == 0){
+			dumpfs(token[1] ? Latoi(token[1]) : 4);
+		}else if (Lstrcmp(token[0], "creat") == 0){
+			creatCommand(token, 0);
+		}else if (Lstrcmp(token[0], "mkdir") == 0){
+			mkdirCommand(token, 0);
+		}else if (Lstrcmp(token[0], "rm") == 0){
+			rmCommand(token, 0);
+		}else if (Lstrcmp(token[0], "sync") == 0){
+			sync();
+		}else if (Lstrcmp(token[0], "stats") == 0){
+			if (token[1] && Lstrcmp(token[1], "reset") == 0)
+				stats_reset();
+			else if (token[1] && Lstrcmp(token[1], "json") == 0)
+				stats_json(1);
+			else
+				stats_print(1);
+		}else if (Lstrcmp(token[0], "trace") == 0){
+			traceCommand(token, 0);
+		}else if (Lstrcmp(token[0], "defrag") == 0){
+			defragCommand(token, 0);
+		}else if (Lstrcmp(token[0], "df") == 0){
+			dfCommand();
+		}else if (Lstrcmp(token[0], "cd") == 0){
+			uint cdresult = cdCommand(&dirStack, token[1]);
+			if (cdresult == -1){
+				Lprintf("Directory does not exist\n");
+
+			}
+		}else if (Lstrcmp(token[0], "unlink") == 0){
+			int unlinkResult = unlinkCommand(token,0);
+			if (unlinkResult == -1){
+				Lprintf("Directory does not exist\n");
+			}
+		}else if(Lstrcmp(token[0], "link") == 0){
+			int linkResult = linkCommand(token,0);
+			if (linkResult == -1){
+				Lprintf("Directory does not exist\n");
+			}
+		}else if(Lstrcmp(token[0], "find") == 0){
+			Lprintf("Returned Inode: %d\n", find_name_in_dirblock(Latoi(token[1]),token[2]));
+		}else if(Lstrcmp(token[0], "dent") == 0){
+			Lprintf("Returned Inode: %d\n", find_dent(Latoi(token[1]), token[2]));
+		}else if(Lstrcmp(token[0], "path") == 0){
+			Lprintf("Returned Inode: %d\n", nameiat(cwdinum(), token[1]));
+		}else if(Lstrcmp(token[0], "ls") == 0){
+			int lsResult = lsCommand(token,0);
+			if (lsResult == -1){
+				Lprintf("Directory does not exist\n");
+			}
+		}else if (Lstrcmp(token[0], "lspath") == 0){
+			lspathat(cwdinum(), token[1]);
+		}else if (Lstrcmp(token[0], "upload") == 0){
+			if (token[1] == NULL || token[2] == NULL || upload(cwdinum(), token[1], token[2]) < 0){
+				Lprintf("Could not upload\n");
+			}
+		}else if (Lstrcmp(token[0], "download") == 0){
+			int t = 1, iflags = 0;
+			for (; token[t] != NULL && token[t][0] == '-'; t++){
+				if (Lstrcmp(token[t], "-z") == 0)
+					iflags |= I_LZ;
+				else if (Lstrcmp(token[t], "-d") == 0)
+					iflags |= DL_DEDUP;
+				else
+					break;
+			}
+			if (token[t] == NULL || token[t+1] == NULL || download(token[t], cwdinum(), token[t+1], iflags) < 0){
+				Lprintf("Could not download\n");
+			}
+		}else if (Lstrcmp(token[0], "uploadtree") == 0){
+			if (uploadtreeCommand(token, 0) < 0){
+				Lprintf("Could not upload tree\n");
+			}
+		}else{
+			// Display an invalid message when token doesn't match an action
+			Lprintf("Invalid Command\n");
+			statname = "invalid";
+		}
+	}
+	/*
+		If command was pwd:
+
+			Lprintf("%s\n", CWD.name);
+	
+		If command was ls, without any argument params:
+			lspath(CWD.name);
+
+		If command was ls, with argument param path1:
+			lspath(path1);	// Handle errors, repeat for path2, path3, ...
+
+		If command was cd, without any argument params:
+			CWD.inum = 1;
+			Lstrcpy(CWD.name, "/");
+
+		If command was cd, with argument param path:
+			// Strip extra repeated slashes, then
+			uint in = namei(path);
+			struct dinode inode;
+			inode.type = 0;
+			if (in != 0)
+				getinode(&inode, in);
+			if (inode.type == T_DIR) {
+				// Try to do the cd, i.e., update struct CWD properly
+				// Mostly string processing here
+			} else {
+			Lprintf("Could not cd to %s (not a directory)\n", path);
+			}
+	*/
+	
+	Larena_reset(&cmdarena);
+	if (statname != NULL)
+		stats_command(statname, t0);
+	return flag;
+}
+
+/*****************************
+ * IMPLEMENTING READLINE
+ ****************************/
+/*
+Return one '\n'-terminated line per call.  A single Lread() on a pipe
+can return several lines at once when commands are scripted, so the
+remainder is kept in a static buffer for the next call.
+*/
+int
+readline(int fd, char *line, int max)
+{
+	static char pending[LINESIZE];
+	static int npending = 0;
+	int n = 0;
+	long got;
+
+	for (;;) {
+		for (int i = 0; i < npending; i++) {
+			if (pending[i] == '\n' || i == max - 2) {
+				n = i + 1;
+				Lmemcpy(line, pending, n);
+				line[n] = '\0';
+				Lmemmove(pending, pending + n, npending - n);
+				npending -= n;
+				return n;
+			}
+		}
+		if ((got = Lread(fd, pending + npending, LINESIZE - npending)) <= 0) {
+			/* EOF: a final unterminated line still counts */
+			if (npending == 0)
+				return 0;
+			n = npending < max - 1 ? npending : max - 1;
+			Lmemcpy(line, pending, n);
+			line[n] = '\0';
+			npending = 0;
+			return n;
+		}
+		npending += got;
+	}
+}
+
 // Takes the Line command, as well as the size
 /*****************************
  * IMPLEMENTING PARSELINE
@@ -370,14 +536,43 @@ parseLine(char **line, int len, char **token){
 /*****************************
  * IMPLEMENTING CD COMMAND
  ****************************/
+/*
+  cd [path]:  path may have several elements, ".", ".." and repeated
+  slashes.  It is resolved from the CWD inode first, so a bad path
+  leaves the stack alone; then the stack replays it one element at a
+  time ("." is dropped and ".." pops, but never below "/").
+*/
 int 
 cdCommand(DirectoryStack *stack, char *token){
-	uint cdresult = cd(stack->entries[stack->top].inum, token);
-	if (cdresult == -1){
+	char name[DIRSIZ+1];
+	struct dinode inode;
+	uint inum;
+
+	if (token == NULL)
+		token = "/";
+	inum = nameiat(cwdinum(), token);
+	if (inum == 0 || getinode(&inode, inum) == -1 || inode.type != T_DIR)
 		return -1;
+	if (token[0] == '/')
+		stack->top = 0;
+	for (char *p = token; *p != '\0'; ) {
+		int n = 0;
+		while (*p == '/')
+			p++;
+		for (; *p != '/' && *p != '\0'; p++)
+			if (n < DIRSIZ)
+				name[n++] = *p;
+		name[n] = '\0';
+		if (n == 0 || Lstrcmp(name, ".") == 0)
+			continue;
+		if (Lstrcmp(name, "..") == 0) {
+			if (stack->top > 0)
+				pop(stack);
+			continue;
+		}
+		cwd_update(find_dent(stack->entries[stack->top].inum, name), name);
 	}
-	cwd_update(cdresult, token);
-	return cdresult;
+	return inum;
 }
 
 /*****************************
@@ -385,33 +580,30 @@ cdCommand(DirectoryStack *stack, char *token){
  ****************************/
 int
 lsCommand(char *token[], int curr){
-	char pathResult[1000] ={0};
+	char *pathResult;
 
-	if (token[curr+1] == NULL || Lstrcmp(token[curr+1], ".") == 0) {
-			buildPathFromStack(&dirStack, pathResult, sizeof(pathResult));
-	} else if (Lstrcmp(token[curr+1], "..") == 0) {
-		if (dirStack.top == 0) {
-			Lprintf("Cannot go above root\n");
+	if (token[curr+1] != NULL && Lstrcmp(token[curr+1], "-R") == 0) {
+		/* The absolute path is only needed for the headings */
+		pathResult = token[curr+2] ? absPath(token[curr+2]) : cwdPath(NULL);
+		if (pathResult == NULL) {
+			return -1;
+		}
+		uint inum = token[curr+2] ? nameiat(cwdinum(), token[curr+2]) : cwdinum();
+		if (inum == 0) {
 			return -1;
-		} 
-		int currentLength = buildPathFromStack(&dirStack, pathResult, sizeof(pathResult));
-		// Ensure there's a slash before, but avoid a double slash
-		if (currentLength > 0 && pathResult[currentLength - 1] != '/') {
-			Lstrcpy(pathResult + currentLength++, "/");
-		}	
-		Lstrcpy(pathResult + currentLength, token[curr+1]);	
-		//targetInum = dirStack.entries[dirStack.top - 1].inum;
-	} else if(token[curr+1] != NULL) {
-		int currentLength = buildPathFromStack(&dirStack, pathResult, sizeof(pathResult));
-		// Ensure there's a slash before, but avoid a double slash
-		if (currentLength > 0 && pathResult[currentLength - 1] != '/') {
-			Lstrcpy(pathResult + currentLength++, "/");
-		}	
-   		Lstrcpy(pathResult + currentLength, token[curr+1]);	
-	}else{
+		}
+		return lsrecursive(inum, pathResult);
+	}
+
+	if (token[curr+1] == NULL) {
+		pathResult = ".";
+	} else if (Lstrcmp(token[curr+1], "..") == 0 && dirStack.top == 0) {
+		Lprintf("Cannot go above root\n");
 		return -1;
+	} else {
+		pathResult = token[curr+1];
 	}
-	lspath(pathResult);
+	lspathat(cwdinum(), pathResult);
 	return 0;
 }
 
@@ -424,16 +616,10 @@ unlinkCommand(char *token[],int curr){
 	if (token[curr + 1] == NULL){
 		return -1;
 	}
-	char pathResult[1000] ={0};
-
-	int currentLength = buildPathFromStack(&dirStack, pathResult, sizeof(pathResult));
-	// Ensure there's a slash before, but avoid a double slash
-	if (currentLength > 0 && pathResult[currentLength - 1] != '/') {
-		Lstrcpy(pathResult + currentLength++, "/");
+	if (oncwdpath(nameiat(cwdinum(), token[curr+1]))){
+		return -1;	// The CWD (empty), as rmdir . would
 	}
-   	Lstrcpy(pathResult + currentLength, token[curr+1]);
-
-	return unlink(pathResult);
+	return unlinkin(cwdinum(), token[curr+1]);
 }
 
 /*****************************
@@ -444,22 +630,60 @@ linkCommand(char *token[], int curr){
 	if (token[curr + 1] == NULL || token[curr + 2] == NULL){
 		return -1;
 	}
-	char pathResult[1000] ={0};
-	char pathResult2[1000] ={0};
-
-	int currentLength = buildPathFromStack(&dirStack, pathResult, sizeof(pathResult));
+	return linkin(cwdinum(), token[curr+1], token[curr+2]);
+}
 
-	Lstrcpy(pathResult2, pathResult);
-	// Ensure there's a slash before, but avoid a double slash
-	if (currentLength > 0 && pathResult[currentLength - 1] != '/') {
-		Lstrcpy(pathResult + currentLength, "/");
-		Lstrcpy(pathResult2 + currentLength, "/");
-		currentLength++;
+/*****************************
+ * IMPLEMENTING UPLOADTREE COMMAND
+ ****************************/
+/*
+  Write the output of ls -R / to a host file, by pointing fd 1 at it
+  for the duration (as the server does for client sockets).
+*/
+int
+uploadtreeCommand(char *token[], int curr){
+	if (token[curr+1] == NULL) {
+		return -1;
+	}
+	int fd = Lopen(token[curr+1], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		return -1;
 	}
-   	Lstrcpy(pathResult + currentLength, token[curr+1]);
-	Lstrcpy(pathResult2 + currentLength, token[curr+2]);
+	int saved = Ldup(1);
+	Ldup2(fd, 1);
+	int rc = lsrecursive(ROOTINO, "/");
+	Ldup2(saved, 1);
+	Lclose(saved);
+	Lclose(fd);
+	return rc;
+}
 
-	return link(pathResult, pathResult2);
+/*****************************
+ * IMPLEMENTING TRACE COMMAND
+ ****************************/
+/*
+  trace on [nrec]    start a fresh ring (Ltrace.h)
+  trace off          stop, keeping the ring for a dump
+  trace dump path    write the ring to the host file path
+*/
+void
+traceCommand(char *token[], int curr){
+	char *arg = token[curr+1];
+
+	if (arg != NULL && Lstrcmp(arg, "on") == 0) {
+		if (trace_start(token[curr+2] ? Latoi(token[curr+2]) : 0) < 0)
+			Lprintf("Could not start trace\n");
+	} else if (arg != NULL && Lstrcmp(arg, "off") == 0) {
+		trace_stop();
+	} else if (arg != NULL && Lstrcmp(arg, "dump") == 0 && token[curr+2] != NULL) {
+		int n = trace_dump(token[curr+2]);
+		if (n < 0)
+			Lprintf("Could not dump trace to %s\n", token[curr+2]);
+		else
+			Lprintf("%d records\n", n);
+	} else {
+		Lprintf("Usage:  trace on [nrec] | off | dump path\n");
+	}
 }
 
 /*****************************
@@ -475,12 +699,22 @@ help(){
   Lwrite(1,"| cd [path] | Change directory to path (or to /)                     |\n",72);
   Lwrite(1,"| ls [-d]   | List path as in ls -ail                                |\n",72);
   Lwrite(1,"| [-R] [path]|                                                       |\n",72);
-  Lwrite(1,"| creat path| Create file at path (like touch)                       |\n",72);
-  Lwrite(1,"| mkdir path| Create directory at path                               |\n",72);
+  Lwrite(1,"| creat path| Create files at the paths (like touch)                 |\n",72);
+  Lwrite(1,"| ...       |                                                        |\n",72);
+  Lwrite(1,"| mkdir [-p]| Create directories (-p:  and missing parents)          |\n",72);
+  Lwrite(1,"| path ...  |                                                        |\n",72);
+  Lwrite(1,"| rm [-r]   | Remove files (-r:  directories, with their contents)   |\n",72);
+  Lwrite(1,"| path ...  |                                                        |\n",72);
   Lwrite(1,"| unlink path| Like rm and rmdir                                     |\n",72);
   Lwrite(1,"| link      | Like ln                                                |\n",72);
   Lwrite(1,"| oldpath   | newpath                                                |\n",72);
   Lwrite(1,"| sync      | Write all cached dirty buffers to device blocks        |\n",72);
+  Lwrite(1,"| dumpfs [n]| Dump superblock and first n inodes (alias: stat)       |\n",72);
+  Lwrite(1,"| stats     | Counters and per-command latency (reset, json)         |\n",72);
+  Lwrite(1,"| trace     | Block access trace:  on [n], off, dump hostfile        |\n",72);
+  Lwrite(1,"| defrag    | Make files contiguous                                  |\n",72);
+  Lwrite(1,"| [-n]      | (-n:  only report fragmentation)                       |\n",72);
+  Lwrite(1,"| df        | Free and used data blocks and inodes                   |\n",72);
   Lwrite(1,"| quit      | Exit CLI (should also sync)                            |\n",72);
   Lwrite(1,"+-----------+--------------------------------------------------------+\n",72);
   Lwrite(1,"| Additional CLI commands:                                           |\n",72);
@@ -492,23 +726,166 @@ help(){
   Lwrite(1,"| upload    | Copy path in filesystem image to host                  |\n",72);
   Lwrite(1,"| path      | filename                                               |\n",72);
   Lwrite(1,"| download  | Copy a host file into filesystem image at path         |\n",72);
-  Lwrite(1,"| filename  | path                                                   |\n",72);
+  Lwrite(1,"| [-z] [-d] | file path   (-z:  store compressed,                    |\n",72);
+  Lwrite(1,"|           |   -d:  share blocks identical to ones in the image)    |\n",72);
   Lwrite(1,"+-----------+--------------------------------------------------------+\n",72);
 }
 
+/*****************************
+ * IMPLEMENTING CREAT, MKDIR AND RM
+ ****************************/
+/*
+  creat path ...:  consecutive paths in the same directory are created
+  together with createmany() (one pass over that directory).
+*/
+void
+creatCommand(char *token[], int curr){
+	char *names[NTOKS];
+	uint inums[NTOKS];
+	int t = curr + 1;
+
+	while (token[t] != NULL) {
+		uint dir = 0;
+		int n = 0;
+		for (; token[t] != NULL; t++) {
+			char *name = Larena_alloc(&cmdarena, DIRSIZ + 1);
+			uint parent;
+			if (name == NULL)
+				return;
+			name[0] = '\0';
+			parent = nameiparentat(cwdinum(), token[t], name);
+			if (parent == 0 || name[0] == '\0') {
+				Lprintf("Could not create %s\n", token[t]);
+				continue;
+			}
+			if (n > 0 && parent != dir)
+				break;
+			dir = parent;
+			names[n++] = name;
+		}
+		if (n == 0)
+			continue;
+		int made = createmany(dir, names, n, inums);
+		for (int i = 0; i < n; i++)
+			if (made < 0 || inums[i] == 0)
+				Lprintf("Could not create %s\n", names[i]);
+	}
+}
+
+/* mkdir [-p] path ... */
+void
+mkdirCommand(char *token[], int curr){
+	int t = curr + 1, parents = 0;
+
+	if (token[t] != NULL && Lstrcmp(token[t], "-p") == 0) {
+		parents = 1;
+		t++;
+	}
+	for (; token[t] != NULL; t++) {
+		char name[DIRSIZ+1] = {0};
+		uint parent, inum = -1;
+
+		if (parents)
+			inum = mkdirs(cwdinum(), token[t]);
+		else if ((parent = nameiparentat(cwdinum(), token[t], name)) != 0 && name[0] != '\0')
+			inum = mkdirat(parent, name);
+		if (inum == (uint) -1)
+			Lprintf("Could not create directory %s\n", token[t]);
+	}
+}
+
+/* rm [-r] path ...:  without -r, directories are left alone */
+void
+rmCommand(char *token[], int curr){
+	int t = curr + 1, recursive = 0;
+	struct dinode inode;
+
+	if (token[t] != NULL && Lstrcmp(token[t], "-r") == 0) {
+		recursive = 1;
+		t++;
+	}
+	for (; token[t] != NULL; t++) {
+		uint inum = nameiat(cwdinum(), token[t]);
+		if (inum == 0 || getinode(&inode, inum) == -1) {
+			Lprintf("Could not remove %s (no such file)\n", token[t]);
+		} else if (inode.type == T_DIR && !recursive) {
+			Lprintf("Could not remove %s (a directory)\n", token[t]);
+		} else if (oncwdpath(inum)) {
+			Lprintf("Could not remove %s (a CWD is in it)\n", token[t]);
+		} else if ((recursive ? removetree(cwdinum(), token[t]) : unlinkin(cwdinum(), token[t])) < 0) {
+			Lprintf("Could not remove %s\n", token[t]);
+		}
+	}
+}
+
+/*****************************
+ * IMPLEMENTING DF COMMAND
+ ****************************/
+/*
+  df:  data blocks and inodes, used and free, from the counters kept
+  by the allocators (no bitmap or inode table scan).
+*/
+void
+dfCommand(void){
+	struct fsusage u;
+
+	if (fsusage(&u) < 0) {
+		Lprintf("Could not read the free block bitmap or inodes\n");
+		return;
+	}
+	Lprintf("blocks: %u total, %u used, %u free (%u%% used)\n",
+		u.blocks, u.blocks - u.bfree, u.bfree,
+		u.blocks ? (u.blocks - u.bfree) * 100 / u.blocks : 0);
+	Lprintf("inodes: %u total, %u used, %u free\n",
+		u.inodes, u.inodes - u.ifree, u.ifree);
+}
+
+/*****************************
+ * IMPLEMENTING DEFRAG COMMAND
+ ****************************/
+/*
+  defrag [-n]:  report fragmentation, then (unless -n) relocate
+  fragmented files and report it again.
+*/
+void
+defragCommand(char *token[], int curr){
+	struct fragstat before, pass, after;
+
+	defrag(0, &before);
+	Lprintf("before: files=%d fragmented=%d blocks=%d extents=%d\n",
+		before.files, before.fragmented, before.blocks, before.extents);
+	if (token[curr+1] != NULL && Lstrcmp(token[curr+1], "-n") == 0) {
+		return;
+	}
+	defrag(1, &pass);
+	defrag(0, &after);
+	Lprintf("after:  files=%d fragmented=%d blocks=%d extents=%d moved=%d stuck=%d\n",
+		after.files, after.fragmented, after.blocks, after.extents,
+		pass.moved, pass.stuck);
+}
+
 /****************************
  * IMPLEMENTING STACK
  ***************************/
 
 // Push a directory onto the stack
 void push(DirectoryStack *stack, CWD dir) {
-    // checks if stack is full
-    if (stack->top < STACK_SIZE - 1) {
-        stack->top++;
-        stack->entries[stack->top] = dir;
-    } else {
-        //Do something when the stack is full
+    // checks if stack is full:  then double it
+    if (stack->top + 1 >= stack->cap) {
+        int cap = stack->cap ? 2 * stack->cap : 8;
+        CWD *entries = Lmalloc(cap * sizeof(CWD));
+        if (entries == NULL) {
+            return; // Out of memory:  stay where we are
+        }
+        if (stack->entries != NULL) {
+            Lmemcpy(entries, stack->entries, (stack->top + 1) * sizeof(CWD));
+            Lfree(stack->entries);
+        }
+        stack->entries = entries;
+        stack->cap = cap;
     }
+    stack->top++;
+    stack->entries[stack->top] = dir;
 }
 
 // Pop a directory from the stack
@@ -573,17 +950,69 @@ int buildPathFromStack(const DirectoryStack *stack, char *resultPath, int result
     return currentLength;
 }
 
+/* Inode of the CWD:  the top of the directory stack */
+uint cwdinum(void) {
+    return dirStack.top >= 0 ? dirStack.entries[dirStack.top].inum : ROOTINO;
+}
+
+/*
+  Is inum the CWD or a directory above it, here or (--serve) in any
+  client's session?  Those cannot be removed:  the stack would keep
+  their inode numbers after they are freed.
+*/
+int oncwdpath(uint inum) {
+    for (int i = 0; i <= dirStack.top; i++) {
+        if (dirStack.entries[i].inum == inum) {
+            return 1;
+        }
+    }
+    return server_oncwdpath(inum);
+}
+
+/*
+  The absolute path of name relative to the CWD (or of the CWD itself
+  if name is NULL), in cmdarena, so it lives until the command ends.
+*/
+char *cwdPath(const char *name) {
+    int size = 2;
+    for (int i = 0; i <= dirStack.top; i++) {
+        size += Lstrlen(dirStack.entries[i].name) + 1;
+    }
+    if (name != NULL) {
+        size += Lstrlen((char *)name);
+    }
+    char *path = Larena_alloc(&cmdarena, size);
+    if (path == NULL) {
+        return NULL;
+    }
+    int currentLength = buildPathFromStack(&dirStack, path, size);
+    if (name != NULL) {
+        // Ensure there's a slash before, but avoid a double slash
+        if (currentLength > 0 && path[currentLength - 1] != '/') {
+            path[currentLength++] = '/';
+        }
+        Lstrcpy(path + currentLength, name);
+    }
+    return path;
+}
+
+/*
+  path itself if absolute, else relative to the CWD (in cmdarena).
+*/
+char *absPath(const char *path) {
+    if (path[0] == '/') {
+        return (char *)path;
+    }
+    return cwdPath(path);
+}
+
+/* gcc emits calls to these for struct copies; see Lmem.c */
 void *memcpy(void *dest, const void *src, size_t n) {
-    char *d = dest;
-    const char *s = src;
-    while (n--) *d++ = *s++;
-    return dest;
+    return Lmemcpy(dest, src, n);
 }
 
 void *memset(void *s, int c, size_t n) {
-    unsigned char *p = s;
-    while (n--) *p++ = (unsigned char)c;
-    return s;
+    return Lmemset(s, c, n);
 }
 
 
@@ -7,3 +7,24 @@
 #include "posix-calls.h"
 #include "Llibc.h"
 #include "Ldiskio.h"
+#include "Lalloc.h"
+
+#define LINESIZE 1024   /* Line buffer size */
+
+/*
+  CWD tracking (Lcli.c):  a stack of path components with their inodes.
+  entries is grown with Lmalloc as cd goes deeper (see push()).
+*/
+typedef struct{
+	uint inum;
+	char name[DIRSIZ+1];
+} CWD;
+
+typedef struct{
+    CWD *entries;
+    int top;
+    int cap;
+} DirectoryStack;
+
+uint cwdinum(void);
+/* Inode of the CWD, where relative paths start (nameiat() and co.) */
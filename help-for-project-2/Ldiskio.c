@@ -4,6 +4,54 @@
 #include "fs.h"
 #include "buf.h"
 #include "Ldiskio.h"
+#include "Lstats.h"
+#include "Ltrace.h"
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#ifndef O_DIRECT
+#define O_DIRECT 040000     /* Same on x86_64 and riscv64 */
+#endif
+#define EINTR 4
+
+int disk_direct;
+
+/*
+   O_DIRECT transfers must be aligned to the device's logical block in
+   memory, offset and length.  Buffers are (Lbio.c's slab) and every
+   transfer is whole BSIZE blocks; whether BSIZE is a multiple of the
+   logical block is only known by trying, so read block 0 once.
+*/
+static int
+direct_probe(int fd)
+{
+	static uchar blk[BSIZE] __attribute__((aligned(4096)));
+
+	return Lsyscall(SYS_pread64, fd, blk, BSIZE, 0) == BSIZE ? 0 : -1;
+}
+
+int
+disk_open(const char *path, int direct)
+{
+	int fd;
+
+	if (direct) {
+		if ((fd = Lopen(path, O_RDWR | O_DIRECT)) < 0)
+			fd = Lopen(path, O_RDONLY | O_DIRECT);
+		if (fd >= 0 && direct_probe(fd) == 0) {
+			disk_direct = 1;
+			return fd;
+		}
+		if (fd >= 0)
+			Lclose(fd);
+		Lfprintf(2, "%s:  no direct I/O here, using the page cache\n", path);
+	}
+	/* Read-write for creat, mkdir, link, unlink; a read-only image
+	   still serves pwd, ls, cd and upload */
+	if ((fd = Lopen(path, O_RDWR)) < 0)
+		fd = Lopen(path, O_RDONLY);
+	return fd;
+}
 
 /* This reads or writes one disk block at raw low level  */
 void
@@ -11,6 +59,14 @@ disk_block_rw(struct buf *b, int writeflag)
 {
 	b->disk_rw_fail = 0;
 
+	TRACE(writeflag ? TR_DISKWRITE : TR_DISKREAD, b->dev_fd, b->blockno, 0);
+	if (writeflag) {
+		STAT_INC(disk_write_blocks);
+		STAT_ADD(disk_write_syscalls, 2);
+	} else {
+		STAT_INC(disk_read_blocks);
+		STAT_ADD(disk_read_syscalls, 2);
+	}
 	if (Llseek(b->dev_fd, b->blockno * BSIZE, SEEK_SET) < 0)
 		b->disk_rw_fail = 1;
 	else {	/* seek successful */
@@ -24,4 +80,228 @@ disk_block_rw(struct buf *b, int writeflag)
 	}
 }
 
+/*
+    Batched asynchronous I/O.
+
+    disk_aio_init() tries to set up an io_uring with raw syscalls (no
+    liburing under -nostdlib).  If the kernel lacks io_uring or refuses
+    it (seccomp, sysctl), every batch instead goes out as preadv/pwritev
+    calls, one per run of consecutive block numbers.
+
+    One ring serves the whole process; aio.lock serializes batches.
+*/
+static struct {
+	struct spinlock lock;
+	int mode;		/* DISK_AIO_* */
+	int ringfd;
+	uint depth;		/* SQ entries */
+	/* SQ ring */
+	uint *sq_head, *sq_tail, *sq_mask, *sq_array;
+	struct io_uring_sqe *sqes;
+	/* CQ ring */
+	uint *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+	int nregistered;	/* Buffers registered for READ/WRITE_FIXED */
+} aio;
+
+static void *
+ring_mmap(long size, long offset)
+{
+	void *p = (void *) Lsyscall(SYS_mmap, 0, size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, aio.ringfd, offset);
+	return ((long) p < 0 && (long) p > -4096) ? 0 : p;
+}
+
+int
+disk_aio_init(int depth)
+{
+	struct io_uring_params p;
+	char *sq, *cq;
+	long sqsize, cqsize;
+
+	initlock(&aio.lock, "aio");
+	aio.mode = DISK_AIO_VECTORED;
+	Lmemset(&p, 0, sizeof(p));
+	if ((aio.ringfd = Lsyscall(SYS_io_uring_setup, depth, &p)) < 0)
+		return aio.mode;
+
+	sqsize = p.sq_off.array + p.sq_entries * sizeof(uint);
+	cqsize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (cqsize > sqsize)
+			sqsize = cqsize;
+		sq = cq = ring_mmap(sqsize, IORING_OFF_SQ_RING);
+	} else {
+		sq = ring_mmap(sqsize, IORING_OFF_SQ_RING);
+		cq = ring_mmap(cqsize, IORING_OFF_CQ_RING);
+	}
+	aio.sqes = ring_mmap(p.sq_entries * sizeof(struct io_uring_sqe), IORING_OFF_SQES);
+	if (sq == 0 || cq == 0 || aio.sqes == 0) {
+		Lclose(aio.ringfd);
+		return aio.mode;
+	}
+	aio.sq_head = (uint *) (sq + p.sq_off.head);
+	aio.sq_tail = (uint *) (sq + p.sq_off.tail);
+	aio.sq_mask = (uint *) (sq + p.sq_off.ring_mask);
+	aio.sq_array = (uint *) (sq + p.sq_off.array);
+	aio.cq_head = (uint *) (cq + p.cq_off.head);
+	aio.cq_tail = (uint *) (cq + p.cq_off.tail);
+	aio.cq_mask = (uint *) (cq + p.cq_off.ring_mask);
+	aio.cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+	aio.depth = p.sq_entries;
+	aio.mode = DISK_AIO_URING;
+	return aio.mode;
+}
+
+int
+disk_aio_register(struct buf *bufs, int n)
+{
+	struct iovec iov[DISK_AIO_MAXREG];
 
+	if (aio.mode != DISK_AIO_URING || n > DISK_AIO_MAXREG)
+		return -1;
+	for (int i = 0; i < n; i++) {
+		iov[i].iov_base = bufs[i].data;
+		iov[i].iov_len = BSIZE;
+	}
+	if (Lsyscall(SYS_io_uring_register, aio.ringfd, IORING_REGISTER_BUFFERS, iov, n) < 0)
+		return -1;
+	for (int i = 0; i < n; i++)
+		bufs[i].bufidx = i + 1;
+	aio.nregistered = n;
+	return 0;
+}
+
+static void vectored_batch(struct buf **bs, int n, int writeflag);
+
+/* Queue up to n requests on the ring, submit, and reap them all */
+static void
+uring_batch(struct buf **bs, int n, int writeflag)
+{
+	uint tail = *aio.sq_tail;
+	uint mask = *aio.sq_mask;
+
+	for (int i = 0; i < n; i++) {
+		struct buf *b = bs[i];
+		uint idx = tail & mask;
+		struct io_uring_sqe *sqe = &aio.sqes[idx];
+
+		Lmemset(sqe, 0, sizeof(*sqe));
+		if (b->bufidx > 0 && b->bufidx <= aio.nregistered) {
+			sqe->opcode = writeflag ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+			sqe->buf_index = b->bufidx - 1;
+		} else
+			sqe->opcode = writeflag ? IORING_OP_WRITE : IORING_OP_READ;
+		sqe->fd = b->dev_fd;
+		sqe->off = (uint64) b->blockno * BSIZE;
+		sqe->addr = (uint64) b->data;
+		sqe->len = BSIZE;
+		sqe->user_data = (uint64) b;
+		aio.sq_array[idx] = idx;
+		b->disk_rw_fail = 1;	/* Until its completion says otherwise */
+		tail++;
+	}
+	__atomic_store_n(aio.sq_tail, tail, __ATOMIC_RELEASE);
+
+	int submitted = 0, done = 0;
+	while (done < n) {
+		long r = Lsyscall(SYS_io_uring_enter, aio.ringfd, n - submitted,
+			n - done, IORING_ENTER_GETEVENTS, 0, 0);
+		if (writeflag)
+			STAT_INC(disk_write_syscalls);
+		else
+			STAT_INC(disk_read_syscalls);
+		if (r < 0 && submitted == 0) {
+			/* Ring unusable:  take the batch back, go vectored for good */
+			__atomic_store_n(aio.sq_tail, tail - n, __ATOMIC_RELEASE);
+			aio.mode = DISK_AIO_VECTORED;
+			vectored_batch(bs, n, writeflag);
+			return;
+		}
+		if (r > 0)
+			submitted += r;
+		uint head = *aio.cq_head;
+		while (head != __atomic_load_n(aio.cq_tail, __ATOMIC_ACQUIRE)) {
+			struct io_uring_cqe *cqe = &aio.cqes[head & *aio.cq_mask];
+			struct buf *b = (struct buf *) cqe->user_data;
+			b->disk_rw_fail = (cqe->res != BSIZE);
+			head++;
+			done++;
+		}
+		__atomic_store_n(aio.cq_head, head, __ATOMIC_RELEASE);
+		if (r < 0 && r != -EINTR) {
+			/* Broke mid-batch:  what has not completed stays failed,
+			   and later batches go vectored */
+			aio.mode = DISK_AIO_VECTORED;
+			break;
+		}
+	}
+}
+
+/* Sort by block number, so adjacent blocks become one vectored call */
+static void
+sort_by_blockno(struct buf **bs, int n)
+{
+	for (int i = 1; i < n; i++) {
+		struct buf *b = bs[i];
+		int j = i - 1;
+		for (; j >= 0 && bs[j]->blockno > b->blockno; j--)
+			bs[j + 1] = bs[j];
+		bs[j + 1] = b;
+	}
+}
+
+static void
+vectored_batch(struct buf **bs, int n, int writeflag)
+{
+	struct iovec iov[DISK_AIO_MAXBATCH];
+
+	sort_by_blockno(bs, n);
+	for (int i = 0; i < n; ) {
+		int run = 1;
+		while (i + run < n && bs[i + run]->blockno == bs[i]->blockno + run
+		    && bs[i + run]->dev_fd == bs[i]->dev_fd)
+			run++;
+		for (int k = 0; k < run; k++) {
+			iov[k].iov_base = bs[i + k]->data;
+			iov[k].iov_len = BSIZE;
+		}
+		/* riscv64 and x86_64 pass the 64-bit offset as one register;
+		   the trailing 0 is the (unused) high half */
+		long got = Lsyscall(writeflag ? SYS_pwritev : SYS_preadv, bs[i]->dev_fd,
+			iov, run, (long) bs[i]->blockno * BSIZE, 0);
+		if (writeflag)
+			STAT_INC(disk_write_syscalls);
+		else
+			STAT_INC(disk_read_syscalls);
+		for (int k = 0; k < run; k++)
+			bs[i + k]->disk_rw_fail = got < (long) (k + 1) * BSIZE;
+		i += run;
+	}
+}
+
+void
+disk_block_rw_batch(struct buf **bs, int n, int writeflag)
+{
+	if (writeflag)
+		STAT_ADD(disk_write_blocks, n);
+	else
+		STAT_ADD(disk_read_blocks, n);
+	for (int i = 0; trace_on && i < n; i++)
+		TRACE(writeflag ? TR_DISKWRITE : TR_DISKREAD, bs[i]->dev_fd, bs[i]->blockno, 0);
+	acquire(&aio.lock);
+	while (n > 0) {
+		int chunk = n;
+		if (chunk > DISK_AIO_MAXBATCH)
+			chunk = DISK_AIO_MAXBATCH;
+		if (aio.mode == DISK_AIO_URING && chunk > aio.depth)
+			chunk = aio.depth;
+		if (aio.mode == DISK_AIO_URING)
+			uring_batch(bs, chunk, writeflag);
+		else
+			vectored_batch(bs, chunk, writeflag);
+		bs += chunk;
+		n -= chunk;
+	}
+	release(&aio.lock);
+}
@@ -1,2 +1,31 @@
+
+int disk_open(const char *path, int direct);
+extern int disk_direct;
+/*
+   Open the image, read-write if possible.  With direct, block I/O
+   bypasses the host page cache (O_DIRECT), so blocks are cached once,
+   in bcache, not twice; if the file system rejects it, the image is
+   opened as usual.  disk_direct tells which one happened.  Returns
+   the fd, or -1.
+*/
+
 /* Low level raw disk I/O:  Read or write one disk block directly */
 void disk_block_rw(struct buf *b, int readwriteflag);
+
+/*
+   Batched disk I/O (many blocks in flight at once).
+   disk_aio_init() returns the engine it ended up with.
+*/
+#define DISK_AIO_VECTORED 0   /* preadv/pwritev per run of adjacent blocks */
+#define DISK_AIO_URING    1   /* io_uring, raw syscalls */
+#define DISK_AIO_MAXBATCH 64
+#define DISK_AIO_MAXREG   1024  /* Registered buffers */
+
+int disk_aio_init(int depth);
+int disk_aio_register(struct buf *bufs, int n);   /* For READ/WRITE_FIXED */
+void disk_block_rw_batch(struct buf **bs, int n, int readwriteflag);
+/*
+   Read or write bs[0..n) and wait for all of them; each buf's
+   disk_rw_fail is set as by disk_block_rw().  The order of bs[] may
+   change.  Callers hold each buf's sleep lock.
+*/
@@ -0,0 +1,107 @@
+#include "posix-calls.h"
+#include "Llock.h"
+#include <linux/futex.h>
+
+/*
+   Futex wrappers.  All our locks live in one address space, so the
+   private variants (no shared-mapping hash lookups) are always right.
+*/
+int
+Lfutex_wait(int *addr, int val)
+{
+  return Lsyscall(SYS_futex, addr, FUTEX_WAIT | FUTEX_PRIVATE_FLAG, val, 0, 0, 0);
+}
+
+int
+Lfutex_wake(int *addr, int nwake)
+{
+  return Lsyscall(SYS_futex, addr, FUTEX_WAKE | FUTEX_PRIVATE_FLAG, nwake, 0, 0, 0);
+}
+
+#define SPINS 100   /* Tries before a spinlock sleeps */
+
+/* The lock word protocol, after Drepper's "Futexes Are Tricky" */
+static void
+lockword_acquire(int *w, int spins)
+{
+  int c = 0;
+
+  for (int i = 0; i <= spins; i++) {
+    c = 0;
+    if (__atomic_compare_exchange_n(w, &c, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+      return;
+    if (c == 2)
+      break;    /* Others are already asleep:  join them */
+  }
+  if (c != 2)
+    c = __atomic_exchange_n(w, 2, __ATOMIC_ACQUIRE);
+  while (c != 0) {
+    Lfutex_wait(w, 2);
+    c = __atomic_exchange_n(w, 2, __ATOMIC_ACQUIRE);
+  }
+}
+
+static void
+lockword_release(int *w)
+{
+  if (__atomic_exchange_n(w, 0, __ATOMIC_RELEASE) == 2)
+    Lfutex_wake(w, 1);
+}
+
+void
+initlock(struct spinlock *lk, char *name)
+{
+  lk->locked = 0;
+  lk->name = name;
+}
+
+void
+acquire(struct spinlock *lk)
+{
+  lockword_acquire(&lk->locked, SPINS);
+}
+
+void
+release(struct spinlock *lk)
+{
+  lockword_release(&lk->locked);
+}
+
+int
+holding(struct spinlock *lk)
+{
+  return __atomic_load_n(&lk->locked, __ATOMIC_RELAXED) != 0;
+}
+
+void
+initsleeplock(struct sleeplock *lk, char *name)
+{
+  lk->locked = 0;
+  lk->name = name;
+}
+
+void
+acquiresleep(struct sleeplock *lk)
+{
+  lockword_acquire(&lk->locked, 0);
+}
+
+int
+tryacquiresleep(struct sleeplock *lk)
+{
+  int c = 0;
+
+  return __atomic_compare_exchange_n(&lk->locked, &c, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+void
+releasesleep(struct sleeplock *lk)
+{
+  lockword_release(&lk->locked);
+}
+
+int
+holdingsleep(struct sleeplock *lk)
+{
+  return __atomic_load_n(&lk->locked, __ATOMIC_RELAXED) != 0;
+}
@@ -0,0 +1,45 @@
+/*
+
+File Llock.h
+
+xv6-style locks for Llibc programs, built on linux futexes (Llock.c).
+
+    struct spinlock   short critical sections (bcache hash buckets):
+                      spins briefly, then sleeps in the kernel
+    struct sleeplock  long holds (a buffer across disk I/O):
+                      sleeps right away
+
+Both use the same lock word:  0 = free, 1 = held, 2 = held with
+waiters, so release() only makes a futex syscall when someone waits.
+
+*/
+
+#ifndef LLOCK_H
+#define LLOCK_H
+
+struct spinlock {
+  int locked;   // 0, 1 or 2 (see above)
+  char *name;   // For debugging
+};
+
+struct sleeplock {
+  int locked;   // 0, 1 or 2 (see above)
+  char *name;   // For debugging
+};
+
+void initlock(struct spinlock *lk, char *name);
+void acquire(struct spinlock *lk);
+void release(struct spinlock *lk);
+int  holding(struct spinlock *lk);
+
+void initsleeplock(struct sleeplock *lk, char *name);
+void acquiresleep(struct sleeplock *lk);
+int  tryacquiresleep(struct sleeplock *lk);   /* 1 if acquired */
+void releasesleep(struct sleeplock *lk);
+int  holdingsleep(struct sleeplock *lk);
+/*
+  Without per-thread storage there is no cheap thread id, so holding()
+  and holdingsleep() only tell whether the lock is held by anyone.
+*/
+
+#endif
@@ -0,0 +1,153 @@
+#include "types.h"
+#include "Llibc.h"
+#include "Llz4.h"
+
+#define MINMATCH      4
+#define LASTLITERALS  5     /* The last 5 bytes are always literals */
+#define MFLIMIT       12    /* No match starts in the last 12 bytes */
+#define HASHLOG       12
+
+static uint
+read32(const uchar *p)
+{
+  return p[0] | p[1] << 8 | p[2] << 16 | (uint) p[3] << 24;
+}
+
+static uint
+hash(uint v)
+{
+  return (v * 2654435761U) >> (32 - HASHLOG);
+}
+
+/* An LZ4 length:  15 in the token, then bytes of 255 and the rest */
+static uchar *
+putlen(uchar *op, uint len)
+{
+  for (len -= 15; len >= 255; len -= 255)
+    *op++ = 255;
+  *op++ = len;
+  return op;
+}
+
+/* One sequence:  token, literals anchor[0..litlen), then the match */
+static uchar *
+putseq(uchar *op, uchar *oend, const uchar *anchor, uint litlen, uint offset, uint mlen)
+{
+  uchar *token = op++;
+
+  /* Worst case for the lengths, the literals and the offset */
+  if (op + litlen / 255 + 1 + litlen + 2 + mlen / 255 + 1 > oend)
+    return 0;
+  *token = (litlen >= 15 ? 15 : litlen) << 4;
+  if (litlen >= 15)
+    op = putlen(op, litlen);
+  Lmemcpy(op, anchor, litlen);
+  op += litlen;
+  if (offset == 0)          /* Last sequence:  literals only */
+    return op;
+  *op++ = offset;
+  *op++ = offset >> 8;
+  mlen -= MINMATCH;
+  *token |= mlen >= 15 ? 15 : mlen;
+  if (mlen >= 15)
+    op = putlen(op, mlen);
+  return op;
+}
+
+int
+Llz4_compress(const char *src, int n, char *dst, int cap)
+{
+  const uchar *base = (const uchar *) src, *ip = base, *anchor = base;
+  const uchar *end = base + n;
+  uchar *op = (uchar *) dst, *oend = op + cap;
+  ushort table[1 << HASHLOG];   /* Last position with each hash */
+
+  if (n < 0 || n > LZ4_MAXINPUT || cap < 1)
+    return 0;
+  if (n > MFLIMIT) {
+    const uchar *mflimit = end - MFLIMIT, *matchlimit = end - LASTLITERALS;
+
+    Lmemset(table, 0, sizeof(table));
+    ip++;
+    while (ip < mflimit) {
+      uint h = hash(read32(ip));
+      const uchar *ref = base + table[h];
+
+      table[h] = ip - base;
+      if (ref >= ip || read32(ref) != read32(ip)) {
+        ip++;
+        continue;
+      }
+      /* Extend the match backward into the literals, then forward */
+      while (ip > anchor && ref > base && ip[-1] == ref[-1]) {
+        ip--;
+        ref--;
+      }
+      const uchar *mp = ip + MINMATCH, *mr = ref + MINMATCH;
+      while (mp < matchlimit && *mp == *mr) {
+        mp++;
+        mr++;
+      }
+      if ((op = putseq(op, oend, anchor, ip - anchor, ip - ref, mp - ip)) == 0)
+        return 0;
+      ip = anchor = mp;
+    }
+  }
+  if ((op = putseq(op, oend, anchor, end - anchor, 0, 0)) == 0)
+    return 0;
+  return op - (uchar *) dst;
+}
+
+/* Add the extension bytes of a length of 15; 0 if src ran out */
+static const uchar *
+getlen(const uchar *ip, const uchar *iend, uint *len)
+{
+  uint b;
+
+  do {
+    if (ip >= iend)
+      return 0;
+    b = *ip++;
+    *len += b;
+  } while (b == 255);
+  return ip;
+}
+
+int
+Llz4_decompress(const char *src, int clen, char *dst, int cap)
+{
+  const uchar *ip = (const uchar *) src, *iend = ip + clen;
+  uchar *op = (uchar *) dst, *oend = op + cap;
+
+  while (ip < iend) {
+    uint token = *ip++;
+    uint len = token >> 4;
+
+    if (len == 15 && (ip = getlen(ip, iend, &len)) == 0)
+      return -1;
+    if (len > iend - ip || len > oend - op)
+      return -1;
+    Lmemcpy(op, ip, len);
+    op += len;
+    ip += len;
+    if (ip == iend)         /* The last sequence has no match */
+      break;
+
+    if (iend - ip < 2)
+      return -1;
+    uint offset = ip[0] | ip[1] << 8;
+    ip += 2;
+    if (offset == 0 || offset > op - (uchar *) dst)
+      return -1;
+    len = token & 15;
+    if (len == 15 && (ip = getlen(ip, iend, &len)) == 0)
+      return -1;
+    len += MINMATCH;
+    if (len > oend - op)
+      return -1;
+    /* Byte by byte:  the match may overlap what it produces */
+    for (const uchar *m = op - offset; len > 0; len--)
+      *op++ = *m++;
+  }
+  return op - (uchar *) dst;
+}
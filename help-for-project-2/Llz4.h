@@ -0,0 +1,34 @@
+/*
+
+File Llz4.h
+
+A small LZ4 codec (Llz4.c):  the LZ4 block format (literal runs and
+matches with 16-bit offsets, no frame header), so data it writes can
+also be read with the reference lz4 library's LZ4_decompress_safe().
+Used for I_LZ file clusters (fs.h).
+
+The compressor is the simple greedy one (one hash table probe per
+position), which is fast and good enough for text.  The decompressor
+checks every length and offset, so a corrupt block cannot make it
+write outside dst.
+
+*/
+
+#ifndef LLZ4_H
+#define LLZ4_H
+
+#define LZ4_MAXINPUT  65535        /* Largest n for Llz4_compress */
+
+int     Llz4_compress(const char *src, int n, char *dst, int cap);
+/*
+  Compress src[0..n) into dst[0..cap).  Returns the compressed size,
+  or 0 if it does not fit in cap (or n > LZ4_MAXINPUT).
+*/
+
+int     Llz4_decompress(const char *src, int clen, char *dst, int cap);
+/*
+  Decompress src[0..clen) into dst[0..cap).  Returns the size of the
+  data, or -1 if src is malformed or the data does not fit.
+*/
+
+#endif
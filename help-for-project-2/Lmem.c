@@ -0,0 +1,261 @@
+#include "Llibc.h"
+#include "types.h"
+#include "Lmem.h"
+
+/*
+    Lmemcpy, Lmemmove, Lmemset and Lmemcmp with aligned 64-bit words
+    instead of bytes.  The destination is aligned first; a source with
+    a different alignment is still read as aligned words and shifted
+    into place (little endian), since misaligned loads may trap and be
+    emulated on RISC-V.  Short calls (under WMIN bytes) just use bytes.
+
+    Careful:  nothing in here may call memcpy/memset, even implicitly
+    (struct assignment, "= {0}"), as Lcli.c forwards those to us.
+*/
+
+#define WSIZE   8
+#define WMIN    16
+#define WALIGN(p) (((ulong) (p) & (WSIZE - 1)) == 0)
+
+typedef uint64 word __attribute__((may_alias));
+
+#ifdef __riscv
+/* Lmem-riscv64.S */
+void*   Lmemcpy_rvv(void *dst, const void *src, ulong n);
+void*   Lmemmove_rvv(void *dst, const void *src, ulong n);
+void*   Lmemset_rvv(void *dst, int c, ulong n);
+int     Lmemcmp_rvv(const void *s1, const void *s2, ulong n);
+
+#define AT_HWCAP        16
+#define HWCAP_ISA_V     (1UL << ('V' - 'A'))
+#endif
+
+static int variant = -1;
+
+#ifdef __riscv
+/* AT_HWCAP from /proc/self/auxv, or 0 */
+static ulong
+hwcap(void)
+{
+  ulong auxv[2*16];
+  long n;
+  int fd;
+
+  if ((fd = Lopen("/proc/self/auxv", O_RDONLY)) < 0)
+    return 0;
+  while ((n = Lread(fd, auxv, sizeof(auxv))) > 0) {
+    for (int i = 0; i + 1 < n / sizeof(ulong); i += 2) {
+      if (auxv[i] == AT_HWCAP) {
+        Lclose(fd);
+        return auxv[i+1];
+      }
+    }
+  }
+  Lclose(fd);
+  return 0;
+}
+#endif
+
+static void
+mem_select(void)
+{
+#ifdef __riscv
+  if (hwcap() & HWCAP_ISA_V) {
+    variant = LMEM_RVV;
+    return;
+  }
+#endif
+  variant = LMEM_WORD;
+}
+
+int
+Lmem_variant(void)
+{
+  if (variant < 0)
+    mem_select();
+  return variant;
+}
+
+int
+Lmem_force(int v)
+{
+  if (v == LMEM_RVV) {
+#ifdef __riscv
+    if (!(hwcap() & HWCAP_ISA_V))
+#endif
+      return -1;
+  }
+  variant = v;
+  return 0;
+}
+
+/* A word with every byte equal to c */
+static uint64
+splat(int c)
+{
+  return (uint64) (uchar) c * 0x0101010101010101UL;
+}
+
+static void
+copy_fwd(uchar *d, const uchar *s, ulong n)
+{
+  if (n >= WMIN) {
+    while (!WALIGN(d)) {
+      *d++ = *s++;
+      n--;
+    }
+    if (WALIGN(s)) {
+      word *dw = (word *) d;
+      const word *sw = (const word *) s;
+      for (; n >= 4*WSIZE; n -= 4*WSIZE, dw += 4, sw += 4) {
+        dw[0] = sw[0];
+        dw[1] = sw[1];
+        dw[2] = sw[2];
+        dw[3] = sw[3];
+      }
+      for (; n >= WSIZE; n -= WSIZE)
+        *dw++ = *sw++;
+      d = (uchar *) dw;
+      s = (const uchar *) sw;
+    } else {
+      /* Aligned reads never cross a page, so the overread is harmless */
+      int sh = ((ulong) s & (WSIZE - 1)) * 8;
+      word *dw = (word *) d;
+      const word *sw = (const word *) ((ulong) s & ~(ulong) (WSIZE - 1));
+      uint64 lo = *sw++, hi;
+      for (; n >= WSIZE; n -= WSIZE, s += WSIZE) {
+        hi = *sw++;
+        *dw++ = (lo >> sh) | (hi << (64 - sh));
+        lo = hi;
+      }
+      d = (uchar *) dw;
+    }
+  }
+  while (n-- > 0)
+    *d++ = *s++;
+}
+
+/* Copy from the top down, for overlapping moves with dst > src */
+static void
+copy_bwd(uchar *d, const uchar *s, ulong n)
+{
+  d += n;
+  s += n;
+  if (n >= WMIN && WALIGN((ulong) d ^ (ulong) s)) {
+    while (!WALIGN(d)) {
+      *--d = *--s;
+      n--;
+    }
+    word *dw = (word *) d;
+    const word *sw = (const word *) s;
+    for (; n >= WSIZE; n -= WSIZE)
+      *--dw = *--sw;
+    d = (uchar *) dw;
+    s = (const uchar *) sw;
+  }
+  while (n-- > 0)
+    *--d = *--s;
+}
+
+static void
+set_fwd(uchar *d, int c, ulong n)
+{
+  if (n >= WMIN) {
+    uint64 w = splat(c);
+    while (!WALIGN(d)) {
+      *d++ = c;
+      n--;
+    }
+    word *dw = (word *) d;
+    for (; n >= 4*WSIZE; n -= 4*WSIZE, dw += 4) {
+      dw[0] = w;
+      dw[1] = w;
+      dw[2] = w;
+      dw[3] = w;
+    }
+    for (; n >= WSIZE; n -= WSIZE)
+      *dw++ = w;
+    d = (uchar *) dw;
+  }
+  while (n-- > 0)
+    *d++ = c;
+}
+
+static int
+cmp_fwd(const uchar *a, const uchar *b, ulong n)
+{
+  /* Skip equal words; the bytes then find the one that differs */
+  if (n >= WMIN && WALIGN((ulong) a ^ (ulong) b)) {
+    while (!WALIGN(a)) {
+      if (*a != *b)
+        return *a - *b;
+      a++, b++, n--;
+    }
+    const word *aw = (const word *) a;
+    const word *bw = (const word *) b;
+    for (; n >= WSIZE && *aw == *bw; n -= WSIZE)
+      aw++, bw++;
+    a = (const uchar *) aw;
+    b = (const uchar *) bw;
+  }
+  for (; n > 0; n--, a++, b++)
+    if (*a != *b)
+      return *a - *b;
+  return 0;
+}
+
+void*
+Lmemcpy(void *dst, const void *src, unsigned int n)
+{
+  if (variant < 0)
+    mem_select();
+#ifdef __riscv
+  if (variant == LMEM_RVV)
+    return Lmemcpy_rvv(dst, src, n);
+#endif
+  copy_fwd(dst, src, n);
+  return dst;
+}
+
+void*
+Lmemmove(void *dst, const void *src, int n)
+{
+  if (n <= 0)
+    return dst;
+  if (variant < 0)
+    mem_select();
+#ifdef __riscv
+  if (variant == LMEM_RVV)
+    return Lmemmove_rvv(dst, src, n);
+#endif
+  if ((ulong) dst - (ulong) src >= (ulong) n)   /* No harmful overlap */
+    copy_fwd(dst, src, n);
+  else
+    copy_bwd(dst, src, n);
+  return dst;
+}
+
+void*
+Lmemset(void *dst, int c, unsigned int n)
+{
+  if (variant < 0)
+    mem_select();
+#ifdef __riscv
+  if (variant == LMEM_RVV)
+    return Lmemset_rvv(dst, c, n);
+#endif
+  set_fwd(dst, c, n);
+  return dst;
+}
+
+int
+Lmemcmp(const void *s1, const void *s2, unsigned int n)
+{
+  if (variant < 0)
+    mem_select();
+#ifdef __riscv
+  if (variant == LMEM_RVV)
+    return Lmemcmp_rvv(s1, s2, n);
+#endif
+  return cmp_fwd(s1, s2, n);
+}
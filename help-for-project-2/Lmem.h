@@ -0,0 +1,29 @@
+/*
+
+File Lmem.h
+
+Fast Lmemcpy, Lmemmove, Lmemset and Lmemcmp (Lmem.c).  They replace
+the byte loops of the same names in lib4490.a, so they are declared in
+Llibc.h as before; programs using them link against lib4490m.a, a copy
+of the library in which the old ones are weak (see Makefile).
+
+Two variants of each:
+
+    word   aligned 64-bit loads and stores (any machine)
+    rvv    RISC-V Vector loops (Lmem-riscv64.S), used only when the
+           kernel reports the V extension in AT_HWCAP
+
+The variant is picked once, on the first call of any of the four.
+
+*/
+
+#ifndef LMEM_H
+#define LMEM_H
+
+#define LMEM_WORD 0
+#define LMEM_RVV  1
+
+int             Lmem_variant(void);     /* LMEM_WORD or LMEM_RVV */
+int             Lmem_force(int variant);        /* For benchmarks; -1 if unsupported */
+
+#endif
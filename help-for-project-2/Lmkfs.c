@@ -0,0 +1,365 @@
+/*
+
+File Lmkfs.c
+
+mkfs-style generator of synthetic xv6 images for benchmarking.  Lays
+out the image like xv6's mkfs (boot, super, log, inodes, bitmap, data)
+and fills it with a tree:
+
+    /d0 .. /d<fanout-1>            directories, nested depth levels
+    <dir>/f0 .. <dir>/f<files-1>   files in every directory
+
+so /d0/d0/.../f0 always exists for depth >= 1.  Options are key=value:
+
+    size=8192       image size in blocks
+    ninodes=1024    number of inodes (at most 65535)
+    fanout=4        subdirectories per directory
+    depth=2         levels of subdirectories below /
+    files=8         files per directory (including /)
+    minsize=0       file sizes in bytes, at most MAXFILE blocks
+    maxsize=16384
+    dist=uniform    uniform, fixed (all maxsize) or log (log-uniform:
+                    many small files, few large ones)
+    frag=0          percent of data blocks placed at a random free
+                    block instead of the next one (fragmentation)
+    seed=1
+
+It stops adding files and directories when inodes or blocks run out,
+and prints one key=value summary line.
+
+Usage:  Lmkfs image_path [key=value ...]
+
+*/
+
+#include "posix-calls.h"
+#include "Llibc.h"
+#include "types.h"
+#include "param.h"
+#include "fs.h"
+#include "Lstat.h"
+#include "Lalloc.h"
+
+enum { UNIFORM, FIXED, LOG };
+
+struct {
+  uint size, ninodes, fanout, depth, files, minsize, maxsize, dist, frag, seed;
+} opt = { 8192, 1024, 4, 2, 8, 0, 16384, UNIFORM, 0, 1 };
+
+char *img;              // The whole image, written out at the end
+uchar *inuse;           // One byte per block
+struct superblock sb;
+uint freeinode = 1;
+uint nextblock;         // Sequential allocation cursor
+uint ndirs, nfiles, nfull;
+ulong nbytes;
+
+uint
+rnd(void)
+{
+  opt.seed = opt.seed * 1103515245 + 12345;
+  return (opt.seed >> 8) & 0xffffff;
+}
+
+char *
+block(uint b)
+{
+  return img + (ulong) b * BSIZE;
+}
+
+struct dinode *
+dinode(uint inum)
+{
+  return (struct dinode *) block(IBLOCK(inum, sb)) + inum % IPB;
+}
+
+uint
+balloc(void)
+{
+  uint b = nextblock;
+  int scattered = opt.frag && rnd() % 100 < opt.frag;
+
+  if (scattered)
+    b = sb.size - sb.nblocks + rnd() % sb.nblocks;
+  /* Next free block from there, wrapping once */
+  for (uint n = 0; n < sb.nblocks; n++, b++) {
+    if (b >= sb.size)
+      b = sb.size - sb.nblocks;
+    if (!inuse[b]) {
+      inuse[b] = 1;
+      if (!scattered)
+        nextblock = b + 1;
+      return b;
+    }
+  }
+  nfull = 1;
+  return 0;
+}
+
+uint
+ialloc(int type)
+{
+  if (freeinode >= sb.ninodes) {
+    nfull = 1;
+    return 0;
+  }
+  uint inum = freeinode++;
+  struct dinode *dp = dinode(inum);
+  dp->type = type;
+  dp->nlink = 1;
+  return inum;
+}
+
+/* Append n bytes to inum, as xv6 mkfs's iappend(); returns bytes added */
+uint
+iappend(uint inum, const char *p, uint n)
+{
+  struct dinode *dp = dinode(inum);
+  uint off = dp->size, done = 0;
+
+  while (done < n) {
+    uint fbn = off / BSIZE, x;
+    uint *slot;
+
+    if (fbn >= MAXFILE)
+      break;
+    if (fbn < NDIRECT)
+      slot = &dp->addrs[fbn];
+    else {
+      if (dp->addrs[NDIRECT] == 0 && (dp->addrs[NDIRECT] = balloc()) == 0)
+        break;
+      slot = (uint *) block(dp->addrs[NDIRECT]) + (fbn - NDIRECT);
+    }
+    if (*slot == 0 && (*slot = balloc()) == 0)
+      break;
+    x = BSIZE - off % BSIZE;
+    if (x > n - done)
+      x = n - done;
+    Lmemcpy(block(*slot) + off % BSIZE, p + done, x);
+    done += x;
+    off += x;
+  }
+  dp->size = off;
+  return done;
+}
+
+int
+dirent_add(uint dir, const char *name, uint inum)
+{
+  struct dirent de;
+
+  Lmemset(&de, 0, sizeof(de));
+  de.inum = inum;
+  for (int i = 0; i < DIRSIZ && name[i]; i++)
+    de.name[i] = name[i];
+  if (dinode(dir)->size + sizeof(de) > NDIRECT * BSIZE)
+    return -1;          /* Directories only use direct blocks */
+  return iappend(dir, (char *) &de, sizeof(de)) == sizeof(de) ? 0 : -1;
+}
+
+uint
+mkdir(uint parent, const char *name)
+{
+  uint inum = ialloc(T_DIR);
+
+  if (inum == 0)
+    return 0;
+  if (dirent_add(inum, ".", inum) < 0 || dirent_add(inum, "..", parent) < 0
+      || dirent_add(parent, name, inum) < 0) {
+    nfull = 1;
+    return 0;
+  }
+  dinode(parent)->nlink++;
+  ndirs++;
+  return inum;
+}
+
+uint
+file_size(void)
+{
+  uint lo = opt.minsize, hi = opt.maxsize;
+
+  if (opt.dist == FIXED || hi <= lo)
+    return hi;
+  if (opt.dist == LOG) {
+    /* Pick a power-of-two band, then a size inside it */
+    uint bands = 0;
+    while ((lo + 1) << bands < hi)
+      bands++;
+    uint k = rnd() % (bands + 1);
+    uint blo = ((lo + 1) << k) - 1, bhi = ((lo + 1) << (k + 1)) - 1;
+    if (bhi > hi)
+      bhi = hi;
+    return blo + rnd() % (bhi - blo + 1);
+  }
+  return lo + rnd() % (hi - lo + 1);
+}
+
+void
+mkfile(uint dir, const char *name)
+{
+  char chunk[BSIZE];
+  uint inum = ialloc(T_FILE), size = file_size();
+
+  if (inum == 0)
+    return;
+  if (dirent_add(dir, name, inum) < 0) {
+    nfull = 1;
+    return;
+  }
+  nfiles++;
+  for (uint done = 0; done < size; ) {
+    uint n = size - done < BSIZE ? size - done : BSIZE;
+    for (int i = 0; i < n; i++)
+      chunk[i] = rnd();
+    uint got = iappend(inum, chunk, n);
+    nbytes += got;
+    done += n;
+    if (got < n)
+      break;
+  }
+}
+
+/* c followed by i in decimal */
+void
+name(char *buf, char c, uint i)
+{
+  char digits[12];
+  int n = 0;
+
+  do {
+    digits[n++] = '0' + i % 10;
+    i /= 10;
+  } while (i);
+  *buf++ = c;
+  while (n > 0)
+    *buf++ = digits[--n];
+  *buf = 0;
+}
+
+void
+tree(uint dir, uint level)
+{
+  char nm[DIRSIZ + 1];
+
+  for (uint i = 0; i < opt.files && !nfull; i++) {
+    name(nm, 'f', i);
+    mkfile(dir, nm);
+  }
+  if (level >= opt.depth)
+    return;
+  for (uint i = 0; i < opt.fanout && !nfull; i++) {
+    name(nm, 'd', i);
+    uint sub = mkdir(dir, nm);
+    if (sub)
+      tree(sub, level + 1);
+  }
+}
+
+/* key=value into opt; returns -1 if unknown */
+int
+setopt(char *arg)
+{
+  static const char *keys[] = { "size", "ninodes", "fanout", "depth", "files",
+    "minsize", "maxsize", "dist", "frag", "seed" };
+  static uint *vals[] = { &opt.size, &opt.ninodes, &opt.fanout, &opt.depth, &opt.files,
+    &opt.minsize, &opt.maxsize, &opt.dist, &opt.frag, &opt.seed };
+  char *eq = Lstrchr(arg, '=');
+
+  if (eq == 0)
+    return -1;
+  *eq = 0;
+  for (int i = 0; i < sizeof(keys) / sizeof(keys[0]); i++) {
+    if (Lstrcmp(arg, (char *) keys[i]) != 0)
+      continue;
+    if (vals[i] == &opt.dist)
+      opt.dist = Lstrcmp(eq + 1, "fixed") == 0 ? FIXED
+        : Lstrcmp(eq + 1, "log") == 0 ? LOG : UNIFORM;
+    else
+      *vals[i] = Latoi(eq + 1);
+    return 0;
+  }
+  return -1;
+}
+
+int
+Lmain(int argc, char *argv[])
+{
+  if (argc < 2) {
+    Lprintf("Usage:  %s image_path [key=value ...]\n", argv[0]);
+    return 1;
+  }
+  for (int i = 2; i < argc; i++) {
+    if (setopt(argv[i]) < 0) {
+      Lfprintf(2, "Unknown option %s\n", argv[i]);
+      return 1;
+    }
+  }
+  if (opt.ninodes > 65535)
+    opt.ninodes = 65535;    /* dirent.inum is 16 bits */
+  if (opt.maxsize > MAXFILE * BSIZE)
+    opt.maxsize = MAXFILE * BSIZE;
+  if (opt.minsize > opt.maxsize)
+    opt.minsize = opt.maxsize;
+
+  /* Layout, as in xv6 mkfs */
+  uint nbitmap = opt.size / BPB + 1;
+  uint ninodeblocks = opt.ninodes / IPB + 1;
+  uint nmeta = 2 + LOGSIZE + ninodeblocks + nbitmap;
+  if (opt.size <= nmeta + 1) {
+    Lfprintf(2, "size=%d is too small (metadata alone is %d blocks)\n", opt.size, nmeta);
+    return 1;
+  }
+  sb.magic = FSMAGIC;
+  sb.size = opt.size;
+  sb.nblocks = opt.size - nmeta;
+  sb.ninodes = opt.ninodes;
+  sb.nlog = LOGSIZE;
+  sb.logstart = 2;
+  sb.inodestart = 2 + LOGSIZE;
+  sb.bmapstart = 2 + LOGSIZE + ninodeblocks;
+
+  /* Both are fresh mappings, so they start out zeroed */
+  img = Lmalloc((ulong) opt.size * BSIZE);
+  inuse = Lmalloc(opt.size);
+  if (img == 0 || inuse == 0) {
+    Lfprintf(2, "out of memory\n");
+    return 2;
+  }
+  for (uint b = 0; b < nmeta; b++)
+    inuse[b] = 1;
+  nextblock = nmeta;
+  Lmemcpy(block(1), &sb, sizeof(sb));
+
+  uint root = ialloc(T_DIR);    /* ROOTINO */
+  dirent_add(root, ".", root);
+  dirent_add(root, "..", root);
+  tree(root, 0);
+
+  uint used = 0;
+  for (uint b = 0; b < opt.size; b++) {
+    if (inuse[b]) {
+      block(BBLOCK(b, sb))[(b % BPB) / 8] |= 1 << (b % 8);
+      used++;
+    }
+  }
+
+  int fd = Lopen(argv[1], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    Lfprintf(2, "Could not create %s\n", argv[1]);
+    return 2;
+  }
+  for (ulong off = 0, n; off < (ulong) opt.size * BSIZE; off += n) {
+    n = (ulong) opt.size * BSIZE - off;
+    if (n > 1024 * 1024)
+      n = 1024 * 1024;
+    if (Lwrite(fd, img + off, n) != n) {
+      Lfprintf(2, "Could not write %s\n", argv[1]);
+      return 2;
+    }
+  }
+  Lclose(fd);
+
+  Lprintf("image=%s size=%d ninodes=%d dirs=%d files=%d file_kb=%d used_blocks=%d full=%d\n",
+    argv[1], opt.size, opt.ninodes, ndirs + 1, nfiles, (int) (nbytes / 1024), used, nfull);
+  return 0;
+}
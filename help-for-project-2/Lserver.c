@@ -0,0 +1,282 @@
+#include "posix-calls.h"
+#include "Llibc.h"
+#include "Lcli.h"
+#include "walkfunctions.h"
+#include "Llock.h"
+#include "Lserver.h"
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <signal.h>
+
+/* From Lbio.c */
+void bflush(void);
+
+/*
+   There is no socket or epoll support in posix-calls.c, so the few
+   calls needed here go straight through Lsyscall().  Note that
+   riscv64 has no plain epoll_wait(); epoll_pwait() with a null
+   sigmask is the same thing.
+*/
+
+static int
+Lsocket_unix(void)
+{
+	return Lsyscall(SYS_socket, AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+}
+
+static int
+sockaddr_init(struct sockaddr_un *sa, const char *sockpath)
+{
+	if (Lstrlen((char *)sockpath) >= sizeof(sa->sun_path)) {
+		Lfprintf(2, "Socket path too long: %s\n", sockpath);
+		return -1;
+	}
+	Lmemset(sa, 0, sizeof(*sa));
+	sa->sun_family = AF_UNIX;
+	Lstrcpy(sa->sun_path, sockpath);
+	return 0;
+}
+
+/* Per-connection state:  a partial line, and the client's own CWD */
+struct client {
+	int fd;
+	int len;
+	char line[LINESIZE];
+	DirectoryStack cwd;
+};
+
+struct client clients[MAXCLIENTS];
+
+/* The client whose request is running:  its stack is in dirStack */
+static struct client *running;
+
+static struct client *
+client_alloc(int fd)
+{
+	for (int i = 0; i < MAXCLIENTS; i++) {
+		if (clients[i].fd == 0) {
+			clients[i].fd = fd;
+			clients[i].len = 0;
+			clients[i].cwd.entries = 0;
+			clients[i].cwd.top = -1;
+			clients[i].cwd.cap = 0;
+			return &clients[i];
+		}
+	}
+	return 0;
+}
+
+static void
+client_close(int epfd, struct client *c)
+{
+	Lsyscall(SYS_epoll_ctl, epfd, EPOLL_CTL_DEL, c->fd, 0);
+	Lclose(c->fd);
+	c->fd = 0;
+	Lfree(c->cwd.entries);
+	c->cwd.entries = 0;
+}
+
+/* Held from begin_op() to the end of end_op():  one request at a time */
+static struct sleeplock oplock = { 0, "oplock" };
+
+void
+begin_op(void)
+{
+	acquiresleep(&oplock);
+}
+
+/*
+   Write the command's blocks out, but leave the free counts to the
+   sync() at shutdown:  saving them here would cost two superblock
+   writes per changing command (SB_CLEAN set here, cleared again by
+   the next allocation).  If the server dies, the next mount counts.
+*/
+void
+end_op(void)
+{
+	bflush();
+	releasesleep(&oplock);
+}
+
+/*
+   Run one request line for client c.  The global CWD and fds 1/2 are
+   swapped to the client's for the duration.  Returns 1 if the client
+   asked to quit, 2 for shutdown, else 0.
+*/
+static int
+client_request(struct client *c, char *line, int saved1, int saved2)
+{
+	int rc;
+
+	if (Lstrcmp(line, "shutdown\n") == 0 || Lstrcmp(line, "shutdown") == 0)
+		return 2;
+
+	/* The client owns its stack's entries; dirStack borrows them */
+	dirStack = c->cwd;
+	if (dirStack.top < 0)
+		cwd_init();
+	Ldup2(c->fd, 1);
+	Ldup2(c->fd, 2);
+
+	begin_op();
+	running = c;
+	rc = run_command(line);
+	running = 0;
+	end_op();
+
+	Ldup2(saved1, 1);
+	Ldup2(saved2, 2);
+	c->cwd = dirStack;
+	return rc;
+}
+
+int
+server_oncwdpath(uint inum)
+{
+	for (int i = 0; i < MAXCLIENTS; i++) {
+		struct client *c = &clients[i];
+		if (c->fd == 0 || c == running)
+			continue;
+		for (int j = 0; j <= c->cwd.top; j++)
+			if (c->cwd.entries[j].inum == inum)
+				return 1;
+	}
+	return 0;
+}
+
+/* Consume c->line[0..len) line by line; returns as client_request() */
+static int
+client_drain(struct client *c, int eof, int saved1, int saved2)
+{
+	char line[LINESIZE + 1];	/* A full c->line, plus its '\0' */
+	int start = 0, rc = 0;
+
+	for (int i = 0; i < c->len && rc == 0; i++) {
+		if (c->line[i] != '\n')
+			continue;
+		Lmemcpy(line, c->line + start, i + 1 - start);
+		line[i + 1 - start] = '\0';
+		start = i + 1;
+		rc = client_request(c, line, saved1, saved2);
+	}
+	if (rc == 0 && eof && start < c->len) {
+		Lmemcpy(line, c->line + start, c->len - start);
+		line[c->len - start] = '\0';
+		start = c->len;
+		rc = client_request(c, line, saved1, saved2);
+	}
+	Lmemmove(c->line, c->line + start, c->len - start);
+	c->len -= start;
+	return rc;
+}
+
+int
+serve(const char *sockpath)
+{
+	struct sockaddr_un sa;
+	struct epoll_event ev, events[MAXCLIENTS + 1];
+	int lfd, epfd, saved1, saved2, stop = 0;
+	unsigned long sigpipe = 1UL << (SIGPIPE - 1);
+
+	if (sockaddr_init(&sa, sockpath) < 0)
+		return -1;
+	/* A client that hangs up early must not kill the server */
+	Lsyscall(SYS_rt_sigprocmask, SIG_BLOCK, &sigpipe, 0, sizeof(sigpipe));
+
+	Lunlink(sockpath);
+	if ((lfd = Lsocket_unix()) < 0
+	    || Lsyscall(SYS_bind, lfd, &sa, sizeof(sa)) < 0
+	    || Lsyscall(SYS_listen, lfd, MAXCLIENTS) < 0) {
+		Lfprintf(2, "Could not listen on %s\n", sockpath);
+		return -1;
+	}
+	if ((epfd = Lsyscall(SYS_epoll_create1, EPOLL_CLOEXEC)) < 0)
+		return -1;
+	ev.events = EPOLLIN;
+	ev.data.ptr = 0;	/* null marks the listening socket */
+	Lsyscall(SYS_epoll_ctl, epfd, EPOLL_CTL_ADD, lfd, &ev);
+
+	saved1 = Ldup(1);
+	saved2 = Ldup(2);
+
+	while (!stop) {
+		int n = Lsyscall(SYS_epoll_pwait, epfd, events, MAXCLIENTS + 1, -1, 0, 0);
+		for (int i = 0; i < n && !stop; i++) {
+			struct client *c = events[i].data.ptr;
+
+			if (c == 0) {
+				int fd = Lsyscall(SYS_accept4, lfd, 0, 0, SOCK_CLOEXEC);
+				if (fd < 0)
+					continue;
+				if ((c = client_alloc(fd)) == 0) {
+					Lclose(fd);	/* Full:  the client sees EOF */
+					continue;
+				}
+				ev.events = EPOLLIN;
+				ev.data.ptr = c;
+				Lsyscall(SYS_epoll_ctl, epfd, EPOLL_CTL_ADD, fd, &ev);
+				continue;
+			}
+
+			long got = Lread(c->fd, c->line + c->len, LINESIZE - c->len);
+			int eof = got <= 0;
+			if (!eof)
+				c->len += got;
+			/* A full buffer without '\n' runs as one (overlong) line */
+			int rc = client_drain(c, eof || c->len == LINESIZE, saved1, saved2);
+			if (rc == 2)
+				stop = 1;
+			if (rc != 0 || eof)
+				client_close(epfd, c);
+		}
+	}
+	for (int i = 0; i < MAXCLIENTS; i++)
+		if (clients[i].fd)
+			client_close(epfd, &clients[i]);
+	Lclose(epfd);
+	Lclose(lfd);
+	Lunlink(sockpath);
+	return 0;
+}
+
+int
+client(const char *sockpath, int argc, char *argv[])
+{
+	struct sockaddr_un sa;
+	char line[LINESIZE];
+	int fd, len = 0;
+	long n;
+
+	if (sockaddr_init(&sa, sockpath) < 0)
+		return -1;
+	for (int i = 0; i < argc; i++) {
+		int alen = Lstrlen(argv[i]);
+		if (len + alen + 2 > LINESIZE) {
+			Lfprintf(2, "Command line too long\n");
+			return -1;
+		}
+		if (i > 0)
+			line[len++] = ' ';
+		Lmemcpy(line + len, argv[i], alen);
+		len += alen;
+	}
+	line[len++] = '\n';
+
+	if ((fd = Lsocket_unix()) < 0)
+		return -1;
+	if (Lsyscall(SYS_connect, fd, &sa, sizeof(sa)) < 0) {
+		Lfprintf(2, "Could not connect to %s\n", sockpath);
+		Lclose(fd);
+		return -1;
+	}
+	if (Lwrite(fd, line, len) != len) {
+		Lclose(fd);
+		return -1;
+	}
+	Lsyscall(SYS_shutdown, fd, SHUT_WR);
+	while ((n = Lread(fd, line, LINESIZE)) > 0)
+		Lwrite(1, line, n);
+	Lclose(fd);
+	return 0;
+}
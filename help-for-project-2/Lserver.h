@@ -0,0 +1,49 @@
+/*
+
+File Lserver.h
+
+Persistent server mode (Lserver.c):  keep the image mounted with warm
+caches and serve command lines from many clients over a Unix socket.
+
+*/
+
+#define MAXCLIENTS 32
+
+int serve(const char *sockpath);
+/*
+  Listen on the Unix domain socket sockpath and run an epoll event loop.
+  Each '\n'-terminated line a client sends is one request:  it runs
+  through run_command() with fd 1 and fd 2 on the client socket, and
+  its dirty buffers are synced before the next request (end_op()).
+  A client's CWD persists for the life of its connection.  A "quit"
+  request closes the connection; "shutdown" stops the server.
+  Returns only on error or shutdown.
+*/
+
+int client(const char *sockpath, int argc, char *argv[]);
+/*
+  Thin client:  join argv into one command line, send it to the server
+  at sockpath, and copy the reply to stdout.  Returns 0 on success.
+*/
+
+int server_oncwdpath(uint inum);
+/*
+  Is inum the CWD of another connected client, or a directory above
+  it?  (The running request's own CWD is dirStack, not checked here.)
+  Always 0 when not serving.
+*/
+
+void begin_op(void);
+void end_op(void);
+/*
+  Request boundaries.  begin_op() takes a lock that end_op() drops, so
+  requests never interleave, whoever runs them.  end_op() writes back
+  every dirty buffer first, so a request's effects are on the image
+  before its reply ends.  There is no log:  a crash during a request
+  (or its write-back) can leave part of it on the image.
+*/
+
+/* From Lcli.c */
+int run_command(char *line);
+void cwd_init(void);
+extern DirectoryStack dirStack;
@@ -0,0 +1,174 @@
+#include "posix-calls.h"
+#include "Llibc.h"
+#include "types.h"
+#include "Lstats.h"
+
+struct stats stats;
+
+/* Counter names, in struct stats order */
+static const char *counter_names[] = {
+  "bcache_hits",
+  "bcache_misses",
+  "bcache_evictions",
+  "disk_read_blocks",
+  "disk_write_blocks",
+  "disk_read_syscalls",
+  "disk_write_syscalls",
+  "getinode_calls",
+  "namei_components",
+  "dirents_scanned",
+  "balloc_probes",
+  "ialloc_probes",
+  "dedup_shared",
+  "bcache_meta_hits",
+  "bcache_meta_misses",
+  "bcache_writeback_blocks",
+  "bcache_dirty_evictions",
+  "bcache_meta_resident",
+};
+#define NCOUNTERS (sizeof(counter_names) / sizeof(counter_names[0]))
+
+struct cmdstat {
+  char name[STATS_CMDLEN];
+  ulong count;
+  ulong total_us;
+  ulong min_us;
+  ulong max_us;
+  ulong hist[STATS_NHIST];
+};
+
+/* Commands run one at a time, so these need no lock */
+static struct cmdstat cmds[STATS_MAXCMDS];
+static int ncmds;
+
+long
+stats_now(void)
+{
+  struct timespec ts;
+
+  Lsyscall(SYS_clock_gettime, CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+/* Slot for name; the last slot collects everything past the table */
+static struct cmdstat *
+cmd_slot(const char *name)
+{
+  int i;
+
+  for (i = 0; i < ncmds; i++)
+    if (Lstrcmp(cmds[i].name, (char *) name) == 0)
+      return &cmds[i];
+  if (ncmds == STATS_MAXCMDS)
+    return &cmds[STATS_MAXCMDS - 1];
+  for (i = 0; i < STATS_CMDLEN - 1 && name[i]; i++)
+    cmds[ncmds].name[i] = name[i];
+  cmds[ncmds].name[i] = 0;
+  if (ncmds == STATS_MAXCMDS - 1)
+    Lstrcpy(cmds[ncmds].name, "other");
+  return &cmds[ncmds++];
+}
+
+void
+stats_command(const char *name, long t0)
+{
+  struct cmdstat *c = cmd_slot(name);
+  ulong us = stats_now() - t0;
+  int k = 0;
+
+  while (k < STATS_NHIST - 1 && (2UL << k) <= us)
+    k++;
+  c->hist[k]++;
+  if (c->count == 0 || us < c->min_us)
+    c->min_us = us;
+  if (us > c->max_us)
+    c->max_us = us;
+  c->count++;
+  c->total_us += us;
+}
+
+/* Upper bound (usec) of the bucket holding the p-th percentile */
+static ulong
+percentile(struct cmdstat *c, int p)
+{
+  ulong want = (c->count * p + 99) / 100, seen = 0;
+
+  for (int k = 0; k < STATS_NHIST; k++) {
+    seen += c->hist[k];
+    if (seen >= want)
+      return 2UL << k;
+  }
+  return c->max_us;
+}
+
+/* Lprintf has no %lu:  format into the end of a caller's buffer */
+static char *
+ultoa(char *end, ulong v)
+{
+  *--end = 0;
+  do {
+    *--end = '0' + v % 10;
+    v /= 10;
+  } while (v);
+  return end;
+}
+
+void
+stats_print(int fd)
+{
+  ulong *v = (ulong *) &stats;
+  char b1[24], b2[24], b3[24], b4[24], b5[24], b6[24], b7[24];
+
+  for (int i = 0; i < NCOUNTERS; i++)
+    Lfprintf(fd, "%-20s %s\n", counter_names[i], ultoa(b1 + 24, v[i]));
+  if (ncmds == 0)
+    return;
+  Lfprintf(fd, "\n%-16s %-8s %-10s %-8s %-8s %-8s %-8s\n", "command", "count",
+    "total_us", "min_us", "max_us", "p50_us<", "p99_us<");
+  for (int i = 0; i < ncmds; i++) {
+    struct cmdstat *c = &cmds[i];
+    Lfprintf(fd, "%-16s %-8s %-10s %-8s %-8s %-8s %-8s\n", c->name,
+      ultoa(b1 + 24, c->count), ultoa(b2 + 24, c->total_us),
+      ultoa(b3 + 24, c->min_us), ultoa(b4 + 24, c->max_us),
+      ultoa(b5 + 24, percentile(c, 50)), ultoa(b6 + 24, percentile(c, 99)));
+    for (int k = 0; k < STATS_NHIST; k++)
+      if (c->hist[k])
+        Lfprintf(fd, "    [%s us, ...) %s\n", ultoa(b7 + 24, k ? 1UL << k : 0),
+          ultoa(b1 + 24, c->hist[k]));
+  }
+}
+
+void
+stats_json(int fd)
+{
+  ulong *v = (ulong *) &stats;
+  char b[24];
+
+  Lfprintf(fd, "{\"counters\":{");
+  for (int i = 0; i < NCOUNTERS; i++)
+    Lfprintf(fd, "%s\"%s\":%s", i ? "," : "", counter_names[i], ultoa(b + 24, v[i]));
+  Lfprintf(fd, "},\"commands\":{");
+  for (int i = 0; i < ncmds; i++) {
+    struct cmdstat *c = &cmds[i];
+    Lfprintf(fd, "%s\"%s\":{\"count\":%s", i ? "," : "", c->name, ultoa(b + 24, c->count));
+    Lfprintf(fd, ",\"total_us\":%s", ultoa(b + 24, c->total_us));
+    Lfprintf(fd, ",\"min_us\":%s", ultoa(b + 24, c->min_us));
+    Lfprintf(fd, ",\"max_us\":%s", ultoa(b + 24, c->max_us));
+    Lfprintf(fd, ",\"hist_log2_us\":[");
+    for (int k = 0; k < STATS_NHIST; k++)
+      Lfprintf(fd, "%s%s", k ? "," : "", ultoa(b + 24, c->hist[k]));
+    Lfprintf(fd, "]}");
+  }
+  Lfprintf(fd, "}}\n");
+}
+
+void
+stats_reset(void)
+{
+  ulong resident = stats.bcache_meta_resident;
+
+  Lmemset(&stats, 0, sizeof(stats));
+  stats.bcache_meta_resident = resident;
+  Lmemset(cmds, 0, sizeof(cmds));
+  ncmds = 0;
+}
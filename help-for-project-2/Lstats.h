@@ -0,0 +1,66 @@
+/*
+
+File Lstats.h
+
+Always-on counters and per-command latency histograms (Lstats.c).
+Counting is one relaxed atomic add, cheap enough to leave in the hot
+paths of Lbio.c, Ldiskio.c and walkfunctions.c for good.
+
+Shown by the CLI's stats command, and written as JSON to fd 2 when
+Lcli exits if started with --stats-json.
+
+*/
+
+#ifndef LSTATS_H
+#define LSTATS_H
+
+struct stats {
+  unsigned long bcache_hits;
+  unsigned long bcache_misses;
+  unsigned long bcache_evictions;       // Misses that displaced a valid block
+  unsigned long disk_read_blocks;
+  unsigned long disk_write_blocks;
+  unsigned long disk_read_syscalls;     // lseek, read, preadv, io_uring_enter
+  unsigned long disk_write_syscalls;
+  unsigned long getinode_calls;
+  unsigned long namei_components;       // Path elements looked up
+  unsigned long dirents_scanned;
+  unsigned long balloc_probes;          // Bitmap bits tested
+  unsigned long ialloc_probes;          // Inodes tested
+  unsigned long dedup_shared;           // Blocks shared instead of written
+  unsigned long bcache_meta_hits;       // Hits and misses on metadata blocks
+  unsigned long bcache_meta_misses;
+  unsigned long bcache_writeback_blocks; // Written by the flusher thread
+  unsigned long bcache_dirty_evictions; // Misses that had to write a victim first
+  unsigned long bcache_meta_resident;   // Not a counter:  bufs in the metadata
+                                        // tier now (stats reset keeps it)
+};
+
+extern struct stats stats;
+
+#define STAT_ADD(field, n) __atomic_add_fetch(&stats.field, (n), __ATOMIC_RELAXED)
+#define STAT_INC(field) STAT_ADD(field, 1)
+
+/*
+  Latency histogram per command name:  bucket k counts commands that
+  took [2^k, 2^(k+1)) microseconds (bucket 0 also takes 0).
+*/
+#define STATS_NHIST   24
+#define STATS_MAXCMDS 32
+#define STATS_CMDLEN  16
+
+long    stats_now(void);
+/*
+  Monotonic time in microseconds.
+*/
+
+void    stats_command(const char *name, long t0);
+/*
+  Record one run of command name that started at stats_now() == t0.
+*/
+
+void    stats_print(int fd);
+void    stats_json(int fd);
+void    stats_reset(void);
+
+#endif
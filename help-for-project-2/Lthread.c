@@ -0,0 +1,260 @@
+#include "posix-calls.h"
+#include "Lthread.h"
+#include <linux/futex.h>
+
+#define PAGESIZE 4096
+#define CLONE_THREAD_FLAGS (CLONE_VM | CLONE_FS | CLONE_FILES | CLONE_SIGHAND \
+	| CLONE_THREAD | CLONE_SYSVSEM | CLONE_PARENT_SETTID | CLONE_CHILD_CLEARTID)
+
+/*********************
+ * THREADS
+ *********************/
+
+static int
+thread_start(void *arg)
+{
+	Lthread *t = arg;
+
+	t->result = t->fn(t->arg);
+	return 0;
+}
+
+int
+Lthread_create(Lthread *t, int (*fn)(void *), void *arg)
+{
+	long size = LTHREAD_STACKSIZE + PAGESIZE;
+	char *stack;
+
+	stack = (char *) Lsyscall(SYS_mmap, 0, size, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+	if ((long) stack < 0 && (long) stack > -4096)
+		return -1;
+	/* Guard page:  an overflow faults instead of scribbling */
+	Lsyscall(SYS_mprotect, stack, PAGESIZE, PROT_NONE);
+
+	t->fn = fn;
+	t->arg = arg;
+	t->result = 0;
+	t->stack = stack;
+	if (Lclone(thread_start, stack + size, CLONE_THREAD_FLAGS, t,
+	    &t->tid, 0, &t->tid) < 0) {
+		Lsyscall(SYS_munmap, stack, size);
+		return -1;
+	}
+	return 0;
+}
+
+int
+Lthread_join(Lthread *t)
+{
+	int tid;
+
+	/*
+	   The kernel's CLONE_CHILD_CLEARTID wakeup is a shared futex
+	   wake, which a private (Lfutex_wait) waiter would never see.
+	*/
+	while ((tid = __atomic_load_n(&t->tid, __ATOMIC_ACQUIRE)) != 0)
+		Lsyscall(SYS_futex, &t->tid, FUTEX_WAIT, tid, 0, 0, 0);
+	Lsyscall(SYS_munmap, t->stack, LTHREAD_STACKSIZE + PAGESIZE);
+	return t->result;
+}
+
+void
+Lexit_group(int status)
+{
+	for (;;)
+		Lsyscall(SYS_exit_group, status);
+}
+
+/*********************
+ * MUTEX AND CONDVAR
+ *********************/
+
+void
+Lmutex_init(Lmutex *m)
+{
+	initlock(&m->lk, "Lmutex");
+}
+
+void
+Lmutex_lock(Lmutex *m)
+{
+	acquire(&m->lk);
+}
+
+void
+Lmutex_unlock(Lmutex *m)
+{
+	release(&m->lk);
+}
+
+void
+Lcond_init(Lcond *c)
+{
+	c->seq = 0;
+}
+
+void
+Lcond_wait(Lcond *c, Lmutex *m)
+{
+	int seq = __atomic_load_n(&c->seq, __ATOMIC_RELAXED);
+
+	Lmutex_unlock(m);
+	/* Returns at once if a signal bumped seq after we read it */
+	Lfutex_wait(&c->seq, seq);
+	Lmutex_lock(m);
+}
+
+void
+Lcond_signal(Lcond *c)
+{
+	__atomic_add_fetch(&c->seq, 1, __ATOMIC_RELEASE);
+	Lfutex_wake(&c->seq, 1);
+}
+
+void
+Lcond_broadcast(Lcond *c)
+{
+	__atomic_add_fetch(&c->seq, 1, __ATOMIC_RELEASE);
+	Lfutex_wake(&c->seq, 0x7fffffff);
+}
+
+/*********************
+ * WORKER POOL
+ *********************/
+
+/*
+   The queue is Dmitry Vyukov's bounded MPMC ring:  slot i is free for
+   the producer at position pos when q[i].seq == pos, and holds a task
+   for the consumer at pos when q[i].seq == pos + 1.  Producers and
+   consumers each claim positions with a CAS, never a lock.
+*/
+static int
+queue_push(Lpool *p, void (*fn)(void *), void *arg)
+{
+	unsigned int pos = __atomic_load_n(&p->tail, __ATOMIC_RELAXED);
+
+	for (;;) {
+		struct Ltask *t = &p->q[pos & (LPOOL_QSIZE - 1)];
+		int dif = (int) (__atomic_load_n(&t->seq, __ATOMIC_ACQUIRE) - pos);
+		if (dif == 0) {
+			if (__atomic_compare_exchange_n(&p->tail, &pos, pos + 1, 1,
+			    __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+				t->fn = fn;
+				t->arg = arg;
+				__atomic_store_n(&t->seq, pos + 1, __ATOMIC_RELEASE);
+				return 0;
+			}
+		} else if (dif < 0)
+			return -1;	/* Full */
+		else
+			pos = __atomic_load_n(&p->tail, __ATOMIC_RELAXED);
+	}
+}
+
+static int
+queue_pop(Lpool *p, struct Ltask *out)
+{
+	unsigned int pos = __atomic_load_n(&p->head, __ATOMIC_RELAXED);
+
+	for (;;) {
+		struct Ltask *t = &p->q[pos & (LPOOL_QSIZE - 1)];
+		int dif = (int) (__atomic_load_n(&t->seq, __ATOMIC_ACQUIRE) - (pos + 1));
+		if (dif == 0) {
+			if (__atomic_compare_exchange_n(&p->head, &pos, pos + 1, 1,
+			    __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+				out->fn = t->fn;
+				out->arg = t->arg;
+				__atomic_store_n(&t->seq, pos + LPOOL_QSIZE, __ATOMIC_RELEASE);
+				return 0;
+			}
+		} else if (dif < 0)
+			return -1;	/* Empty */
+		else
+			pos = __atomic_load_n(&p->head, __ATOMIC_RELAXED);
+	}
+}
+
+static void
+task_done(Lpool *p)
+{
+	if (__atomic_sub_fetch(&p->pending, 1, __ATOMIC_ACQ_REL) == 0)
+		Lfutex_wake(&p->pending, 0x7fffffff);
+}
+
+static int
+worker(void *arg)
+{
+	Lpool *p = arg;
+	struct Ltask t;
+
+	for (;;) {
+		int sig = __atomic_load_n(&p->signal, __ATOMIC_ACQUIRE);
+		if (queue_pop(p, &t) == 0) {
+			t.fn(t.arg);
+			task_done(p);
+			continue;
+		}
+		if (__atomic_load_n(&p->stop, __ATOMIC_ACQUIRE))
+			return 0;
+		/* Sleep until the next submit (or stop) bumps signal */
+		__atomic_add_fetch(&p->sleepers, 1, __ATOMIC_ACQ_REL);
+		Lfutex_wait(&p->signal, sig);
+		__atomic_sub_fetch(&p->sleepers, 1, __ATOMIC_ACQ_REL);
+	}
+}
+
+int
+Lpool_init(Lpool *p, int nworkers)
+{
+	if (nworkers < 1 || nworkers > LPOOL_MAXWORKERS)
+		return -1;
+	for (unsigned int i = 0; i < LPOOL_QSIZE; i++)
+		p->q[i].seq = i;
+	p->head = p->tail = 0;
+	p->signal = p->sleepers = p->pending = p->stop = 0;
+	p->nworkers = 0;
+	for (int i = 0; i < nworkers; i++) {
+		if (Lthread_create(&p->workers[i], worker, p) < 0) {
+			Lpool_destroy(p);
+			return -1;
+		}
+		p->nworkers++;
+	}
+	return 0;
+}
+
+void
+Lpool_submit(Lpool *p, void (*fn)(void *), void *arg)
+{
+	__atomic_add_fetch(&p->pending, 1, __ATOMIC_ACQ_REL);
+	if (queue_push(p, fn, arg) < 0) {
+		fn(arg);
+		task_done(p);
+		return;
+	}
+	__atomic_add_fetch(&p->signal, 1, __ATOMIC_RELEASE);
+	if (__atomic_load_n(&p->sleepers, __ATOMIC_ACQUIRE) > 0)
+		Lfutex_wake(&p->signal, 1);
+}
+
+void
+Lpool_wait(Lpool *p)
+{
+	int n;
+
+	while ((n = __atomic_load_n(&p->pending, __ATOMIC_ACQUIRE)) != 0)
+		Lfutex_wait(&p->pending, n);
+}
+
+void
+Lpool_destroy(Lpool *p)
+{
+	Lpool_wait(p);
+	__atomic_store_n(&p->stop, 1, __ATOMIC_RELEASE);
+	__atomic_add_fetch(&p->signal, 1, __ATOMIC_RELEASE);
+	Lfutex_wake(&p->signal, 0x7fffffff);
+	for (int i = 0; i < p->nworkers; i++)
+		Lthread_join(&p->workers[i]);
+	p->nworkers = 0;
+}
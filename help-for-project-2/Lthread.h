@@ -0,0 +1,108 @@
+/*
+
+File Lthread.h
+
+Minimal threads for -nostdlib Llibc programs (Lthread.c):  raw clone
+with CLONE_VM|CLONE_THREAD, mmap'd stacks, futex-based join, mutex and
+condition variable, and a fixed-size worker pool.
+
+There is no thread-local storage:  threads share errno, and anything
+per-thread must be passed through the arg pointer.
+
+*/
+
+#ifndef LTHREAD_H
+#define LTHREAD_H
+
+#include "Llock.h"
+
+#define LTHREAD_STACKSIZE (64*1024)   /* Plus one guard page below */
+
+typedef struct {
+  int tid;        // Set by clone, cleared and woken by the kernel at exit
+  int result;     // fn's return value, valid after Lthread_join()
+  int (*fn)(void *);
+  void *arg;
+  char *stack;    // Base of the mapping (guard page included)
+} Lthread;
+
+int Lthread_create(Lthread *t, int (*fn)(void *), void *arg);
+/*
+  Start fn(arg) in a new thread.  t must stay valid until joined.
+  Return 0 on success, -1 on error.
+*/
+
+int Lthread_join(Lthread *t);
+/*
+  Wait for t to exit, free its stack, and return fn's return value.
+*/
+
+void Lexit_group(int status);
+/*
+  Exit the whole process.  Lexit() (SYS_exit) ends only the calling
+  thread, which leaves the process running while any other is.
+*/
+
+typedef struct {
+  struct spinlock lk;
+} Lmutex;
+
+typedef struct {
+  int seq;        // Bumped by every signal/broadcast
+} Lcond;
+
+void Lmutex_init(Lmutex *m);
+void Lmutex_lock(Lmutex *m);
+void Lmutex_unlock(Lmutex *m);
+
+void Lcond_init(Lcond *c);
+void Lcond_wait(Lcond *c, Lmutex *m);
+void Lcond_signal(Lcond *c);
+void Lcond_broadcast(Lcond *c);
+/*
+  Lcond_wait() may return spuriously:  always re-check the predicate.
+*/
+
+#define LPOOL_MAXWORKERS 16
+#define LPOOL_QSIZE      256    /* Power of 2 */
+
+struct Ltask {
+  unsigned int seq;             // Slot sequence number (lock-free queue)
+  void (*fn)(void *);
+  void *arg;
+};
+
+typedef struct {
+  struct Ltask q[LPOOL_QSIZE];  // Bounded MPMC ring (Vyukov)
+  unsigned int head;            // Next slot to dequeue
+  unsigned int tail;            // Next slot to enqueue
+  int signal;             // Futex:  bumped on each submit
+  int sleepers;           // Workers waiting on signal
+  int pending;            // Futex:  submitted but not yet finished
+  int stop;
+  int nworkers;
+  Lthread workers[LPOOL_MAXWORKERS];
+} Lpool;
+
+int Lpool_init(Lpool *p, int nworkers);
+/*
+  Start nworkers (1..LPOOL_MAXWORKERS) threads.  Return 0 or -1.
+*/
+
+void Lpool_submit(Lpool *p, void (*fn)(void *), void *arg);
+/*
+  Queue fn(arg) without taking a lock.  If the queue is full, the
+  caller runs fn(arg) itself, which also throttles the producer.
+*/
+
+void Lpool_wait(Lpool *p);
+/*
+  Wait until every submitted task has finished.
+*/
+
+void Lpool_destroy(Lpool *p);
+/*
+  Finish the queued tasks, then stop and join the workers.
+*/
+
+#endif
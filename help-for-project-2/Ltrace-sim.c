@@ -0,0 +1,304 @@
+/*
+
+File Ltrace-sim.c
+
+Replay a block trace (Ltrace.h, from "trace dump" or Lcli --trace)
+through simulated buffer caches, to get miss-ratio curves without
+touching any image.  Only the bread() lookups are replayed:  that is
+the stream the cache sees.
+
+For cache sizes 1, 2, 4, ... maxsize (and NBUF, the size Lcli uses)
+and for each policy:
+
+    lru     least recently used
+    fifo    first in, first out
+    clock   second chance, as Lbio.c does it
+    opt     Belady's optimal (evict the block used furthest ahead),
+            the lower bound for any policy
+
+one line is printed:
+
+    policy=lru size=16 accesses=5120 misses=311 miss_ratio=0.0607
+
+Usage:  Ltrace-sim trace_file [maxsize]
+
+*/
+
+#include "posix-calls.h"
+#include "Llibc.h"
+#include "types.h"
+#include "param.h"
+#include "Lalloc.h"
+#include "Ltrace.h"
+
+enum { LRU, FIFO, CLOCK, OPT, NPOLICY };
+const char *policy_names[NPOLICY] = { "lru", "fifo", "clock", "opt" };
+
+ulong *keys;        // Access stream:  dev << 32 | blockno
+uint *nextuse;      // Index of the next access to the same key, or n
+uint naccess;
+uint count[TR_DISKWRITE + 1];   // Records per op
+
+/*
+  Map from key to an int, open addressing with linear probing.  Used
+  for the slot lookup of the cache being simulated and for nextuse.
+*/
+struct map {
+  ulong *key;
+  int *val;       // -1:  empty
+  uint mask;
+};
+
+int
+map_init(struct map *m, uint n)
+{
+  uint size = 16;
+
+  while (size < 2 * n)
+    size *= 2;
+  m->key = Lmalloc(size * sizeof(ulong));
+  m->val = Lmalloc(size * sizeof(int));
+  if (m->key == 0 || m->val == 0)
+    return -1;
+  m->mask = size - 1;
+  for (uint i = 0; i < size; i++)
+    m->val[i] = -1;
+  return 0;
+}
+
+void
+map_free(struct map *m)
+{
+  Lfree(m->key);
+  Lfree(m->val);
+}
+
+uint
+map_hash(ulong k)
+{
+  return (uint) ((k * 0x9e3779b97f4a7c15UL) >> 32);
+}
+
+int *
+map_find(struct map *m, ulong k, int insert)
+{
+  for (uint h = map_hash(k) & m->mask; ; h = (h + 1) & m->mask) {
+    if (m->val[h] == -1) {
+      if (!insert)
+        return 0;
+      m->key[h] = k;
+      return &m->val[h];
+    }
+    if (m->key[h] == k)
+      return &m->val[h];
+  }
+}
+
+/* Delete k, re-inserting the rest of its probe run */
+void
+map_delete(struct map *m, ulong k)
+{
+  uint h = map_hash(k) & m->mask;
+
+  while (m->val[h] != -1 && m->key[h] != k)
+    h = (h + 1) & m->mask;
+  if (m->val[h] == -1)
+    return;
+  m->val[h] = -1;
+  for (h = (h + 1) & m->mask; m->val[h] != -1; h = (h + 1) & m->mask) {
+    ulong rk = m->key[h];
+    int rv = m->val[h];
+    m->val[h] = -1;
+    *map_find(m, rk, 1) = rv;
+  }
+}
+
+/* Cache simulation of one policy and size; returns the misses */
+uint
+simulate(int policy, uint size)
+{
+  struct map slotof;
+  ulong *slotkey = Lmalloc(size * sizeof(ulong));
+  uint *prev = Lmalloc(size * sizeof(uint));    /* LRU list, toward MRU */
+  uint *next = Lmalloc(size * sizeof(uint));    /* LRU list, toward LRU */
+  uint *aux = Lmalloc(size * sizeof(uint));     /* CLOCK used bit, OPT next use */
+  uint used = 0, hand = 0, mru = 0, lru = 0, misses = 0;
+
+  if (slotkey == 0 || prev == 0 || next == 0 || aux == 0
+      || map_init(&slotof, size) < 0) {
+    Lfprintf(2, "out of memory\n");
+    Lexit(1);
+  }
+
+  for (uint i = 0; i < naccess; i++) {
+    int *sp = map_find(&slotof, keys[i], 0);
+    uint s;
+
+    if (sp != 0) {
+      s = *sp;
+      if (policy == CLOCK)
+        aux[s] = 1;
+      else if (policy == OPT)
+        aux[s] = nextuse[i];
+      else if (policy == LRU && s != mru) {
+        /* Unlink s, then put it at the MRU end */
+        if (s == lru)
+          lru = prev[s];
+        else
+          prev[next[s]] = prev[s];
+        next[prev[s]] = next[s];
+        next[s] = mru;
+        prev[mru] = s;
+        mru = s;
+      }
+      continue;
+    }
+
+    misses++;
+    if (used < size)
+      s = used++;
+    else {
+      if (policy == FIFO) {
+        s = hand;
+        hand = (hand + 1) % size;
+      } else if (policy == CLOCK) {
+        while (aux[hand]) {
+          aux[hand] = 0;
+          hand = (hand + 1) % size;
+        }
+        s = hand;
+        hand = (hand + 1) % size;
+      } else if (policy == OPT) {
+        s = 0;
+        for (uint j = 1; j < size; j++)
+          if (aux[j] > aux[s])
+            s = j;
+      } else {
+        s = lru;
+        lru = prev[s];
+      }
+      map_delete(&slotof, slotkey[s]);
+    }
+    slotkey[s] = keys[i];
+    *map_find(&slotof, keys[i], 1) = s;
+    aux[s] = policy == OPT ? nextuse[i] : 1;
+    if (policy == LRU) {
+      if (size == 1 || (used == 1 && s == 0))
+        lru = s;
+      else {
+        next[s] = mru;
+        prev[mru] = s;
+      }
+      mru = s;
+    }
+  }
+
+  map_free(&slotof);
+  Lfree(slotkey);
+  Lfree(prev);
+  Lfree(next);
+  Lfree(aux);
+  return misses;
+}
+
+/* num/den as "d.dddd" (no floating point in Lprintf) */
+char *
+ratio(char *buf, ulong num, ulong den)
+{
+  ulong r = den ? (num * 10000 + den / 2) / den : 0;
+
+  buf[0] = '0' + r / 10000;
+  buf[1] = '.';
+  for (int i = 5; i >= 2; i--) {
+    buf[i] = '0' + r % 10;
+    r /= 10;
+  }
+  buf[6] = 0;
+  return buf;
+}
+
+void
+report(int policy, uint size)
+{
+  char buf[8];
+  uint misses = simulate(policy, size);
+
+  Lprintf("policy=%s size=%d accesses=%d misses=%d miss_ratio=%s\n",
+    policy_names[policy], size, naccess, misses, ratio(buf, misses, naccess));
+}
+
+int
+Lmain(int argc, char *argv[])
+{
+  struct trace_hdr h;
+  struct trace_rec *recs;
+  uint maxsize = 1024, hits = 0, distinct = 0;
+  int fd;
+  char buf[8];
+
+  if (argc < 2) {
+    Lprintf("Usage:  %s trace_file [maxsize]\n", argv[0]);
+    return 1;
+  }
+  if (argc > 2)
+    maxsize = Latoi(argv[2]);
+  if ((fd = Lopen(argv[1], O_RDONLY)) < 0
+      || Lread(fd, &h, sizeof(h)) != sizeof(h)
+      || h.magic != TRACE_MAGIC || h.recsize != sizeof(struct trace_rec)) {
+    Lfprintf(2, "%s:  not a trace file\n", argv[1]);
+    return 2;
+  }
+  ulong bytes = (ulong) h.nrec * sizeof(struct trace_rec);
+  recs = Lmalloc(bytes);
+  keys = Lmalloc(h.nrec * sizeof(ulong));
+  nextuse = Lmalloc(h.nrec * sizeof(uint));
+  if (recs == 0 || keys == 0 || nextuse == 0) {
+    Lfprintf(2, "out of memory\n");
+    return 3;
+  }
+  for (ulong got = 0; got < bytes; ) {
+    long n = Lread(fd, (char *) recs + got, bytes - got);
+    if (n <= 0) {
+      Lfprintf(2, "%s:  truncated\n", argv[1]);
+      return 2;
+    }
+    got += n;
+  }
+  Lclose(fd);
+
+  for (uint i = 0; i < h.nrec; i++) {
+    if (recs[i].op <= TR_DISKWRITE)
+      count[recs[i].op]++;
+    if (recs[i].op == TR_BREAD) {
+      keys[naccess++] = (ulong) recs[i].dev << 32 | recs[i].blockno;
+      hits += recs[i].hit;
+    }
+  }
+
+  /* Next use of each access, by a backward pass */
+  struct map last;
+  if (map_init(&last, naccess) < 0) {
+    Lfprintf(2, "out of memory\n");
+    return 3;
+  }
+  for (int i = naccess - 1; i >= 0; i--) {
+    int *lp = map_find(&last, keys[i], 1);
+    if (*lp == -1)
+      distinct++;
+    nextuse[i] = *lp == -1 ? naccess : *lp;
+    *lp = i;
+  }
+  map_free(&last);
+
+  Lprintf("records=%d dropped=%d breads=%d bwrites=%d disk_reads=%d disk_writes=%d distinct_blocks=%d observed_hit_ratio=%s\n",
+    h.nrec, h.dropped, count[TR_BREAD], count[TR_BWRITE], count[TR_DISKREAD],
+    count[TR_DISKWRITE], distinct, ratio(buf, hits, naccess));
+  for (int p = 0; p < NPOLICY; p++) {
+    for (uint size = 1; size <= maxsize; size *= 2) {
+      if (size / 2 < NBUF && NBUF < size)
+        report(p, NBUF);
+      report(p, size);
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,105 @@
+#include "posix-calls.h"
+#include "Llibc.h"
+#include "types.h"
+#include "Lalloc.h"
+#include "Lstats.h"
+#include "Ltrace.h"
+
+int trace_on;
+
+/*
+  A ring and its size are published together through one pointer, so
+  a recorder never pairs a ring with another ring's nrec.  trace_start()
+  frees the old ring only once no trace_record() is inside it:  each
+  one counts itself in tr_busy before it loads the pointer.
+*/
+struct trace_ring {
+  uint nrec;
+  uint next;      // Total records ever logged; next slot is next % nrec
+  long t0;
+  struct trace_rec rec[];
+};
+
+static struct trace_ring *tr;
+static int tr_busy;
+
+int
+trace_start(int nrec)
+{
+  struct trace_ring *r, *old;
+
+  trace_on = 0;
+  if (nrec <= 0)
+    nrec = TRACE_NREC;
+  r = Lmalloc(sizeof(*r) + (ulong) nrec * sizeof(struct trace_rec));
+  if (r != 0) {
+    r->nrec = nrec;
+    r->next = 0;
+    r->t0 = stats_now();
+  }
+  old = __atomic_exchange_n(&tr, r, __ATOMIC_SEQ_CST);
+  while (__atomic_load_n(&tr_busy, __ATOMIC_SEQ_CST) != 0)
+    ;
+  Lfree(old);
+  if (r == 0)
+    return -1;
+  trace_on = 1;
+  return 0;
+}
+
+void
+trace_stop(void)
+{
+  trace_on = 0;
+}
+
+/* Lock-free:  each caller claims its own slot */
+void
+trace_record(int op, uint dev, uint blockno, int hit, void *caller)
+{
+  __atomic_fetch_add(&tr_busy, 1, __ATOMIC_SEQ_CST);
+  struct trace_ring *t = __atomic_load_n(&tr, __ATOMIC_SEQ_CST);
+  if (t != 0 && t->nrec != 0) {
+    uint i = __atomic_fetch_add(&t->next, 1, __ATOMIC_RELAXED);
+    struct trace_rec *r = &t->rec[i % t->nrec];
+
+    r->usec = stats_now() - t->t0;
+    r->blockno = blockno;
+    r->op = op;
+    r->hit = hit;
+    r->dev = dev;
+    r->tag = (long) caller - (long) trace_start;
+  }
+  __atomic_fetch_sub(&tr_busy, 1, __ATOMIC_RELEASE);
+}
+
+int
+trace_dump(const char *path)
+{
+  struct trace_ring *t = tr;
+  struct trace_hdr h;
+  uint n, first;
+  int fd;
+
+  if (t == 0)
+    return -1;
+  n = t->next < t->nrec ? t->next : t->nrec;
+  first = t->next - n;    /* Oldest record still in the ring */
+  h.magic = TRACE_MAGIC;
+  h.recsize = sizeof(struct trace_rec);
+  h.base = (ulong) trace_start;
+  h.nrec = n;
+  h.dropped = first;
+
+  if ((fd = Lopen(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+    return -1;
+  Lwrite(fd, &h, sizeof(h));
+  /* At most two runs:  oldest..end of ring, then start of ring..newest */
+  uint a = first % t->nrec;
+  uint run = n < t->nrec - a ? n : t->nrec - a;
+  Lwrite(fd, &t->rec[a], (ulong) run * sizeof(struct trace_rec));
+  if (run < n)
+    Lwrite(fd, &t->rec[0], (ulong) (n - run) * sizeof(struct trace_rec));
+  Lclose(fd);
+  return n;
+}
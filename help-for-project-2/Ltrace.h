@@ -0,0 +1,71 @@
+/*
+
+File Ltrace.h
+
+Block access tracing (Ltrace.c).  When on, bread(), bwrite() and the
+disk I/O routines log one record per access into an in-memory ring;
+trace_dump() writes it out oldest first, for Ltrace-sim to replay
+against other cache sizes and policies.
+
+Trace file format (little endian, as the host writes it):
+
+    struct trace_hdr       once
+    struct trace_rec       hdr.nrec times, oldest first
+
+A record's tag is the address bread()/bwrite()/... was called from,
+as an offset from hdr.base:  addr2line -e Lcli <base + tag> names it.
+
+*/
+
+#ifndef LTRACE_H
+#define LTRACE_H
+
+#define TRACE_MAGIC   0x3154424c   /* "LBT1" */
+#define TRACE_NREC    65536        /* Default ring size (records) */
+
+/* trace_rec.op */
+#define TR_BREAD      1            /* Cache lookup; hit says if cached */
+#define TR_BWRITE     2
+#define TR_DISKREAD   3            /* Actual device I/O, one per block */
+#define TR_DISKWRITE  4
+
+struct trace_hdr {
+  unsigned int magic;
+  unsigned int recsize;            // sizeof(struct trace_rec)
+  unsigned long base;              // Code address that tags are relative to
+  unsigned int nrec;               // Records that follow
+  unsigned int dropped;            // Older records the ring overwrote
+};
+
+struct trace_rec {
+  unsigned int usec;               // Since trace_start()
+  unsigned int blockno;
+  unsigned char op;                // TR_*
+  unsigned char hit;               // TR_BREAD only
+  unsigned short dev;
+  int tag;                         // Caller, relative to trace_hdr.base
+};
+
+extern int trace_on;
+
+int     trace_start(int nrec);
+/*
+  Start (or restart) tracing into a fresh ring of nrec records
+  (TRACE_NREC if nrec <= 0).  Returns 0, or -1 if out of memory.
+*/
+
+void    trace_stop(void);
+int     trace_dump(const char *path);
+/*
+  Write the ring to path.  Returns the number of records, or -1.
+*/
+
+void    trace_record(int op, unsigned int dev, unsigned int blockno, int hit, void *caller);
+
+/* Costs one test of trace_on when tracing is off */
+#define TRACE(op, dev, blockno, hit) do { \
+    if (trace_on) \
+      trace_record((op), (dev), (blockno), (hit), __builtin_return_address(0)); \
+  } while (0)
+
+#endif
@@ -1,16 +1,26 @@
+#include "Llock.h"
+
+/*
+  Buffer header.  Headers are kept small (one cache line each) and in
+  a dense array, so bget() and the CLOCK sweep stay in cache; the
+  BSIZE bytes of block data live apart in a page-aligned slab (Lbio.c)
+  that data points into.
+*/
 struct buf {
-  int valid;   // has data been read from disk?
-  /* int disk; */    // does disk "own" buf?
-  /* The original xv6 buf.disk indicates if disk is working on a block  */
-  int dirty;	/* delayed write flag */
-  int disk_rw_fail;
   /* uint dev; */
   uint dev_fd;  /* xv6 had a device file; we will have a device fd (opened) */
   uint blockno;
-  /* struct sleeplock lock; */
-  uint refcnt;
-  struct buf *prev; // LRU cache list
-  struct buf *next;
-  uchar data[BSIZE];
-};
-
+  uchar valid;   // has data been read from disk?
+  /* int disk; */    // does disk "own" buf?
+  /* The original xv6 buf.disk indicates if disk is working on a block  */
+  uchar dirty;	/* delayed write flag */
+  uchar disk_rw_fail;
+  uchar used;   /* CLOCK reference bit, set on every hit */
+  uchar meta;   /* In the metadata tier (Lbio.c) */
+  uint refcnt;  /* dev_fd, blockno, refcnt:  under the hash bucket lock */
+  uint dirtied; /* bnow() when it went dirty, 0 while clean (Lbio.c) */
+  int bufidx;   /* 1 + io_uring registered buffer index, 0 if none */
+  struct sleeplock lock;
+  struct buf *next; // Hash bucket chain
+  uchar *data;  // BSIZE bytes in the slab, BSIZE-aligned
+} __attribute__((aligned(64)));
@@ -21,10 +21,18 @@ struct superblock {
   uint logstart;     // Block number of first log block
   uint inodestart;   // Block number of first inode block
   uint bmapstart;    // Block number of first free map block
+  uint flags;        // SB_ flags (0 in images from xv6 mkfs)
+  uint nfree;        // Free blocks and inodes, saved by sync() for
+  uint nifree;       // the next mount (only valid with SB_CLEAN)
 };
 
 #define FSMAGIC 0x10203040
 
+// Some file data blocks are shared by several files (download -d)
+#define SB_SHARED 0x1
+// nfree and nifree are right:  nothing was allocated or freed since
+#define SB_CLEAN  0x2
+
 #define NDIRECT 12
 #define NINDIRECT (BSIZE / sizeof(uint))
 #define MAXFILE (NDIRECT + NINDIRECT)
@@ -66,6 +74,28 @@ struct dinode {
   uint addrs[NDIRECT+1];   // Data block addresses
 };
 
+/*
+  A T_FILE's major is not a device number:  it holds flags.
+
+  I_LZ:  file data is stored in clusters of ZCLUSTER blocks (file
+  blocks c*ZCLUSTER ...), each of which is one of
+
+    hole        every slot 0
+    raw         every slot (up to the end of the file) in use
+    compressed  the first k slots hold a uint byte count and that many
+                bytes of LZ4 (Llz4.h); the cluster's last slot is 0
+
+  A raw cluster never has holes, so the last slot tells them apart.
+
+  I_INLINE:  the file's data (size <= INLINESIZE bytes) is kept in
+  addrs[] itself, and the file has no blocks.  It moves out to blocks
+  as soon as a write would go past INLINESIZE.
+*/
+#define I_LZ      0x1
+#define ZCLUSTER  4
+#define I_INLINE  0x2
+#define INLINESIZE ((NDIRECT+1) * sizeof(uint))
+
 // Inodes per block.
 #define IPB           (BSIZE / sizeof(struct dinode))
 
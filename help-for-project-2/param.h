@@ -5,6 +5,8 @@
 #define MAXARG       32  // max exec arguments
 #define MAXOPBLOCKS  10  // max # of blocks any FS op writes
 #define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
+#ifndef NBUF                           // make NBUF=n to override
 #define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
+#endif
 #define FSSIZE       2000  // size of file system in blocks
 #define MAXPATH      128   // maximum file path name
@@ -35,3 +35,14 @@ unsigned int Lsleep(unsigned int decisecs);
 int Luptime(void);
 void * Lsbrk(long int size);    /* Implementaion needs to improve */
 
+/* Futex wait/wake on a private (process-local) int (Llock.c) */
+int Lfutex_wait(int *addr, int val);
+int Lfutex_wake(int *addr, int nwake);
+
+/*
+   Like clone(2) in glibc:  run fn(arg) on stack (its highest address)
+   in a new task; returns the new tid, or < 0 on error (Lclone-riscv64.S)
+*/
+int Lclone(int (*fn)(void *), void *stack, int flags, void *arg,
+           int *ptid, void *tls, int *ctid);
+
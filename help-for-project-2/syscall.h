@@ -1,4 +1,4 @@
 #include <unistd.h>
 #include <sys/syscall.h>
 extern int errno;
-long int Lsyscall(...);
+long int Lsyscall(long int n, ...);
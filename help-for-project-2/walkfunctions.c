@@ -2,32 +2,31 @@
 #include "Llibc.h"
 #include "Lcli.h"
 #include "walkfunctions.h"
+#include "Lalloc.h"
+#include "Lstats.h"
+#include "Ldiskio.h"
+#include "Llz4.h"
+#include "Lthread.h"
 extern int DEVFD;
 extern struct superblock SB;
 
 /* From Lbio.c */
 void binit(void);
 struct buf* bread(uint, uint);
+struct buf* bread_meta(uint, uint, int);
+struct buf* bnew(uint, uint);
+int bread_batch(uint, uint*, int, struct buf**);
 void brelse(struct buf*);
 void bwrite(struct buf*);
-extern struct {
-    struct buf buf[NBUF];
-    struct buf head;
-} bcache;
-
-int inodeUsage[BSIZE]; 
-void initInodeUsage() {
-    for (int i = 0; i < BSIZE; i++) {
-        inodeUsage[i] = 0; 
-    }
-}
-
+void bflush(void);
+void bwritesync(struct buf*);
 
 int getinode(struct dinode *inode,  uint inodenum){
   struct buf *b;
-  // Using Mailman algorithm
-  b = bread(DEVFD, 32 + inodenum / 16);
-  Lmemcpy(inode, &b->data[(inodenum % 16)*64], 64);
+  STAT_INC(getinode_calls);
+  // Using Mailman algorithm (SB is memoized by fs_mount())
+  b = bread(DEVFD, IBLOCK(inodenum, SB));
+  Lmemcpy(inode, &b->data[(inodenum % IPB)*sizeof(struct dinode)], sizeof(struct dinode));
   brelse(b);
   if (inode->type == 0) {
   	return -1;
@@ -37,23 +36,32 @@ int getinode(struct dinode *inode,  uint inodenum){
 
 }
 
-uint find_name_in_dirblock(uint blockptr, const char *nam){
+/* find_name_in_dirblock() over only the first nslots entries */
+static uint find_name_in_slots(uint blockptr, const char *nam, int nslots){
   //Lprintf("Block ptr: %d Name: %s\n", blockptr, nam);
   struct buf *b;
-  b = bread(DEVFD, blockptr);
+  b = bread_meta(DEVFD, blockptr, 1);
   //Lprintf("Validity:  %d\n", b->valid);
+  uint inum = 0;
   if (b->valid == 1){
     struct dirent *dir;
-    for (int k = 0; k < 64; k++) {
+    for (int k = 0; k < nslots; k++) {
       dir = (struct dirent *) &b->data[k*16];
+      STAT_INC(dirents_scanned);
       if (Lstrcmp(dir->name, (char *)nam) == 0){
-	      return dir->inum;
+	      inum = dir->inum;
+	      break;
       }
      //Lprintf("Inode: %d   Name: %s\n", dir->inum, dir->name);
     }	
   }
+  brelse(b);
 
-  return 0;
+  return inum;
+}
+
+uint find_name_in_dirblock(uint blockptr, const char *nam){
+  return find_name_in_slots(blockptr, nam, BSIZE / sizeof(struct dirent));
 }
 
 uint find_dent(uint inum, const char *name){
@@ -65,12 +73,15 @@ uint find_dent(uint inum, const char *name){
   }
   //uint blockptr = inode.addrs[0];
   //uint dentnum = find_name_in_dirblock(blockptr, name);
+  /* Entries past size are free:  do not scan them */
   uint dentnum = 0;
-  for(int i = 0; i < 13; i++){
+  for(int i = 0; i < NDIRECT && i * BSIZE < inode.size; i++){
     if (inode.addrs[i] == 0){
        break;
     }
-    dentnum = find_name_in_dirblock(inode.addrs[i], name);
+    uint left = (inode.size - i * BSIZE) / sizeof(struct dirent);
+    dentnum = find_name_in_slots(inode.addrs[i], name,
+      left < BSIZE / sizeof(struct dirent) ? left : BSIZE / sizeof(struct dirent));
     if (dentnum != 0){
      break;
     }
@@ -79,54 +90,208 @@ uint find_dent(uint inum, const char *name){
   return dentnum;
 }
 
-uint namei(const char *pathname){
-  uint inum;
-  if (pathname[0] != '/') {
+/*
+  Copy the next path element of path into name (at most DIRSIZ bytes,
+  NUL terminated) and return a pointer to what follows it, as in xv6.
+  Returns 0 when no element is left.  *toolong is set if the element
+  did not fit:  no dirent can have that name.
+
+    skipelem("a/bb/c", name) = "bb/c", setting name = "a"
+    skipelem("///a//bb", name) = "bb", setting name = "a"
+    skipelem("", name) = skipelem("////", name) = 0
+*/
+static const char*
+skipelem(const char *path, char *name, int *toolong)
+{
+  const char *s;
+  int len;
+
+  while (*path == '/')
+    path++;
+  if (*path == 0)
     return 0;
+  s = path;
+  while (*path != '/' && *path != 0)
+    path++;
+  len = path - s;
+  *toolong = len > DIRSIZ;
+  if (len > DIRSIZ)
+    len = DIRSIZ;
+  Lmemcpy(name, s, len);
+  name[len] = 0;
+  while (*path == '/')
+    path++;
+  return path;
+}
+
+/*
+  Resolve pathname starting at directory dirinum if it is relative, or
+  at the root if it is absolute, so a relative lookup costs one
+  find_dent() per element it has, however deep dirinum is.  "." is
+  skipped without a lookup; ".." is the directory's own ".." entry
+  (the root's points back at the root).
+*/
+uint nameiat(uint dirinum, const char *pathname){
+  char name[DIRSIZ+1];
+  int toolong;
+  uint inum;
+
+  inum = pathname[0] == '/' ? ROOTINO : dirinum;
+  while ((pathname = skipelem(pathname, name, &toolong)) != 0) {
+    if (name[0] == '.' && name[1] == '\0')
+      continue;
+    STAT_INC(namei_components);
+    if (toolong || (inum = find_dent(inum, name)) == 0)
+      return 0; // Directory not found
+  }
+  return inum;
+}
+
+uint namei(const char *pathname){
+  return nameiat(ROOTINO, pathname);
+}
+
+
+/*
+  Batch getinode():  inodes[i] gets inode inums[i] for each i < n.
+  inums[] is visited in inode order, so each inode block is read once,
+  STAT_BATCH blocks at a time with one bread_batch() (a single preadv
+  when they are adjacent).  Returns 0, or -1; inodes that could not be
+  read (or inum 0) come back with type 0.
+*/
+#define STAT_BATCH 8
+
+int getinodes(const uint *inums, int n, struct dinode *inodes){
+  ushort *order = Larena_alloc(&cmdarena, n * sizeof(ushort));
+  int rc = 0;
+
+  if (order == 0) {
+    return -1;
+  }
+  /* Indices by inum (insertion sort), so inode blocks come in order */
+  for (int i = 0; i < n; i++) {
+    int j;
+    for (j = i; j > 0 && inums[order[j-1]] > inums[i]; j--) {
+      order[j] = order[j-1];
+    }
+    order[j] = i;
+    Lmemset(&inodes[i], 0, sizeof(struct dinode));
   }
-    char dirName[1024];
-    // Location of root inode
-    inum = 1;
-    int j = 0;
-    for(int i = 1; pathname[i] != '\0'; i++){
-      dirName[j] = pathname[i];
-      if (pathname[i] == '/'){
-        dirName[j] = '\0';
-        inum = find_dent(inum, dirName);
-        if (inum == 0) return 0; // Directory not found
-        dirName[0] = '\0';
-        j = -1;
+
+  for (int i = 0; i < n; ) {
+    uint blocks[STAT_BATCH];
+    struct buf *bs[STAT_BATCH];
+    int nb = 0, j;
+
+    /* order[i..j):  the entries in the next STAT_BATCH inode blocks */
+    for (j = i; j < n; j++) {
+      uint inum = inums[order[j]];
+      if (inum == 0 || inum >= SB.ninodes) {
+        continue;
+      }
+      if (nb == 0 || blocks[nb-1] != IBLOCK(inum, SB)) {
+        if (nb == STAT_BATCH) {
+          break;
+        }
+        blocks[nb++] = IBLOCK(inum, SB);
       }
-      j++;
     }
-    if (j > 0) { // Handle the last part of the path
-        dirName[j] = '\0';
-        inum = find_dent(inum, dirName);
+    if (nb > 0 && bread_batch(DEVFD, blocks, nb, bs) < 0) {
+      return -1;
     }
-    return inum;
+    for (int b = 0; i < j; i++) {
+      uint inum = inums[order[i]];
+      if (inum == 0 || inum >= SB.ninodes) {
+        continue;
+      }
+      while (blocks[b] != IBLOCK(inum, SB)) {
+        b++;
+      }
+      if (!bs[b]->valid) {
+        rc = -1;
+        continue;
+      }
+      Lmemcpy(&inodes[order[i]], &bs[b]->data[(inum % IPB)*sizeof(struct dinode)], sizeof(struct dinode));
+    }
+    for (int b = 0; b < nb; b++) {
+      brelse(bs[b]);
+    }
+  }
+  return rc;
 }
 
+/*
+  Copy the entries in use from directory blocks blocks[0..nblocks)
+  into *desp and stat them all with getinodes() into *inodesp, both in
+  cmdarena.  No buffer is held afterwards.  Returns the number of
+  entries, or -1.
+*/
+static int dirstat(const uint *blocks, int nblocks, struct dirent **desp, struct dinode **inodesp){
+  int max = nblocks * (BSIZE / sizeof(struct dirent)), n = 0;
+  struct dirent *des = Larena_alloc(&cmdarena, max * sizeof(struct dirent));
+  uint *inums = Larena_alloc(&cmdarena, max * sizeof(uint));
+
+  if (des == 0 || inums == 0) {
+    return -1;
+  }
+  for (int i = 0; i < nblocks; i++) {
+    struct buf *b = bread_meta(DEVFD, blocks[i], 1);
+    if (b == 0) {
+      return -1;
+    }
+    struct dirent *de = (struct dirent *) b->data;
+    for (int k = 0; k < BSIZE / sizeof(struct dirent); k++) {
+      STAT_INC(dirents_scanned);
+      if (de[k].inum != 0) {
+        des[n] = de[k];
+        inums[n++] = de[k].inum;
+      }
+    }
+    brelse(b);
+  }
+  struct dinode *inodes = Larena_alloc(&cmdarena, (n ? n : 1) * sizeof(struct dinode));
+  if (inodes == 0) {
+    return -1;
+  }
+  getinodes(inums, n, inodes);    // Unreadable ones are skipped
+  *desp = des;
+  *inodesp = inodes;
+  return n;
+}
 
-void lsdir(uint blockptr){
-  struct buf *b;
-  b = bread(DEVFD, blockptr);
-  struct dirent *dir;
+/* Number of blocks of directory *dp (directories use direct blocks only) */
+static int dirblocks(struct dinode *dp){
+  int n = 0;
+  while (n < NDIRECT && dp->addrs[n] != 0) {
+    n++;
+  }
+  return n;
+}
 
-  for (int k = 0; k < 64; k++) {
-    dir = (struct dirent *) &b->data[k*16];
-    struct dinode inode;
-    int result = getinode(&inode, dir->inum);
-    if(result == -1){
+/* One line per entry, for those whose inode could be read */
+static void lsprint(struct dirent *des, struct dinode *inodes, int n){
+  for (int k = 0; k < n; k++) {
+    if (inodes[k].type == 0) {
       continue;
     }
-    Lprintf("%-14s %d %d %d\n", dir->name, inode.type, dir->inum, inode.size);
-   }
+    Lprintf("%-14s %d %d %d\n", des[k].name, inodes[k].type, des[k].inum, inodes[k].size);
+  }
+}
 
-  brelse(b);
+void lsdir(uint blockptr){
+  struct dirent *des;
+  struct dinode *inodes;
+  int n = dirstat(&blockptr, 1, &des, &inodes);
+
+  lsprint(des, inodes, n);
 }
 
 int lspath(const char *pathname){
-  uint inum = namei(pathname);
+  return lspathat(ROOTINO, pathname);
+}
+
+int lspathat(uint dirinum, const char *pathname){
+  uint inum = nameiat(dirinum, pathname);
   if(inum == 0){
     return -1;
   }
@@ -137,11 +302,56 @@ int lspath(const char *pathname){
     return -1;
   }
 
-  lsdir(inode.addrs[0]);
+  /* The whole directory at once:  each inode block is read once */
+  struct dirent *des;
+  struct dinode *inodes;
+  int n = dirstat(inode.addrs, dirblocks(&inode), &des, &inodes);
+  lsprint(des, inodes, n);
 
   return 0;
 }
 
+/*
+  ls -R:  list directory inum (called path), then each subdirectory
+  below it, depth first.  Paths are built in cmdarena.
+*/
+int lsrecursive(uint inum, const char *path){
+  struct dinode inode;
+  if (getinode(&inode, inum) == -1 || inode.type != T_DIR) {
+    return -1;
+  }
+  struct dirent *des;
+  struct dinode *inodes;
+  int n = dirstat(inode.addrs, dirblocks(&inode), &des, &inodes);
+  if (n < 0) {
+    return -1;
+  }
+  Lprintf("%s:\n", path);
+  lsprint(des, inodes, n);
+  Lprintf("\n");
+
+  /* The same batch says which entries are subdirectories */
+  for (int k = 0; k < n; k++) {
+    struct dirent *de = &des[k];
+    if (inodes[k].type != T_DIR || Lstrcmp(de->name, ".") == 0 || Lstrcmp(de->name, "..") == 0) {
+      continue;
+    }
+    int len = Lstrlen((char *)path);
+    char *sub = Larena_alloc(&cmdarena, len + DIRSIZ + 2);
+    if (sub == 0) {
+      return -1;
+    }
+    Lstrcpy(sub, path);
+    if (len > 0 && sub[len - 1] != '/') {
+      sub[len++] = '/';
+    }
+    Lmemcpy(sub + len, de->name, DIRSIZ);
+    sub[len + DIRSIZ] = '\0';
+    lsrecursive(de->inum, sub);
+  }
+  return 0;
+}
+
 uint cd(uint inum, const char *name){
   uint inumReturn = find_dent(inum, name);
   if (inumReturn == 0){
@@ -155,9 +365,139 @@ uint cd(uint inum, const char *name){
   return inumReturn;
 }
 
+/* Does directory *dp hold nothing but . and .. ? */
+static int dirempty(struct dinode *dp){
+    struct dirent de;
+    for (uint off = 2*sizeof(de); off < dp->size; off += sizeof(de)) {
+        if (readi(dp, (char *) &de, off, sizeof(de)) != sizeof(de)) {
+            return 0;
+        }
+        if (de.inum != 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+  Slot hints, per directory, for this session (a small table indexed
+  by inode number; a directory that is not in it starts out unknown).
+  Slots are dirent indexes.  Every slot below free is in use, so
+  dirlink() starts looking there, and live is the number of entries
+  in use, or -1 until someone counts them.  The hints only speed up
+  dirlink():  find_dent() and listings still read every slot up to
+  size, which only dircompact() brings down.
+*/
+#define DIRHINTS 64
+#define DIRSLOTS (BSIZE / sizeof(struct dirent))
+
+static struct dirhint {
+  uint inum;
+  uint free;
+  int live;
+} dirhints[DIRHINTS];
+
+static struct dirhint *dirhint(uint dirinum){
+  struct dirhint *h = &dirhints[dirinum % DIRHINTS];
+
+  if (h->inum != dirinum) {
+    h->inum = dirinum;
+    h->free = 0;
+    h->live = -1;
+  }
+  return h;
+}
+
+/* Compact a directory once fewer than this percent of its slots are used */
+#define DIR_COMPACT_PCT 50
+
+/*
+  Online compaction:  if directory dirinum (*dp) is using less than
+  DIR_COMPACT_PCT of its slots and packing would free a block, move
+  its entries to the front (in order, so . and .. stay first), free
+  the blocks left empty at the end, and shrink its size to match.
+  Lookups and listings then only read blocks with entries in them.
+
+  Entries only move to lower slots, so the blocks are written in
+  order:  each destination before the later blocks its entries came
+  from (bwritesync(), one at a time, so write-back cannot reorder
+  them), then the emptied blocks are cleared, and the directory is
+  truncated last (after a bflush()).  A crash can still leave a moved
+  entry in both its old and its new slot until the clearing is on
+  disk, but never lose one.
+*/
+static void dircompact(uint dirinum, struct dinode *dp){
+  struct dirhint *h = dirhint(dirinum);
+  int nb = dirblocks(dp), live = 0;
+
+  if (nb < 2) {
+    return;
+  }
+  struct dirent *des = Larena_alloc(&cmdarena, nb * BSIZE);
+  if (des == 0) {
+    return;
+  }
+  for (int i = 0; i < nb; i++) {
+    struct buf *b = bread_meta(DEVFD, dp->addrs[i], 1);
+    if (b == 0 || !b->valid) {
+      if (b != 0) {
+        brelse(b);
+      }
+      return;
+    }
+    struct dirent *de = (struct dirent *) b->data;
+    for (int k = 0; k < DIRSLOTS; k++) {
+      if (de[k].inum != 0 && (i * DIRSLOTS + k) * sizeof(struct dirent) < dp->size) {
+        des[live++] = de[k];
+      }
+    }
+    brelse(b);
+  }
+  h->live = live;
+  int keep = (live + DIRSLOTS - 1) / DIRSLOTS;
+  if (keep == 0 || keep >= nb || live * 100 >= nb * DIRSLOTS * DIR_COMPACT_PCT) {
+    return;
+  }
+  Lmemset(des + live, 0, (keep * DIRSLOTS - live) * sizeof(struct dirent));
+  for (int i = 0; i < keep; i++) {
+    struct buf *b = bnew(DEVFD, dp->addrs[i]);
+    if (b == 0) {
+      return;
+    }
+    Lmemcpy(b->data, des + i * DIRSLOTS, BSIZE);
+    b->dirty = 1;
+    bwritesync(b);      // Before block i+1, whose old entries may be here now
+    brelse(b);
+  }
+  /* The entries are all in the first keep blocks now:  clear the rest */
+  for (int i = keep; i < nb; i++) {
+    struct buf *b = bnew(DEVFD, dp->addrs[i]);
+    if (b == 0) {
+      return;
+    }
+    Lmemset(b->data, 0, BSIZE);
+    b->dirty = 1;
+    bwrite(b);
+    brelse(b);
+  }
+  bflush();
+  dp->size = live * sizeof(struct dirent);
+  iupdate(dp, dirinum);
+  for (int i = keep; i < nb; i++) {
+    bfree(DEVFD, dp->addrs[i]);
+    dp->addrs[i] = 0;
+  }
+  iupdate(dp, dirinum);
+  h->free = live;
+}
+
 int unlink(const char *pathname){
+    return unlinkin(ROOTINO, pathname);
+}
+
+int unlinkin(uint dirinum, const char *pathname){
     char fileName[20] = {0};
-    uint parentInum = dirWithFileToRm(pathname, fileName);
+    uint parentInum = nameiparentat(dirinum, pathname, fileName);
     if(parentInum == 0){
         return -1; // Failed to find parent directory or file
     }
@@ -178,232 +518,576 @@ int unlink(const char *pathname){
     if(targetInode.type != T_FILE && targetInode.type != T_DIR){
         return -1; // Only files and directories can be unlinked
     }
+    if(Lstrcmp(fileName, ".") == 0 || Lstrcmp(fileName, "..") == 0){
+        return -1;
+    }
+    if(targetInode.type == T_DIR && !dirempty(&targetInode)){
+        return -1; // Like rmdir:  only empty directories
+    }
 
     int removed = 0;
-    for(int i = 0; i < 13 && !removed; i++){
+    for(int i = 0; i < NDIRECT && !removed; i++){
         if (parentInode.addrs[i] == 0) continue;
 
-        struct buf *b = bread(DEVFD, parentInode.addrs[i]);
+        struct buf *b = bread_meta(DEVFD, parentInode.addrs[i], 1);
+        if (b == 0) {
+            break;
+        }
         if (b->valid == 1){
             struct dirent *dir;
             for (int k = 0; k < 64; k++) {
                 dir = (struct dirent *) &b->data[k*16];
-                if (Lstrcmp(dir->name, fileName) == 0){
+                STAT_INC(dirents_scanned);
+                if (dir->inum != 0 && Lstrcmp(dir->name, fileName) == 0){
                     Lmemset(dir, 0, sizeof(struct dirent));
                     b->dirty = 1;
                     bwrite(b);
                     removed = 1;
+                    struct dirhint *h = dirhint(parentInum);
+                    if (i * DIRSLOTS + k < h->free) {
+                        h->free = i * DIRSLOTS + k;
+                    }
+                    if (h->live > 0) {
+                        h->live--;
+                    }
                     break;
                 }
             }
-            brelse(b);
         }
+        brelse(b);     // Even after a failed read:  it holds the sleep lock
     }
     if (!removed) {
         return -1; 
     }
-    return 0; 
-}
 
+    // Drop the link:  the last one frees the inode and its blocks
+    if (targetInode.type == T_DIR) {
+        parentInode.nlink--; // The directory's ".."
+        iupdate(&parentInode, parentInum);
+        targetInode.nlink = 0;
+        dirhints[targetInum % DIRHINTS].inum = 0;  // Its inode may be reused
+    } else {
+        targetInode.nlink--;
+    }
+    if (targetInode.nlink > 0) {
+        iupdate(&targetInode, targetInum);
+    } else {
+        itrunc(&targetInode, targetInum);
+        Lmemset(&targetInode, 0, sizeof(struct dinode));
+        iupdate(&targetInode, targetInum);
+    }
 
+    /* Count the entries once; after that, only look when it pays off */
+    struct dirhint *hint = dirhint(parentInum);
+    int nb = dirblocks(&parentInode);
+    if (nb > 1 && (hint->live < 0 || hint->live * 100 < nb * DIRSLOTS * DIR_COMPACT_PCT)) {
+        dircompact(parentInum, &parentInode);
+    }
+    return 0; 
+}
 
-uint dirWithFileToRm(const char *pathname, char *name){
-  uint inum;
-  if (pathname[0] != '/') {
-    return 0;
+/*
+  Empty directory dirinum (*dp) for rm -r, a whole directory per pass:
+  dirstat() reads its entries and stats them together, subdirectories
+  are emptied first, every entry's link is dropped (freeing the inode
+  with its last link), and then the first block is cleared down to .
+  and .. with one write and the other blocks are freed.
+*/
+static int emptydir(uint dirinum, struct dinode *dp){
+  struct dirent *des;
+  struct dinode *inodes;
+  int n = dirstat(dp->addrs, dirblocks(dp), &des, &inodes);
+
+  if (n < 0 || dp->addrs[0] == 0) {
+    return -1;
   }
-    char dirName[1024];
-    // Location of root inode
-    inum = 1;
-    int j = 0;
-    for(int i = 1; pathname[i] != '\0'; i++){
-      dirName[j] = pathname[i];
-      if (pathname[i] == '/'){
-        dirName[j] = '\0';
-        inum = find_dent(inum, dirName);
-        if (inum == 0) return 0; // Directory not found
-        dirName[0] = '\0';
-        j = -1;
+  for (int k = 0; k < n; k++) {
+    struct dinode ip;
+    uint inum = des[k].inum;
+    if (Lstrcmp(des[k].name, ".") == 0 || Lstrcmp(des[k].name, "..") == 0) {
+      continue;
+    }
+    /* Again, not inodes[k]:  a hard link seen earlier may have changed it */
+    if (getinode(&ip, inum) == -1) {
+      continue;
+    }
+    if (ip.type == T_DIR) {
+      if (emptydir(inum, &ip) < 0) {
+        return -1;
       }
-      j++;
+      dp->nlink--;    // Its ".."
+      ip.nlink = 0;
+      dirhints[inum % DIRHINTS].inum = 0;
+    } else {
+      ip.nlink--;
     }
-
-    if (j > 0) { // Handle the last part of the path
-        dirName[j] = '\0';
-        Lstrcpy(name, dirName);
+    if (ip.nlink > 0) {
+      iupdate(&ip, inum);
+      continue;
     }
-    return inum;
-}
+    itrunc(&ip, inum);
+    Lmemset(&ip, 0, sizeof(ip));
+    iupdate(&ip, inum);
+  }
 
-int link(const char *pathname, const char *pathname2){
-  char fileName[20] = {0};
-  char fileName2[20] = {0};
-  uint inum = dirWithFileToRm(pathname, fileName);
-  uint inum2 = dirWithFileToRm(pathname2, fileName2);
-  if(inum == 0 || inum2 == 0){
+  struct buf *b = bread_meta(DEVFD, dp->addrs[0], 1);
+  if (b == 0) {
     return -1;
   }
+  Lmemset(b->data + 2 * sizeof(struct dirent), 0, BSIZE - 2 * sizeof(struct dirent));
+  b->dirty = 1;
+  bwrite(b);
+  brelse(b);
+  for (int i = 1; i < NDIRECT && dp->addrs[i] != 0; i++) {
+    bfree(DEVFD, dp->addrs[i]);
+    dp->addrs[i] = 0;
+  }
+  dp->size = 2 * sizeof(struct dirent);
+  iupdate(dp, dirinum);
+  struct dirhint *h = dirhint(dirinum);
+  h->free = 2;
+  h->live = 2;
+  return 0;
+}
+
+/*
+  rm -r:  remove pathname, and everything in it if it is a directory.
+*/
+int removetree(uint dirinum, const char *pathname){
+  char name[DIRSIZ+1] = {0};
   struct dinode inode;
-  struct dinode inode2;
-  int result = getinode(&inode, inum);
-  int result2 = getinode(&inode2, inum2);
-  if(result == -1 || result2 == -1 || inode.type != T_DIR || inode2.type != T_DIR){
+  uint parent = nameiparentat(dirinum, pathname, name);
+  uint inum;
+
+  if (parent == 0 || name[0] == '\0' || Lstrcmp(name, ".") == 0 || Lstrcmp(name, "..") == 0) {
+    return -1;    // Not /, and not a directory from inside
+  }
+  if ((inum = find_dent(parent, name)) == 0 || getinode(&inode, inum) == -1) {
     return -1;
   }
-  for(int i = 0; i < 13; i++){
-    if (inode.addrs[i] == 0){
-      return -1;
+  if (inode.type == T_DIR && emptydir(inum, &inode) < 0) {
+    return -1;
+  }
+  return unlinkin(dirinum, pathname);
+}
+
+
+
+/*
+  Like nameiat, but stop one element early:  return the inode number
+  of the parent directory and copy the last element into name (which
+  must hold DIRSIZ+1 bytes).  name stays empty for "/".
+*/
+uint nameiparentat(uint dirinum, const char *pathname, char *name){
+  char elem[DIRSIZ+1];
+  int toolong;
+  uint inum;
+
+  inum = pathname[0] == '/' ? ROOTINO : dirinum;
+  while ((pathname = skipelem(pathname, elem, &toolong)) != 0) {
+    if (toolong)
+      return 0;
+    if (*pathname == '\0') { // Handle the last part of the path
+      Lstrcpy(name, elem);
+      break;
     }
-    uint blockptr = inode.addrs[i];
-    uint blockptr2 = inode2.addrs[i];
-    struct buf *b;
-    struct buf *b2;
-    b = bread(DEVFD, blockptr);
-    b2 = bread(DEVFD, blockptr2);
-    //Lprintf("Validity:  %d\n", b->valid);
-    if (b->valid == 1 && b2->valid == 1){
-      struct dirent *dir;
-      struct dirent *dir2;
-
-      for (int k = 0; k < 64; k++) {
-        dir = (struct dirent *) &b->data[k*16];
-        if (Lstrcmp(dir->name, fileName) == 0){
-          int result = getinode(&inode, dir->inum);
-          if(result == -1 || inode.type != T_FILE){
-             brelse(b);
-            return -1;
-          }
-            break;
-        }
-      }
+    if (elem[0] == '.' && elem[1] == '\0')
+      continue;
+    STAT_INC(namei_components);
+    if ((inum = find_dent(inum, elem)) == 0)
+      return 0; // Directory not found
+  }
+  return inum;
+}
 
-      for (int k = 0; k < 64; k++) {
-        dir2 = (struct dirent *) &b2->data[k*16];
-        if (Lstrcmp(dir2->name, fileName2) == 0){
-          int result2 = getinode(&inode2, dir2->inum);
-          if(result2 == -1 || inode2.type != T_FILE){
-             brelse(b2);
-            return -1;
-          }
-            break;
-        }
-      }
+uint dirWithFileToRm(const char *pathname, char *name){
+  return nameiparentat(ROOTINO, pathname, name);
+}
 
-      dir->inum = dir2->inum;
+/*
+  Add a directory entry (name, inum) to directory dirinum, reusing the
+  first free slot in its direct blocks and growing size past the end;
+  when every block is full, a new block is added.  Each block is read
+  and released on its own, so no two buffers are ever held at once.
+  Returns 0 on success, -1 if the directory cannot grow.
+*/
+int dirlink(uint dirinum, const char *name, uint inum){
+  struct dinode dir;
+  struct dirhint *h = dirhint(dirinum);
+  if (getinode(&dir, dirinum) == -1 || dir.type != T_DIR) {
+    return -1;
+  }
+  /* Slots below h->free are taken:  start there */
+  for (int i = h->free / DIRSLOTS; i < NDIRECT; i++) {
+    if (dir.addrs[i] == 0) {
+      /* Every block is full:  grow the directory by one (zeroed) block */
+      if ((dir.addrs[i] = balloc(DEVFD)) == 0) {
+        return -1;
+      }
+      dir.size = i*BSIZE;
+      iupdate(&dir, dirinum);
+    }
+    struct buf *b = bread_meta(DEVFD, dir.addrs[i], 1);
+    int k0 = i == h->free / DIRSLOTS ? h->free % DIRSLOTS : 0;
+    for (int k = k0; k < DIRSLOTS; k++) {
+      struct dirent *de = (struct dirent *) &b->data[k*sizeof(struct dirent)];
+      uint off = i*BSIZE + (k+1)*sizeof(struct dirent);
+      STAT_INC(dirents_scanned);
+      if (de->inum != 0 && off <= dir.size) {
+        continue;
+      }
+      Lmemset(de, 0, sizeof(struct dirent));
+      for (int n = 0; n < DIRSIZ && name[n] != '\0'; n++) {
+        de->name[n] = name[n];
+      }
+      de->inum = inum;
+      b->dirty = 1;
       bwrite(b);
       brelse(b);
-      brelse(b2);
+      h->free = i*DIRSLOTS + k + 1;
+      if (h->live >= 0) {
+        h->live++;
+      }
+      if (off > dir.size) {
+        dir.size = off;
+        iupdate(&dir, dirinum);
+      }
       return 0;
     }
+    brelse(b);
   }
   return -1;
 }
 
+/*
+  Like ln:  make pathname2 a new name for the file at pathname.
+*/
+int link(const char *pathname, const char *pathname2){
+  return linkin(ROOTINO, pathname, pathname2);
+}
+
+int linkin(uint dirinum, const char *pathname, const char *pathname2){
+  char fileName2[20] = {0};
+  uint inum = nameiat(dirinum, pathname);
+  uint parent2 = nameiparentat(dirinum, pathname2, fileName2);
+  if(inum == 0 || parent2 == 0 || fileName2[0] == '\0'){
+    return -1;
+  }
+  struct dinode inode;
+  if(getinode(&inode, inum) == -1 || inode.type != T_FILE){
+    return -1;
+  }
+  if(find_dent(parent2, fileName2) != 0){
+    return -1;  // newpath already exists
+  }
+  if(dirlink(parent2, fileName2, inum) == -1){
+    return -1;
+  }
+  inode.nlink++;
+  iupdate(&inode, inum);
+  return 0;
+}
+
+/*
+  creat:  make an empty file called name in directory inum.
+  Returns the new inode number, or -1.
+*/
 uint createPath(uint inum, const char *name) {
     struct dinode inode;
-    struct buf *b;
-    struct dirent *dir;
+    uint newInum;
 
+    if (name == 0 || name[0] == '\0' || Lstrlen((char *)name) > DIRSIZ) {
+        return -1;
+    }
     if (getinode(&inode, inum) == -1 || inode.type != T_DIR) {
         return -1;
     }
+    if (find_dent(inum, name) != 0) {
+        return -1; // Already exists
+    }
+    if ((newInum = ialloc(DEVFD, T_FILE)) == 0) {
+        return -1; // No free inode found
+    }
+    if (dirlink(inum, name, newInum) == -1) {
+        // Parent full:  give the inode back
+        struct dinode freed;
+        Lmemset(&freed, 0, sizeof(freed));
+        iupdate(&freed, newInum);
+        return -1;
+    }
+    return newInum;
+}
 
-    for (int i = 0; i < 13; i++) {
-        if (inode.addrs[i] == 0) {
-            continue;
-        }
 
-        b = bread(DEVFD, inode.addrs[i]);
-        for (uint k = 0; k < BSIZE / sizeof(struct dirent); k++) {
-            dir = (struct dirent *)&b->data[k * sizeof(struct dirent)];
-            if (dir->inum == 0) {
-                size_t name_len = Lstrlen((char *)name);
-                if (name_len >= DIRSIZ) {
-                    name_len = DIRSIZ - 1;
-                }
-                Lmemcpy(dir->name, name, name_len);
-                dir->name[name_len] = '\0';
-
-                uint emptyInode = 0;
-                for (uint j = 1; j < BSIZE; j++) { // Start at 1 to skip the root inode
-                    if (inodeUsage[j] == 0) { // Found a free inode
-                        emptyInode = j;
-                        inodeUsage[j] = 1; // Mark as in use
-                        break;
-                    }
-                }
+/* Write the in-memory SB back to the superblock */
+static void sbwrite(void) {
+    struct buf *bp = bread(DEVFD, 1);
+    if (bp == 0) {
+        return;
+    }
+    Lmemcpy(bp->data, &SB, sizeof(SB));
+    bp->dirty = 1;
+    bwritesync(bp);     // Its flags must not be overtaken (write-back)
+    brelse(bp);
+}
 
-                if (emptyInode == 0) {
-                    brelse(b);
-                    return -1; // No free inode found
-                }
+/*
+  Free-space summary (fsum_load(), fsusage() in walkfunctions.h).
+  Every allocator and free path calls fsum_unclean() before it touches
+  the bitmap or the inode table, so SB_CLEAN is off on disk before
+  the saved counts can go stale, and fsum_change() once it is done.
+  sync() sets SB_CLEAN again only after everything else is written.
+*/
+static struct {
+    int loaded;
+    uint nfree;     // Clear bits in the free bitmap
+    uint nifree;    // Inodes 1..ninodes-1 with type 0
+} fsum;
+
+static void fsum_unclean(void) {
+    if (SB.flags & SB_CLEAN) {
+        SB.flags &= ~SB_CLEAN;
+        sbwrite();
+    }
+}
 
-                dir->inum = emptyInode;
-                b->dirty = 1;
-                bwrite(b);
-                brelse(b);
+static void fsum_change(int blocks, int inodes) {
+    if (!fsum.loaded) {
+        return;
+    }
+    fsum.nfree += blocks;
+    fsum.nifree += inodes;
+}
 
-                // Additional code to initialize the new inode goes here.
+/*
+  The fsum_load() scan, in parts:  each part counts a run of bitmap
+  blocks or inode blocks and adds its count to the scan's under the
+  mutex.  The parts run on a pool of FSUM_WORKERS threads (inline if
+  each table is one part, or there is no pool), and fsum_load() waits
+  on done until every part is merged.
+*/
+#define FSUM_WORKERS  4
+#define FSUM_MAXPARTS 32        // Per table
+#define FSUM_MINPART  16        // Blocks:  less is not worth a thread
+
+struct fsum_scan {
+    Lmutex m;
+    Lcond done;
+    int left;       // Parts not yet merged
+    int err;
+    uint used;      // Bits set in the bitmap
+    uint nifree;
+};
+
+struct fsum_part {
+    struct fsum_scan *s;
+    int inodes;     // Else bitmap
+    uint lo, hi;    // Block numbers or inode numbers [lo, hi)
+};
+
+/*
+  Bits set in x.  Not __builtin_popcount():  without a popcount
+  instruction gcc calls libgcc's __popcountdi2, and Lcli is linked
+  without libgcc.  The bitmap is mostly dense, so count in parallel
+  (SWAR) rather than one set bit at a time.
+*/
+static inline uint bitcount(uint x) {
+    x = x - ((x >> 1) & 0x55555555);
+    x = (x & 0x33333333) + ((x >> 2) & 0x33333333);
+    x = (x + (x >> 4)) & 0x0f0f0f0f;
+    return (x * 0x01010101) >> 24;
+}
 
-                return emptyInode;
+/* Bits set for blocks [lo, hi), lo a multiple of BPB; -1 if unreadable */
+static int fsum_bits(uint lo, uint hi, uint *used) {
+    /* One popcount per word (bit i of a block is bit i%32 of
+       little-endian word i/32), masking off the bits past hi */
+    for (uint b = lo; b < hi; b += BPB) {
+        struct buf *bp = bread(DEVFD, BBLOCK(b, SB));
+        if (bp == 0 || bp->disk_rw_fail) {
+            if (bp != 0) {
+                brelse(bp);
             }
+            return -1;
         }
-        brelse(b);
+        uint n = hi - b < BPB ? hi - b : BPB;
+        uint *w = (uint *) bp->data;
+        for (uint i = 0; i < n / 32; i++) {
+            *used += bitcount(w[i]);
+        }
+        if (n % 32 != 0) {
+            *used += bitcount(w[n / 32] & ((1U << (n % 32)) - 1));
+        }
+        brelse(bp);
     }
-	Lprintf("%d\n", inode);
-	Lprintf("%d\n", inum);
-
-    return -1;
+    return 0;
 }
 
-
-void sync() {
-  struct buf *b;
-    for (b = bcache.head.next; b!= &bcache.head; b = b->next) {
-        if (b->valid == 0 || b->refcnt == 0) {
-            continue;
-        }
-        if (b->dirty == 0) {
-            continue;
+/* Free inodes in [lo, hi), a block at a time; -1 if unreadable */
+static int fsum_inodes(uint lo, uint hi, uint *nifree) {
+    for (uint i = lo; i < hi; ) {
+        struct buf *bp = bread(DEVFD, IBLOCK(i, SB));
+        if (bp == 0 || bp->disk_rw_fail) {
+            if (bp != 0) {
+                brelse(bp);
+            }
+            return -1;
         }
-        bwrite(b);
+        struct dinode *dip = (struct dinode *) bp->data;
+        do {
+            *nifree += dip[i % IPB].type == 0;
+            i++;
+        } while (i < hi && i % IPB != 0);
+        brelse(bp);
     }
+    return 0;
 }
 
-int iupdate(struct dinode *inode, uint inum) {
-    uint blockno = IBLOCK(inum, SB);
-    struct buf *bp = bread(DEVFD, blockno);
-    struct dinode *dip = (struct dinode *)(bp->data) + (inum % IPB);
+static void fsum_count(void *arg) {
+    struct fsum_part *p = arg;
+    struct fsum_scan *s = p->s;
+    uint n = 0;
+    int rc = p->inodes ? fsum_inodes(p->lo, p->hi, &n) : fsum_bits(p->lo, p->hi, &n);
+
+    Lmutex_lock(&s->m);
+    if (rc < 0) {
+        s->err = 1;
+    } else if (p->inodes) {
+        s->nifree += n;
+    } else {
+        s->used += n;
+    }
+    if (--s->left == 0) {
+        Lcond_signal(&s->done);
+    }
+    Lmutex_unlock(&s->m);
+}
 
-    *dip = *inode;
-    bp->dirty = 1;
-    bwrite(bp);
-    brelse(bp);
-    return 0; 
+/*
+  Cut items [lo, hi), per to a block, into at most FSUM_MAXPARTS parts
+  on block boundaries, each of at least FSUM_MINPART blocks.  Returns
+  the number of parts.
+*/
+static int fsum_split(struct fsum_part *part, struct fsum_scan *s, int inodes,
+                      uint lo, uint hi, uint per) {
+    uint nblocks = (hi - 1) / per - lo / per + 1;
+    uint step = (nblocks + FSUM_MAXPARTS - 1) / FSUM_MAXPARTS;
+    int n = 0;
+
+    if (step < FSUM_MINPART) {
+        step = FSUM_MINPART;
+    }
+    for (uint a = lo; a < hi; n++) {
+        uint b = (a / per + step) * per;
+        part[n].s = s;
+        part[n].inodes = inodes;
+        part[n].lo = a;
+        part[n].hi = b < hi ? b : hi;
+        a = part[n].hi;
+    }
+    return n;
 }
 
-uint mkdir(const char *path) {
-    if (path[0] != '/') {
-        return -1; 
+int fsum_load(int scan) {
+    static struct fsum_part part[2 * FSUM_MAXPARTS];
+    static Lpool pool;
+    struct fsum_scan s;
+    int n, nworkers;
+
+    if ((SB.flags & SB_CLEAN) && SB.nfree <= SB.nblocks && SB.nifree < SB.ninodes) {
+        fsum.nfree = SB.nfree;
+        fsum.nifree = SB.nifree;
+        fsum.loaded = 1;
+        return 0;
     }
-
-    char parentPath[1024] = {0};
-    char newDirName[DIRSIZ] = {0};
-    const char *slash = Lstrchr(path, '/');
-    if (slash && slash != path) { 
-        size_t len = slash - path;
-        Lmemcpy(parentPath, path, len); 
-        parentPath[len] = '\0'; 
-        Lmemcpy(newDirName, slash + 1, Lstrlen((char *)slash + 1)); 
+    if (!scan) {
+        return -1;
+    }
+    Lmemset(&s, 0, sizeof(s));
+    Lmutex_init(&s.m);
+    Lcond_init(&s.done);
+    n = fsum_split(part, &s, 0, 0, SB.size, BPB);
+    n += fsum_split(part + n, &s, 1, 1, SB.ninodes, IPB);
+    s.left = n;
+    nworkers = n < FSUM_WORKERS ? n : FSUM_WORKERS;
+    if (n > 2 && Lpool_init(&pool, nworkers) == 0) {
+        for (int i = 0; i < n; i++) {
+            Lpool_submit(&pool, fsum_count, &part[i]);
+        }
+        Lmutex_lock(&s.m);
+        while (s.left > 0) {
+            Lcond_wait(&s.done, &s.m);
+        }
+        Lmutex_unlock(&s.m);
+        Lpool_destroy(&pool);
     } else {
-        return -1; 
+        for (int i = 0; i < n; i++) {
+            fsum_count(&part[i]);
+        }
+    }
+    if (s.err) {
+        return -1;
+    }
+    fsum.nfree = SB.size - s.used;
+    fsum.nifree = s.nifree;
+    fsum.loaded = 1;
+    return 0;
+}
+
+int fsusage(struct fsusage *u) {
+    if (!fsum.loaded && fsum_load(1) < 0) {
+        return -1;
+    }
+    u->blocks = SB.nblocks;
+    u->bfree = fsum.nfree;
+    u->inodes = SB.ninodes - 1;
+    u->ifree = fsum.nifree;
+    return 0;
+}
+
+/* Also saves the free counts, marking them good for the next mount */
+void sync() {
+  bflush();
+  if (fsum.loaded && !(SB.flags & SB_CLEAN)) {
+    SB.nfree = fsum.nfree;
+    SB.nifree = fsum.nifree;
+    SB.flags |= SB_CLEAN;
+    sbwrite();
+  }
+}
+
+int iupdate(struct dinode *inode, uint inum) {
+    if (inode->type == 0) {
+        fsum_unclean();     // May be freeing it
     }
+    uint blockno = IBLOCK(inum, SB);
+    struct buf *bp = bread(DEVFD, blockno);
+    struct dinode *dip = (struct dinode *)(bp->data) + (inum % IPB);
 
-    uint parentInum = namei(parentPath);
-    if (parentInum == 0) {
+    if ((dip->type == 0) != (inode->type == 0)) {
+        fsum_change(0, inode->type == 0 ? 1 : -1);
+    }
+    *dip = *inode;
+    bp->dirty = 1;
+    bwrite(bp);
+    brelse(bp);
+    return 0; 
+}
+
+uint mkdir(const char *path) {
+    char newDirName[DIRSIZ+1] = {0};
+    uint parentInum = dirWithFileToRm(path, newDirName);
+    if (parentInum == 0 || newDirName[0] == '\0') {
         return -1; 
     }
+    return mkdirat(parentInum, newDirName);
+}
 
+uint mkdirat(uint parentInum, const char *newDirName) {
+    struct dinode parentInode;
+    if (getinode(&parentInode, parentInum) == -1 || parentInode.type != T_DIR) {
+        return -1;
+    }
     if (find_dent(parentInum, newDirName) != 0) {
         return -1; 
     }
@@ -416,16 +1100,18 @@ uint mkdir(const char *path) {
     struct dinode newDirInode;
     Lmemset(&newDirInode, 0, sizeof(struct dinode));
     newDirInode.type = T_DIR;
-    newDirInode.nlink = 2;
+    newDirInode.nlink = 1;
     newDirInode.size = 2 * sizeof(struct dirent);
 
-    uint newDirBlock = balloc(DEVFD); // You need to implement balloc
+    uint newDirBlock = balloc(DEVFD);
     if (newDirBlock == 0) {
+        newDirInode.type = 0; // Give the inode back
+        iupdate(&newDirInode, newDirInum);
         return -1; 
     }
     newDirInode.addrs[0] = newDirBlock;
 
-    struct buf *b = bread(DEVFD, newDirBlock);
+    struct buf *b = bread_meta(DEVFD, newDirBlock, 1);
     struct dirent *de = (struct dirent *)b->data;
     de->inum = newDirInum;
     Lmemcpy(de->name, ".", 2);
@@ -439,72 +1125,1232 @@ uint mkdir(const char *path) {
 
     iupdate(&newDirInode, newDirInum);
 
-    struct buf *parentBuf = bread(DEVFD, BBLOCK(parentInum, SB));
-	struct dirent *parentDe = (struct dirent *)parentBuf->data;
-	for (int i = 0; i < BSIZE / sizeof(struct dirent); i++, parentDe++) {
-   	 if (parentDe->inum == 0) { 
-       	 parentDe->inum = newDirInum;
-       	 size_t dirNameLen = Lstrlen(newDirName);
-       	 if (dirNameLen >= DIRSIZ) {
-            dirNameLen = DIRSIZ - 1;
-       	 }
-       	 Lmemcpy(parentDe->name, newDirName, dirNameLen);
-       	 parentDe->name[dirNameLen] = '\0'; 
-       	 parentBuf->dirty = 1;
-       	 bwrite(parentBuf);
-       	 break;
-  	  }
-	}
-	brelse(parentBuf);
+    if (dirlink(parentInum, newDirName, newDirInum) == -1) {
+        itrunc(&newDirInode, newDirInum);   // Give the block and inode back
+        newDirInode.type = 0;
+        iupdate(&newDirInode, newDirInum);
+        return -1;
+    }
+    // ".." in the new directory
+    if (getinode(&parentInode, parentInum) == 0) {
+        parentInode.nlink++;
+        iupdate(&parentInode, parentInum);
+    }
     return newDirInum; 
 }
 
-#define TOTAL_BLOCKS 10000 
-int blockBitmap[TOTAL_BLOCKS] = {0};
+/*
+  mkdir -p:  create every missing directory along path (relative to
+  directory dirinum unless absolute), resolving it one element at a
+  time, so each level is looked up once.  Returns the last one's
+  inum, or -1.
+*/
+uint mkdirs(uint dirinum, const char *path) {
+    char name[DIRSIZ+1];
+    int toolong;
+    struct dinode inode;
+    uint inum = path[0] == '/' ? ROOTINO : dirinum;
+
+    while ((path = skipelem(path, name, &toolong)) != 0) {
+        if (toolong) {
+            return -1;
+        }
+        if (Lstrcmp(name, ".") == 0) {
+            continue;
+        }
+        uint next = find_dent(inum, name);
+        if (next == 0 && (next = mkdirat(inum, name)) == (uint) -1) {
+            return -1;
+        }
+        if (getinode(&inode, next) == -1 || inode.type != T_DIR) {
+            return -1;     // A file is in the way
+        }
+        inum = next;
+    }
+    return inum;
+}
+
+/*
+  Allocate a zeroed data block, as in xv6:  scan the on-disk free
+  bitmap through the buffer cache.  mkfs marks the boot, super, log,
+  inode and bitmap blocks in use, so they are never handed out.
 
+  The block is zeroed in the cache only, and left dirty:  every caller
+  fills it in and writes it right away, so reading it from disk or
+  writing the zeroes out first would be wasted I/O.
+*/
 uint balloc(int dev) {
-    for (uint i = 0; i < TOTAL_BLOCKS; i++) {
-        if (blockBitmap[i] == 0) { 
-            blockBitmap[i] = 1; 
-            struct buf *b = bread(dev, i);
-            Lmemset(b->data, 0, BSIZE);
-            bwrite(b);
-            brelse(b);
+    if (fsum.loaded && fsum.nfree == 0) {
+        return 0;   // Full:  no need to scan the bitmap to find out
+    }
+    fsum_unclean();
+    for (uint b = 0; b < SB.size; b += BPB) {
+        struct buf *bp = bread(dev, BBLOCK(b, SB));
+        if (bp == 0) {
+            return 0;
+        }
+        for (uint bi = 0; bi < BPB && b + bi < SB.size; bi++) {
+            int m = 1 << (bi % 8);
+            STAT_INC(balloc_probes);
+            if ((bp->data[bi/8] & m) == 0) { // Is block free?
+                bp->data[bi/8] |= m; // Mark block in use
+                bp->dirty = 1;
+                bwrite(bp);
+                brelse(bp);
+                fsum_change(-1, 0);
+
+                struct buf *zb = bnew(dev, b + bi);
+                if (zb != 0) {
+                    Lmemset(zb->data, 0, BSIZE); // May hold a freed block's data
+                    zb->dirty = 1;
+                    brelse(zb);
+                }
+                return b + bi; 
+            }
+        }
+        brelse(bp);
+    }
+    return 0; 
+}
+
+/*
+  Allocate an inode of the given type, as in xv6:  the first on-disk
+  inode with type 0 is free.  Inode 0 is never used.
+*/
+uint ialloc(uint dev, int type) {
+    if (fsum.loaded && fsum.nifree == 0) {
+        return 0;
+    }
+    fsum_unclean();
+    for (uint i = 1; i < SB.ninodes; i++) { 
+        uint blockno = IBLOCK(i, SB); 
+        struct buf *bp = bread(dev, blockno);
+        if (bp == 0) {
+            return 0;
+        }
+        struct dinode *dip = (struct dinode *)(bp->data) + (i % IPB);
+        STAT_INC(ialloc_probes);
+        if (dip->type == 0) { // a free inode
+            Lmemset(dip, 0, sizeof(struct dinode));
+            dip->type = type;
+            dip->nlink = 1; 
+            bp->dirty = 1;
+            bwrite(bp);
+            brelse(bp);
+            fsum_change(0, -1);
 
             return i; 
         }
+        brelse(bp);
     }
     return 0; 
 }
 
-#define TOTAL_INODES 1024 
-int inodeBitmap[TOTAL_INODES] = {0}; 
+/*
+  ialloc() for n inodes at once, in one pass over the inode table:
+  each inode block is read once and written once, however many of its
+  inodes are taken.  Fills inums[] and returns how many were
+  allocated (fewer than n if the table is full).
+*/
+static int iallocmany(int type, uint *inums, int n) {
+    int got = 0;
+
+    if (fsum.loaded && fsum.nifree == 0) {
+        return 0;
+    }
+    fsum_unclean();
+    for (uint i = 1; i < SB.ninodes && got < n; ) {
+        struct buf *bp = bread(DEVFD, IBLOCK(i, SB));
+        if (bp == 0) {
+            break;
+        }
+        int claimed = 0;
+        do {
+            struct dinode *dip = (struct dinode *)(bp->data) + (i % IPB);
+            STAT_INC(ialloc_probes);
+            if (dip->type == 0) {
+                Lmemset(dip, 0, sizeof(struct dinode));
+                dip->type = type;
+                dip->nlink = 1;
+                inums[got++] = i;
+                claimed++;
+            }
+            i++;
+        } while (got < n && i < SB.ninodes && i % IPB != 0);
+        if (claimed > 0) {
+            bp->dirty = 1;
+            bwrite(bp);
+            fsum_change(0, -claimed);
+        }
+        brelse(bp);
+    }
+    return got;
+}
 
+/* FNV-1a of a NUL terminated name */
+static uint namehash(const char *s) {
+    uint h = 2166136261u;
 
-uint ialloc(uint dev, int type) {
-    for (uint i = 1; i < TOTAL_INODES; i++) { 
-        if (inodeBitmap[i] == 0) { 
-            inodeBitmap[i] = 1; 
-
-            struct dinode newInode;
-            Lmemset(&newInode, 0, sizeof(struct dinode));
-            newInode.type = type;
-            newInode.nlink = 1; 
-
-            
-            uint blockno = IBLOCK(i, SB); 
-            struct buf *bp = bread(dev, blockno);
-            struct dinode *dip = (struct dinode *)(bp->data) + (i % IPB);
-            *dip = newInode; 
+    while (*s != '\0') {
+        h = (h ^ (uchar) *s++) * 16777619u;
+    }
+    return h;
+}
+
+/*
+  creat for n names in directory dirinum at once (creat a b c ...).
+  One pass over the directory finds the names already there and its
+  free slots; the inodes come from one pass over the inode table
+  (iallocmany()); then each directory block gets all of its new
+  entries with one write, new blocks are added as needed, and the
+  directory inode is written once.
+
+  inums[i] becomes the new inode of names[i], or 0 if it was not
+  created:  a bad or repeated name, one that exists already, or no
+  room left.  Returns the number created, or -1 if dirinum is not a
+  directory (or out of memory).
+*/
+int createmany(uint dirinum, char **names, int n, uint *inums) {
+    struct dinode dir;
+
+    if (getinode(&dir, dirinum) == -1 || dir.type != T_DIR) {
+        return -1;
+    }
+    int nb = dirblocks(&dir);
+    uint hsize = 16;
+    while (hsize < 2 * (uint) n) {
+        hsize *= 2;
+    }
+    int *ht = Larena_alloc(&cmdarena, hsize * sizeof(int));
+    char *want = Larena_alloc(&cmdarena, n ? n : 1);
+    int *todo = Larena_alloc(&cmdarena, (n ? n : 1) * sizeof(int));
+    uint *newinums = Larena_alloc(&cmdarena, (n ? n : 1) * sizeof(uint));
+    uint *freeslot = Larena_alloc(&cmdarena, (nb * DIRSLOTS + 1) * sizeof(uint));
+    if (ht == 0 || want == 0 || todo == 0 || newinums == 0 || freeslot == 0) {
+        return -1;
+    }
+
+    /* The names to create, in an open addressing table of indexes */
+    for (uint j = 0; j < hsize; j++) {
+        ht[j] = -1;
+    }
+    for (int i = 0; i < n; i++) {
+        int len = Lstrlen(names[i]);
+        inums[i] = 0;
+        want[i] = len > 0 && len <= DIRSIZ && Lstrchr(names[i], '/') == 0
+            && Lstrcmp(names[i], ".") != 0 && Lstrcmp(names[i], "..") != 0;
+        if (!want[i]) {
+            continue;
+        }
+        uint j = namehash(names[i]) & (hsize - 1);
+        while (ht[j] >= 0 && Lstrcmp(names[ht[j]], names[i]) != 0) {
+            j = (j + 1) & (hsize - 1);
+        }
+        if (ht[j] >= 0) {
+            want[i] = 0;    // Repeated:  the first one is created
+        } else {
+            ht[j] = i;
+        }
+    }
+
+    /* One pass over the directory:  drop names it has, list free slots */
+    int nfree = 0;
+    for (int b = 0; b < nb; b++) {
+        struct buf *bp = bread_meta(DEVFD, dir.addrs[b], 1);
+        if (bp == 0) {
+            return -1;
+        }
+        struct dirent *de = (struct dirent *) bp->data;
+        for (int k = 0; k < DIRSLOTS; k++) {
+            uint slot = b * DIRSLOTS + k;
+            char name[DIRSIZ+1];
+            STAT_INC(dirents_scanned);
+            if (de[k].inum == 0 || (slot + 1) * sizeof(struct dirent) > dir.size) {
+                freeslot[nfree++] = slot;
+                continue;
+            }
+            Lmemcpy(name, de[k].name, DIRSIZ);
+            name[DIRSIZ] = '\0';
+            uint j = namehash(name) & (hsize - 1);
+            while (ht[j] >= 0 && Lstrcmp(names[ht[j]], name) != 0) {
+                j = (j + 1) & (hsize - 1);
+            }
+            if (ht[j] >= 0) {
+                want[ht[j]] = 0;
+            }
+        }
+        brelse(bp);
+    }
+
+    int m = 0;
+    for (int i = 0; i < n; i++) {
+        if (want[i]) {
+            todo[m++] = i;
+        }
+    }
+    if (m > nfree + (NDIRECT - nb) * DIRSLOTS) {
+        m = nfree + (NDIRECT - nb) * DIRSLOTS;
+    }
+    m = iallocmany(T_FILE, newinums, m);
+
+    /* Fill free slots in order, block by block, then new blocks */
+    int t = 0, fp = 0;
+    uint last = 0;
+    for (int b = 0; t < m && b < NDIRECT; b++) {
+        if (b >= nb && (dir.addrs[b] = balloc(DEVFD)) == 0) {
+            break;
+        }
+        struct buf *bp = bread_meta(DEVFD, dir.addrs[b], 1);
+        if (bp == 0) {
+            break;
+        }
+        struct dirent *de = (struct dirent *) bp->data;
+        int wrote = 0;
+        for (int k = 0; k < DIRSLOTS && t < m; k++) {
+            uint slot = b * DIRSLOTS + k;
+            if (fp < nfree && freeslot[fp] == slot) {
+                fp++;
+            } else if (b < nb) {
+                continue;   // In use
+            }
+            Lmemset(&de[k], 0, sizeof(struct dirent));
+            Lmemcpy(de[k].name, names[todo[t]], Lstrlen(names[todo[t]]));
+            de[k].inum = newinums[t];
+            inums[todo[t]] = newinums[t];
+            t++;
+            last = slot;
+            wrote = 1;
+        }
+        if (wrote) {
             bp->dirty = 1;
             bwrite(bp);
+        }
+        brelse(bp);
+    }
+    for (int i = t; i < m; i++) {   // No block for them after all
+        struct dinode freed;
+        Lmemset(&freed, 0, sizeof(freed));
+        iupdate(&freed, newinums[i]);
+    }
+    if (t > 0 && (last + 1) * sizeof(struct dirent) > dir.size) {
+        dir.size = (last + 1) * sizeof(struct dirent);
+    }
+    iupdate(&dir, dirinum);
+
+    struct dirhint *h = dirhint(dirinum);
+    if (t > 0) {
+        h->free = fp < nfree ? freeslot[fp] : last + 1;
+    }
+    h->live = nb * DIRSLOTS - nfree + t;
+    return t;
+}
+
+/*
+  The last I_LZ cluster decompressed, by the disk address of its first
+  block:  reading a compressed file sequentially decompresses each
+  cluster once.  bfree() forgets it when that block goes.
+*/
+static struct {
+  uint addr;                        // 0:  empty
+  char data[ZCLUSTER*BSIZE];
+  char packed[ZCLUSTER*BSIZE];      // The cluster's blocks, as stored
+} zcache;
+
+#define ISLZ(ip) ((ip)->type == T_FILE && ((ip)->major & I_LZ))
+#define ISINLINE(ip) ((ip)->type == T_FILE && ((ip)->major & I_INLINE))
+
+/*
+  Block sharing (download -d).  Identical file data blocks are stored
+  once, and dd.refs[b] counts the file block pointers to block b.  The
+  counts are not kept on disk:  they are rebuilt from the inodes the
+  first time a session needs them, that is for a dedup download, or
+  before freeing blocks of an image whose superblock has SB_SHARED.
+  Mounting never scans for them.  A count of 0 means "not counted", which for
+  a block in use is one.  A count that reaches DD_MAXREFS sticks
+  there, and such a block is never freed.
+
+  Sharing is safe because file data blocks are never rewritten in
+  place:  download, the only writer of file data, truncates first.
+
+  dd.index maps a hash of a block's contents to a block that had them.
+  A match is compared byte for byte before it is shared, and entries
+  whose block has since been freed (count 0) are ignored.
+*/
+#define DD_MAXREFS 0xffff
+
+struct ddslot {
+    ulong hash;
+    uint addr;              // 0:  empty
+};
+
+static struct {
+    ushort *refs;           // SB.size counts; 0 until counted
+    struct ddslot *index;   // Open addressing, linear probing
+    uint mask;
+    uint used;
+} dd;
+
+/* Hash of a block's contents, a word at a time (p is 8-byte aligned) */
+static ulong blockhash(const char *p) {
+    const ulong *w = (const ulong *) p;
+    ulong h = 0xcbf29ce484222325UL;
+
+    for (int i = 0; i < BSIZE / sizeof(ulong); i++) {
+        h = (h ^ w[i]) * 0x100000001b3UL;
+        h ^= h >> 32;
+    }
+    return h;
+}
+
+/* Index block addr under hash h, replacing an older block with the same hash */
+static void dedup_insert(ulong h, uint addr) {
+    uint i = h & dd.mask;
+
+    while (dd.index[i].addr != 0 && dd.index[i].hash != h) {
+        i = (i + 1) & dd.mask;
+    }
+    if (dd.index[i].addr == 0) {
+        dd.used++;
+    }
+    dd.index[i].hash = h;
+    dd.index[i].addr = addr;
+}
+
+/* (Re)build dd.index from every counted block */
+static void dedup_reindex(void) {
+    Lmemset(dd.index, 0, (dd.mask + 1) * sizeof(struct ddslot));
+    dd.used = 0;
+    for (uint b = 0; b < SB.size; b++) {
+        if (dd.refs[b] == 0) {
+            continue;
+        }
+        struct buf *bp = bread(DEVFD, b);
+        if (bp == 0) {
+            continue;
+        }
+        dedup_insert(blockhash((char *) bp->data), b);
+        brelse(bp);
+    }
+}
+
+/*
+  Count the pointers to every file data block (not indirect blocks:
+  they change in place) and, with index, build dd.index too.  The
+  caller must hold no buffer.  Returns 0, or -1 if out of memory.
+*/
+static int dedup_load(int index) {
+    if (dd.refs == 0) {
+        ushort *refs = Lmalloc(SB.size * sizeof(ushort));
+        if (refs == 0) {
+            return -1;
+        }
+        Lmemset(refs, 0, SB.size * sizeof(ushort));
+        for (uint inum = 1; inum < SB.ninodes; inum++) {
+            struct dinode ip;
+            if (getinode(&ip, inum) == -1 || ip.type != T_FILE || ISINLINE(&ip)) {
+                continue;
+            }
+            for (int i = 0; i < NDIRECT; i++) {
+                if (ip.addrs[i] != 0 && ip.addrs[i] < SB.size
+                        && refs[ip.addrs[i]] < DD_MAXREFS) {
+                    refs[ip.addrs[i]]++;
+                }
+            }
+            if (ip.addrs[NDIRECT] == 0) {
+                continue;
+            }
+            struct buf *bp = bread(DEVFD, ip.addrs[NDIRECT]);
+            if (bp == 0) {
+                continue;
+            }
+            uint *a = (uint *) bp->data;
+            for (int j = 0; j < NINDIRECT; j++) {
+                if (a[j] != 0 && a[j] < SB.size && refs[a[j]] < DD_MAXREFS) {
+                    refs[a[j]]++;
+                }
+            }
             brelse(bp);
+        }
+        dd.refs = refs;
+    }
+    if (index && dd.index == 0) {
+        uint size = 16;
+        while (size < 2 * SB.nblocks) {
+            size *= 2;
+        }
+        if ((dd.index = Lmalloc(size * sizeof(struct ddslot))) == 0) {
+            return -1;
+        }
+        dd.mask = size - 1;
+        dedup_reindex();
+    }
+    return 0;
+}
 
-            return i; 
+/* Counts are needed before freeing if the image may share blocks */
+static int dedup_counted(void) {
+    if (dd.refs != 0 || !(SB.flags & SB_SHARED)) {
+        return 0;
+    }
+    return dedup_load(0);
+}
+
+/* A counted block with the same BSIZE bytes as src, or 0 */
+static uint dedup_find(ulong h, const char *src) {
+    for (uint i = h & dd.mask; dd.index[i].addr != 0; i = (i + 1) & dd.mask) {
+        uint b = dd.index[i].addr;
+        if (dd.index[i].hash != h) {
+            continue;
+        }
+        if (dd.refs[b] == 0 || dd.refs[b] == DD_MAXREFS) {
+            return 0;
+        }
+        struct buf *bp = bread(DEVFD, b);
+        if (bp == 0) {
+            return 0;
         }
+        int same = Lmemcmp(bp->data, src, BSIZE) == 0;
+        brelse(bp);
+        return same ? b : 0;
     }
-    return 0; 
+    return 0;
+}
+
+/* Set flag f in the superblock, on disk as well */
+static void sbflag(uint f) {
+    if (SB.flags & f) {
+        return;
+    }
+    SB.flags |= f;
+    sbwrite();
 }
 
+/*
+  Free a data block, as in xv6:  clear its bit in the on-disk bitmap.
+  A shared block only loses one reference.  If the image shares blocks
+  but they could not be counted, b is leaked rather than risked.
+*/
+void bfree(int dev, uint b) {
+    if (dedup_counted() < 0) {
+        return;
+    }
+    if (dd.refs != 0) {
+        if (dd.refs[b] == DD_MAXREFS) {
+            return;             // Saturated:  the true count is unknown
+        }
+        if (dd.refs[b] > 1) {
+            dd.refs[b]--;
+            return;
+        }
+        dd.refs[b] = 0;
+    }
+    if (b == zcache.addr) {
+        zcache.addr = 0;
+    }
+    fsum_unclean();
+    struct buf *bp = bread(dev, BBLOCK(b, SB));
+    if (bp == 0) {
+        return;
+    }
+    uint bi = b % BPB;
+    int m = 1 << (bi % 8);
+    if (bp->data[bi/8] & m) {
+        fsum_change(1, 0);
+    }
+    bp->data[bi/8] &= ~m;
+    bp->dirty = 1;
+    bwrite(bp);
+    brelse(bp);
+}
 
+/*
+  The disk block holding block bn of the file, as in xv6.  With alloc,
+  missing blocks (and the indirect block) are allocated, and the
+  caller must iupdate() the inode; without, 0 means there is none.
+*/
+uint bmap(struct dinode *ip, uint bn, int alloc) {
+    uint addr;
+
+    if (bn < NDIRECT) {
+        if ((addr = ip->addrs[bn]) == 0 && alloc) {
+            ip->addrs[bn] = addr = balloc(DEVFD);
+        }
+        return addr;
+    }
+    bn -= NDIRECT;
+    if (bn >= NINDIRECT) {
+        return 0;
+    }
+    if ((addr = ip->addrs[NDIRECT]) == 0) {
+        if (!alloc || (addr = balloc(DEVFD)) == 0) {
+            return 0;
+        }
+        ip->addrs[NDIRECT] = addr;
+    }
+    struct buf *bp = bread_meta(DEVFD, addr, 1);
+    uint *a = (uint *) bp->data;
+    if ((addr = a[bn]) == 0 && alloc) {
+        if ((addr = balloc(DEVFD)) != 0) {
+            a[bn] = addr;
+            bp->dirty = 1;
+            bwrite(bp);
+        }
+    }
+    brelse(bp);
+    return addr;
+}
 
+/*
+  Cluster c of I_LZ file *ip (fs.h):  if it is compressed, point *data
+  at its decompressed contents and return 1.  Returns 0 for a raw or
+  hole cluster (read its blocks as usual), -1 if it is corrupt.
+*/
+static int zcluster(struct dinode *ip, uint c, char **data) {
+    uint a[ZCLUSTER];
+    uint first = c * ZCLUSTER;
+    uint nb = (ip->size + BSIZE - 1) / BSIZE - first;
+    uint k;
+
+    if (nb > ZCLUSTER) {
+        nb = ZCLUSTER;
+    }
+    for (uint j = 0; j < nb; j++) {
+        a[j] = bmap(ip, first + j, 0);
+    }
+    if (nb < 2 || a[0] == 0 || a[nb-1] != 0) {
+        return 0;
+    }
+    *data = zcache.data;
+    if (zcache.addr == a[0]) {
+        return 1;
+    }
+    zcache.addr = 0;
+    for (k = 0; k < nb && a[k] != 0; k++) {
+        struct buf *bp = bread(DEVFD, a[k]);
+        if (bp == 0) {
+            return -1;
+        }
+        Lmemcpy(zcache.packed + k*BSIZE, bp->data, BSIZE);
+        brelse(bp);
+    }
+    uint clen;
+    Lmemcpy(&clen, zcache.packed, sizeof(clen));
+    if (clen > k*BSIZE - sizeof(clen)) {
+        return -1;
+    }
+    int len = Llz4_decompress(zcache.packed + sizeof(clen), clen, zcache.data, sizeof(zcache.data));
+    if (len < 0) {
+        return -1;
+    }
+    Lmemset(zcache.data + len, 0, sizeof(zcache.data) - len);
+    zcache.addr = a[0];
+    return 1;
+}
+
+/*
+  Read n bytes at offset off of the file into dst; returns the number
+  read (less at the end of the file), or -1.  A block with no disk
+  address (a hole in a sparse file) reads as zeroes, without any I/O.
+  Compressed clusters of an I_LZ file are decompressed on the way, and
+  an I_INLINE file is read from the inode, with no I/O at all.
+*/
+int readi(struct dinode *ip, char *dst, uint off, uint n) {
+    if (off >= ip->size) {
+        return 0;
+    }
+    if (n > ip->size - off) {
+        n = ip->size - off;
+    }
+    if (ISINLINE(ip)) {
+        Lmemcpy(dst, (char *) ip->addrs + off, n);
+        return n;
+    }
+    for (uint tot = 0, m; tot < n; tot += m, off += m, dst += m) {
+        m = BSIZE - off % BSIZE;
+        if (m > n - tot) {
+            m = n - tot;
+        }
+        if (ISLZ(ip)) {
+            char *z;
+            int r = zcluster(ip, off / BSIZE / ZCLUSTER, &z);
+            if (r < 0) {
+                return -1;
+            }
+            if (r > 0) {
+                Lmemcpy(dst, z + off % (ZCLUSTER*BSIZE), m);
+                continue;
+            }
+        }
+        uint addr = bmap(ip, off / BSIZE, 0);
+        if (addr == 0) {
+            Lmemset(dst, 0, m);
+            continue;
+        }
+        struct buf *bp = bread(DEVFD, addr);
+        if (bp == 0) {
+            return -1;
+        }
+        Lmemcpy(dst, bp->data + off % BSIZE, m);
+        brelse(bp);
+    }
+    return n;
+}
+
+/* Does the file have no data and no blocks (fresh, or truncated)? */
+static int iempty(struct dinode *ip) {
+    if (ip->size != 0) {
+        return 0;
+    }
+    for (int i = 0; i <= NDIRECT; i++) {
+        if (ip->addrs[i] != 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+  Write n bytes from src at offset off of file inum (inode *ip),
+  allocating blocks as needed, and update its size.  Returns the
+  number written, which is short if the disk or the file is full.
+
+  A plain file that is still empty keeps writes that end within
+  INLINESIZE in the inode (I_INLINE); a write past that moves the
+  data out to a block first.
+*/
+int writei(struct dinode *ip, uint inum, const char *src, uint off, uint n) {
+    uint tot, m;
+
+    if (ip->type == T_FILE && !(ip->major & (I_LZ | I_INLINE))
+        && off + n <= INLINESIZE && iempty(ip)) {
+        ip->major |= I_INLINE;
+    }
+    if (ISINLINE(ip)) {
+        if (off + n <= INLINESIZE) {
+            Lmemcpy((char *) ip->addrs + off, src, n);
+            if (off + n > ip->size) {
+                ip->size = off + n;
+            }
+            iupdate(ip, inum);
+            return n;
+        }
+        /* Spill:  the data so far becomes the start of block 0 */
+        char data[INLINESIZE];
+        Lmemcpy(data, ip->addrs, INLINESIZE);
+        Lmemset(ip->addrs, 0, INLINESIZE);
+        ip->major &= ~I_INLINE;
+        uint addr = bmap(ip, 0, 1);
+        struct buf *bp = addr != 0 ? bnew(DEVFD, addr) : 0;
+        if (bp == 0) {
+            Lmemcpy(ip->addrs, data, INLINESIZE);   // Disk full:  stay inline
+            ip->major |= I_INLINE;
+            return 0;
+        }
+        Lmemcpy(bp->data, data, INLINESIZE);  // balloc() zeroed the rest
+        bp->dirty = 1;
+        bwrite(bp);
+        brelse(bp);
+    }
+
+    for (tot = 0; tot < n; tot += m, off += m, src += m) {
+        uint addr = bmap(ip, off / BSIZE, 1);
+        if (addr == 0) {
+            break;
+        }
+        m = BSIZE - off % BSIZE;
+        if (m > n - tot) {
+            m = n - tot;
+        }
+        /* A whole block is overwritten:  no need to read it first */
+        struct buf *bp = m == BSIZE ? bnew(DEVFD, addr) : bread(DEVFD, addr);
+        if (bp == 0) {
+            break;
+        }
+        Lmemcpy(bp->data + off % BSIZE, src, m);
+        bp->dirty = 1;
+        bwrite(bp);
+        brelse(bp);
+    }
+    if (off > ip->size) {
+        ip->size = off;
+    }
+    iupdate(ip, inum);
+    return tot;
+}
+
+/*
+  Free every data block of file inum and set its size to 0.
+*/
+void itrunc(struct dinode *ip, uint inum) {
+    if (ISINLINE(ip)) {
+        Lmemset(ip->addrs, 0, INLINESIZE);  // Data, not block numbers
+        ip->major &= ~I_INLINE;
+        ip->size = 0;
+        iupdate(ip, inum);
+        return;
+    }
+    dedup_counted();    // Now, before the indirect block is held
+    for (int i = 0; i < NDIRECT; i++) {
+        if (ip->addrs[i]) {
+            bfree(DEVFD, ip->addrs[i]);
+            ip->addrs[i] = 0;
+        }
+    }
+    if (ip->addrs[NDIRECT]) {
+        struct buf *bp = bread_meta(DEVFD, ip->addrs[NDIRECT], 1);
+        uint *a = (uint *) bp->data;
+        for (int j = 0; j < NINDIRECT; j++) {
+            if (a[j]) {
+                bfree(DEVFD, a[j]);
+            }
+        }
+        brelse(bp);
+        bfree(DEVFD, ip->addrs[NDIRECT]);
+        ip->addrs[NDIRECT] = 0;
+    }
+    ip->size = 0;
+    iupdate(ip, inum);
+}
+
+/* Is p[0..n) all zero bytes? */
+static int allzero(const char *p, uint n) {
+    return n == 0 || (p[0] == 0 && Lmemcmp(p, p + 1, n - 1) == 0);
+}
+
+/*
+  upload:  copy the file at path in the image to hostfile on the host.
+  Holes and all-zero blocks are skipped with a seek, so the host file
+  is sparse too.
+*/
+int upload(uint dirinum, const char *path, const char *hostfile) {
+    struct dinode inode;
+    uint inum = nameiat(dirinum, path);
+    if (inum == 0 || getinode(&inode, inum) == -1 || inode.type != T_FILE) {
+        return -1;
+    }
+    int fd = Lopen(hostfile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        return -1;
+    }
+    char *chunk = Larena_alloc(&cmdarena, BSIZE);
+    int n, rc = 0, seeked = 0;
+    for (uint off = 0; chunk != 0 && (n = readi(&inode, chunk, off, BSIZE)) > 0; off += n) {
+        if (allzero(chunk, n)) {
+            Llseek(fd, n, SEEK_CUR);
+            seeked = 1;
+            continue;
+        }
+        seeked = 0;
+        if (Lwrite(fd, chunk, n) != n) {
+            rc = -1;
+            break;
+        }
+    }
+    /* A trailing hole:  the seek alone does not extend the file */
+    if (seeked && rc == 0) {
+        Lsyscall(SYS_ftruncate, fd, inode.size);
+    }
+    Lclose(fd);
+    return chunk == 0 ? -1 : rc;
+}
+
+/* Read up to n bytes, stopping short only at the end of the file */
+static long readfull(int fd, char *buf, long n) {
+    long got = 0, r = 0;
+
+    while (got < n && (r = Lread(fd, buf + got, n - got)) > 0) {
+        got += r;
+    }
+    return got > 0 ? got : r;
+}
+
+/*
+  Write cluster src[0..n) of I_LZ file inum at off (a cluster
+  boundary):  compressed into z if that saves a block, else raw.
+*/
+static int zwrite(struct dinode *ip, uint inum, const char *src, uint off, uint n, char *z) {
+    uint nb = (n + BSIZE - 1) / BSIZE;
+    uint clen = 0;
+
+    if (nb > 1) {
+        clen = Llz4_compress(src, n, z + sizeof(clen), (nb - 1)*BSIZE - sizeof(clen));
+    }
+    if (clen > 0) {
+        Lmemcpy(z, &clen, sizeof(clen));
+        n = clen + sizeof(clen);
+        src = z;
+    }
+    return writei(ip, inum, src, off, n) == n ? 0 : -1;
+}
+
+/* Point file block bn of *ip at disk block addr; the caller iupdate()s */
+static int bset(struct dinode *ip, uint bn, uint addr) {
+    if (bn < NDIRECT) {
+        ip->addrs[bn] = addr;
+        return 0;
+    }
+    bn -= NDIRECT;
+    if (bn >= NINDIRECT) {
+        return -1;
+    }
+    if (ip->addrs[NDIRECT] == 0 && (ip->addrs[NDIRECT] = balloc(DEVFD)) == 0) {
+        return -1;
+    }
+    struct buf *bp = bread_meta(DEVFD, ip->addrs[NDIRECT], 1);
+    if (bp == 0) {
+        return -1;
+    }
+    ((uint *) bp->data)[bn] = addr;
+    bp->dirty = 1;
+    bwrite(bp);
+    brelse(bp);
+    return 0;
+}
+
+/*
+  Write block src[0..n) of file inum at off (a block boundary) for a
+  dedup download:  share a block with the same contents if there is
+  one, else write it and index it.  src holds BSIZE bytes.
+*/
+static int dedup_write(struct dinode *ip, uint inum, char *src, uint off, uint n) {
+    Lmemset(src + n, 0, BSIZE - n);     // As the block will read back
+    ulong h = blockhash(src);
+    uint addr = dedup_find(h, src);
+
+    if (addr != 0) {
+        sbflag(SB_SHARED);      // Before the first shared pointer exists
+        if (bset(ip, off / BSIZE, addr) < 0) {
+            return -1;
+        }
+        dd.refs[addr]++;
+        if (off + n > ip->size) {
+            ip->size = off + n;
+        }
+        STAT_INC(dedup_shared);
+        return 0;
+    }
+    if (writei(ip, inum, src, off, n) != n) {
+        return -1;
+    }
+    if ((addr = bmap(ip, off / BSIZE, 0)) != 0) {
+        dd.refs[addr] = 1;
+        if (dd.used >= (dd.mask + 1) / 4 * 3) {
+            dedup_reindex();    // Drop the entries of freed blocks
+        }
+        dedup_insert(h, addr);
+    }
+    return 0;
+}
+
+/*
+  download:  copy hostfile from the host to path in the image,
+  replacing the file there or creating it, with inode flags iflags
+  (I_LZ:  compressed) plus DL_DEDUP.  All-zero chunks are not written:
+  they stay holes, with no block allocated.
+*/
+int download(const char *hostfile, uint dirinum, const char *path, int iflags) {
+    char name[DIRSIZ+1] = {0};
+    struct dinode inode;
+    uint inum = nameiat(dirinum, path);
+
+    if (inum != 0) {
+        if (getinode(&inode, inum) == -1 || inode.type != T_FILE) {
+            return -1;
+        }
+    } else {
+        uint parent = nameiparentat(dirinum, path, name);
+        if (parent == 0 || name[0] == '\0') {
+            return -1;
+        }
+        if ((inum = createPath(parent, name)) == (uint) -1) {
+            return -1;
+        }
+        getinode(&inode, inum);
+    }
+    int fd = Lopen(hostfile, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    /* Compressed clusters are not shared */
+    int dedup = (iflags & DL_DEDUP) && !(iflags & I_LZ);
+    if (dedup && dedup_load(1) < 0) {
+        Lclose(fd);
+        return -1;
+    }
+    itrunc(&inode, inum);
+    inode.major = iflags & ~DL_DEDUP;
+
+    /* A compressed file is written a cluster at a time */
+    uint csize = (iflags & I_LZ) ? ZCLUSTER*BSIZE : BSIZE;
+    char *chunk = Larena_alloc(&cmdarena, csize);
+    char *z = Larena_alloc(&cmdarena, csize);
+    long n;
+    int rc = 0;
+    uint off = 0;
+    for (; chunk != 0 && z != 0 && (n = readfull(fd, chunk, csize)) > 0; off += n) {
+        if (allzero(chunk, n) && off / BSIZE < MAXFILE) {
+            continue;
+        }
+        if (off == 0 && n <= INLINESIZE) {
+            /* The whole file (readfull() came up short):  into the
+               inode, which neither compression nor sharing can beat */
+            inode.major &= ~I_LZ;
+            if (writei(&inode, inum, chunk, 0, n) != n) {
+                rc = -1;
+                break;
+            }
+            continue;
+        }
+        if ((iflags & I_LZ) ? zwrite(&inode, inum, chunk, off, n, z) < 0
+            : dedup ? dedup_write(&inode, inum, chunk, off, n) < 0
+            : writei(&inode, inum, chunk, off, n) != n) {
+            rc = -1; // Image (or file) full
+            break;
+        }
+    }
+    if (rc == 0) {
+        inode.size = off;   // May end in a hole, or a compressed cluster
+    }
+    iupdate(&inode, inum);  // Also keeps shared blocks of a partial file
+    Lclose(fd);
+    return chunk == 0 || z == 0 ? -1 : rc;
+}
+
+
+/*
+  Disk blocks of the file in file order, with the indirect block right
+  after the direct ones (where a sequential writer would have put it).
+  Holes are left out.  list must hold MAXFILE+1 entries; returns the
+  count.
+*/
+static int fileblocks(struct dinode *ip, uint *list) {
+  int n = 0;
+
+  if (ISINLINE(ip)) {
+    return 0;
+  }
+  for (int i = 0; i < NDIRECT; i++) {
+    if (ip->addrs[i]) {
+      list[n++] = ip->addrs[i];
+    }
+  }
+  if (ip->addrs[NDIRECT]) {
+    list[n++] = ip->addrs[NDIRECT];
+    struct buf *bp = bread(DEVFD, ip->addrs[NDIRECT]);
+    uint *a = (uint *) bp->data;
+    for (int j = 0; j < NINDIRECT; j++) {
+      if (a[j]) {
+        list[n++] = a[j];
+      }
+    }
+    brelse(bp);
+  }
+  return n;
+}
+
+/* Runs of consecutive block numbers in list[0..n) */
+static uint extents(uint *list, int n) {
+  uint e = n > 0;
+
+  for (int i = 1; i < n; i++) {
+    if (list[i] != list[i-1] + 1) {
+      e++;
+    }
+  }
+  return e;
+}
+
+/* First run of n free blocks in the bitmap, or 0 */
+static uint findrun(uint n) {
+  uint start = 0, len = 0;
+
+  for (uint b = 0; b < SB.size; b += BPB) {
+    struct buf *bp = bread(DEVFD, BBLOCK(b, SB));
+    for (uint bi = 0; bi < BPB && b + bi < SB.size; bi++) {
+      STAT_INC(balloc_probes);
+      if (bp->data[bi/8] & (1 << (bi % 8))) {
+        len = 0;
+        continue;
+      }
+      if (len++ == 0) {
+        start = b + bi;
+      }
+      if (len == n) {
+        brelse(bp);
+        return start;
+      }
+    }
+    brelse(bp);
+  }
+  return 0;
+}
+
+/* Mark blocks start..start+n-1 in use, one bitmap write per bitmap block */
+static void allocrun(uint start, uint n) {
+  fsum_unclean();
+  for (uint b = start; b < start + n; ) {
+    struct buf *bp = bread(DEVFD, BBLOCK(b, SB));
+    do {
+      uint bi = b % BPB;
+      bp->data[bi/8] |= 1 << (bi % 8);
+      b++;
+    } while (b < start + n && b % BPB != 0);
+    bp->dirty = 1;
+    bwrite(bp);
+    brelse(bp);
+  }
+  fsum_change(-(int) n, 0);
+}
+
+/* Give back a run from allocrun() that relocate() could not fill */
+static void freerun(uint start, uint n) {
+  for (uint b = start; b < start + n; b++) {
+    bfree(DEVFD, b);
+  }
+}
+
+/*
+  Move the n blocks list[] of file inum (inode *ip, as fileblocks()
+  gave them) to the free run at start.  Blocks are copied through the
+  cache DEFRAG_BATCH at a time, and each batch goes out as one
+  vectored write.  The new indirect block gets the new addresses.
+
+  Nothing points at the new blocks until the one iupdate() at the
+  end, so that single inode write is what switches the file over:  a
+  crash before it leaves the file as it was (and the run allocated but
+  unused), a crash after it leaves the old blocks allocated but
+  unused.  Only then are the old blocks freed.  If a copy fails, the
+  run is freed again and the file keeps its old blocks.
+*/
+#define DEFRAG_BATCH 8
+
+static int relocate(struct dinode *ip, uint inum, uint *list, int n, uint start) {
+  struct buf *batch[DEFRAG_BATCH];
+  int ind = -1;     // Index of the indirect block in list[]
+
+  if (ip->addrs[NDIRECT]) {
+    ind = 0;
+    for (int i = 0; i < NDIRECT; i++) {
+      ind += ip->addrs[i] != 0;
+    }
+  }
+
+  allocrun(start, n);
+  for (int i = 0; i < n; i += DEFRAG_BATCH) {
+    int m = n - i < DEFRAG_BATCH ? n - i : DEFRAG_BATCH;
+    for (int j = 0; j < m; j++) {
+      struct buf *ob = bread(DEVFD, list[i+j]);
+      struct buf *nb = bnew(DEVFD, start + i + j);
+      if (ob == 0 || nb == 0) {
+        if (ob != 0) {
+          brelse(ob);
+        }
+        if (nb != 0) {
+          brelse(nb);
+        }
+        while (j-- > 0) {
+          batch[j]->dirty = 0;
+          brelse(batch[j]);
+        }
+        freerun(start, n);
+        return -1;
+      }
+      Lmemcpy(nb->data, ob->data, BSIZE);
+      brelse(ob);
+      if (i + j == ind) {
+        /* Its k-th nonzero entry is list[ind+1+k], now at start+ind+1+k */
+        uint *a = (uint *) nb->data;
+        for (int k = 0, next = ind + 1; k < NINDIRECT; k++) {
+          if (a[k]) {
+            a[k] = start + next++;
+          }
+        }
+      }
+      nb->dirty = 1;
+      batch[j] = nb;
+    }
+    disk_block_rw_batch(batch, m, 1);
+    int failed = 0;
+    for (int j = 0; j < m; j++) {
+      failed |= batch[j]->disk_rw_fail;
+      batch[j]->dirty = 0;
+      brelse(batch[j]);
+    }
+    if (failed) {
+      freerun(start, n);
+      return -1;  /* The file still uses its old blocks */
+    }
+  }
+
+  /* The switch:  same order as fileblocks().  With write-back, the
+     run's bitmap bits go out before the inode, and the inode before
+     the old blocks' bits are cleared. */
+  bflush();
+  int next = 0;
+  for (int i = 0; i < NDIRECT; i++) {
+    if (ip->addrs[i]) {
+      ip->addrs[i] = start + next++;
+    }
+  }
+  if (ip->addrs[NDIRECT]) {
+    ip->addrs[NDIRECT] = start + next;
+  }
+  iupdate(ip, inum);
+  bflush();
+
+  for (int i = 0; i < n; i++) {
+    bfree(DEVFD, list[i]);
+  }
+  return 0;
+}
+
+/* Is one of the n blocks list[] shared with another file? */
+static int shared(uint *list, int n) {
+  for (int i = 0; dd.refs != 0 && i < n; i++) {
+    if (dd.refs[list[i]] > 1) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/*
+  Fragmentation of every file and directory and, with apply, move each
+  fragmented one into a single run of free blocks (first fit).  Files
+  for which no long enough run is free are left where they are, and so
+  are files with shared blocks:  moving those would unshare them.
+*/
+void defrag(int apply, struct fragstat *fs) {
+  uint list[MAXFILE + 1];
+
+  Lmemset(fs, 0, sizeof(*fs));
+  if (apply && dedup_counted() < 0) {
+    apply = 0;      // Shared blocks cannot be told apart
+  }
+  for (uint inum = 1; inum < SB.ninodes; inum++) {
+    struct dinode inode;
+    if (getinode(&inode, inum) == -1 || (inode.type != T_FILE && inode.type != T_DIR)) {
+      continue;
+    }
+    int n = fileblocks(&inode, list);
+    uint e = extents(list, n);
+    if (n == 0) {
+      continue;
+    }
+    fs->files++;
+    fs->blocks += n;
+    if (e > 1 && apply) {
+      uint start = shared(list, n) ? 0 : findrun(n);
+      if (start != 0 && relocate(&inode, inum, list, n, start) == 0) {
+        fs->moved++;
+        e = 1;
+      } else {
+        fs->stuck++;
+      }
+    }
+    fs->extents += e;
+    if (e > 1) {
+      fs->fragmented++;
+    }
+  }
+}
@@ -16,6 +16,15 @@ int getinode(struct dinode *inode,  uint inodenum);
 */
 
 
+int getinodes(const uint *inums, int n, struct dinode *inodes);
+/*
+  getinode() for n inodes at once, reading each inode block only once
+  (the listing commands stat a whole directory this way).  Inodes
+  that are free or unreadable come back with type 0.  Return 0, or -1
+  if some could not be read.
+*/
+
+
 uint find_name_in_dirblock(uint blockptr, const char *nam);
 /* 
   Assuming that blockptr points to a block of some directory file,
@@ -41,12 +50,24 @@ uint find_dent(uint inum, const char *name);
 
 uint namei(const char *pathname);
 /*
-  Convert pathname to inode number (as in class/quiz).
+  Convert pathname to inode number (as in class/quiz).  It starts at
+  the root; nameiat() below starts a relative pathname elsewhere.
 
   A fundamental filesystem algorithm!
 */
 
 
+uint nameiat(uint dirinum, const char *pathname);
+uint nameiparentat(uint dirinum, const char *pathname, char *name);
+/*
+  namei() and dirWithFileToRm() from directory dirinum instead of the
+  root (an absolute pathname still starts at the root).  "." and ".."
+  and repeated slashes are handled as in xv6.  Lcli passes the CWD's
+  inode (cwdinum()); the other functions that take a dirinum below
+  treat it the same way.
+*/
+
+
 void lsdir(uint blockptr);
 /*
   Print the list of directory entries in the block pointed to by blockptr.
@@ -59,6 +80,7 @@ void lsdir(uint blockptr);
 
 
 int lspath(const char *pathname);
+int lspathat(uint dirinum, const char *pathname);
 /*
   If pathname is a directory, list its contents.
 
@@ -68,11 +90,86 @@ int lspath(const char *pathname);
 
 uint cd(uint inum, const char *name);
 int unlink(const char *pathname);
+int unlinkin(uint dirinum, const char *pathname);
 uint dirWithFileToRm(const char *pathname, char *name);
 int link(const char *pathname, const char *pathname2);
+int linkin(uint dirinum, const char *pathname, const char *pathname2);
+int dirlink(uint dirinum, const char *name, uint inum);
 uint createPath(uint inum, const char *name);
 void sync();
 uint balloc(int dev);
 int iupdate(struct dinode *inode, uint inum);
 uint ialloc(uint dev, int type);
 uint mkdir(const char* path);
+uint mkdirat(uint parentInum, const char *name);
+int lsrecursive(uint inum, const char *path);
+void bfree(int dev, uint b);
+
+int createmany(uint dirinum, char **names, int n, uint *inums);
+uint mkdirs(uint dirinum, const char *path);
+int removetree(uint dirinum, const char *pathname);
+/*
+  Bulk forms of creat, mkdir and unlink (creat a b c, mkdir -p, rm -r).
+  createmany makes n empty files in one directory with one pass over
+  it and one write per directory and inode block touched; inums[i] is
+  0 for a name it skipped.  It returns the number created.  mkdirs
+  makes the missing directories along path.  removetree removes a
+  file, or a directory with everything below it.  -1 on error.
+*/
+
+uint bmap(struct dinode *ip, uint bn, int alloc);
+int readi(struct dinode *ip, char *dst, uint off, uint n);
+int writei(struct dinode *ip, uint inum, const char *src, uint off, uint n);
+void itrunc(struct dinode *ip, uint inum);
+/*
+  File contents, as in xv6 (bmap, readi, writei, itrunc) but on a
+  caller-held copy of the dinode:  writei and itrunc write it back
+  with iupdate().
+*/
+
+int upload(uint dirinum, const char *path, const char *hostfile);
+int download(const char *hostfile, uint dirinum, const char *path, int iflags);
+/*
+  Copy a whole file out of / into the image.  Return 0 or -1.
+  download gives the file inode flags iflags (I_LZ:  compressed).
+  With DL_DEDUP, blocks identical to ones already in the image are
+  shared instead of written (not for I_LZ files).
+*/
+#define DL_DEDUP 0x100
+
+
+struct fsusage {
+  uint blocks;        // Data blocks
+  uint bfree;         // ... of which free
+  uint inodes;        // Inodes that can be allocated (not inode 0)
+  uint ifree;         // ... of which free
+};
+
+int fsum_load(int scan);
+int fsusage(struct fsusage *u);
+/*
+  Free block and inode counts (df).  fsum_load(), at mount, takes
+  them from the superblock if the last session saved them with
+  sync(); else, with scan, it counts the bitmap and inode table once,
+  on a few threads (mount leaves that to the first df).  From then on
+  the allocators keep them current, so fsusage() is O(1).  Return 0,
+  or -1 if the counts are not loaded.
+*/
+
+
+struct fragstat {
+  uint files;         // Files and directories with data blocks
+  uint fragmented;    // ... in more than one run of blocks
+  uint blocks;        // Data and indirect blocks
+  uint extents;       // Runs of consecutive blocks, over all files
+  uint moved;         // Made contiguous by this pass
+  uint stuck;         // Fragmented, but no free run was long enough,
+                      // or it has shared blocks
+};
+
+void defrag(int apply, struct fragstat *fs);
+/*
+  Measure fragmentation into *fs and, with apply, relocate fragmented
+  files and directories into contiguous runs.  extents == files means
+  every file is contiguous.
+*/